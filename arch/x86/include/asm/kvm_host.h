@@ -45,8 +45,13 @@
 
 #define KVM_PIO_PAGE_OFFSET 1
 #define KVM_COALESCED_MMIO_PAGE_OFFSET 2
+/* Room for a full PML buffer flushed into the dirty ring on vmexit */
+#define KVM_DIRTY_RING_ARCH_RSVD_ENTRIES 512
 #define KVM_HALT_POLL_NS_DEFAULT 200000
 
+/* TDP faults may install leaf sptes with mmu_lock held for read */
+#define KVM_HAVE_MMU_RWLOCK
+
 #define KVM_IRQCHIP_NUM_PINS  KVM_IOAPIC_NUM_PINS
 
 #define CR0_RESERVED_BITS                                               \
@@ -650,6 +655,11 @@ struct kvm_arch {
 	 */
 	struct list_head active_mmu_pages;
 	struct list_head zapped_obsolete_pages;
+	/*
+	 * Serializes rmap updates by TDP faults that hold mmu_lock for
+	 * read; writers of mmu_lock need not take it.
+	 */
+	spinlock_t mmu_rmap_lock;
 	struct kvm_page_track_notifier_node mmu_sp_tracker;
 	struct kvm_page_track_notifier_head track_notifier_head;
 
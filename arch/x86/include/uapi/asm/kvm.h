@@ -355,4 +355,6 @@ struct kvm_sync_regs {
 #define KVM_X86_QUIRK_LINT0_REENABLED	(1 << 0)
 #define KVM_X86_QUIRK_CD_NW_CLEARED	(1 << 1)
 
+#define KVM_DIRTY_LOG_PAGE_OFFSET 64
+
 #endif /* _ASM_X86_KVM_H */
@@ -13,18 +13,34 @@
 #include <linux/idr.h>
 #include <linux/blk-mq.h>
 #include <linux/numa.h>
+#include <linux/highmem.h>
+#include <linux/irq_poll.h>
 
 #define PART_BITS 4
 #define VQ_NAME_LEN 16
 
+/* Completions reaped per irq_poll run on a polled queue */
+#define VIRTBLK_POLL_WEIGHT 64
+
 static int major;
 static DEFINE_IDA(vd_index_ida);
 
 static struct workqueue_struct *virtblk_wq;
 
+/*
+ * Number of request queues whose completions are reaped by irq_poll in
+ * softirq context instead of straight from the interrupt handler.
+ */
+static unsigned int poll_queues;
+module_param(poll_queues, uint, 0444);
+MODULE_PARM_DESC(poll_queues, "Number of request queues to complete in poll mode");
+
 struct virtio_blk_vq {
 	struct virtqueue *vq;
 	spinlock_t lock;
+	/* Only used on queues below poll_queues, see virtblk_poll() */
+	bool poll;
+	struct irq_poll iop;
 	char name[VQ_NAME_LEN];
 } ____cacheline_aligned_in_smp;
 
@@ -49,12 +65,17 @@ struct virtio_blk {
 	/* num of vqs */
 	int num_vqs;
 	struct virtio_blk_vq *vqs;
+
+	/* Host may deallocate the sectors of a write zeroes request */
+	bool write_zeroes_unmap;
 };
 
 struct virtblk_req {
 	struct request *req;
 	struct virtio_blk_outhdr out_hdr;
 	struct virtio_scsi_inhdr in_hdr;
+	/* Payload of discard and write zeroes requests */
+	struct virtio_blk_discard_write_zeroes range;
 	u8 status;
 	struct scatterlist sg[];
 };
@@ -131,6 +152,45 @@ static inline void virtblk_request_done(struct request *req)
 	blk_mq_end_request(req, error);
 }
 
+/*
+ * Reap up to @budget completions of a polled queue.  The virtqueue
+ * callback stays disabled until a run finds fewer than @budget, so a
+ * burst of completions costs a single interrupt.
+ */
+static int virtblk_poll(struct irq_poll *iop, int budget)
+{
+	struct virtio_blk_vq *vbq = container_of(iop, struct virtio_blk_vq, iop);
+	struct virtio_blk *vblk = vbq->vq->vdev->priv;
+	struct virtblk_req *vbr;
+	unsigned long flags;
+	unsigned int len;
+	int done = 0;
+
+	spin_lock_irqsave(&vbq->lock, flags);
+	while (done < budget &&
+	       (vbr = virtqueue_get_buf(vbq->vq, &len)) != NULL) {
+		blk_mq_complete_request(vbr->req, vbr->req->errors);
+		done++;
+	}
+
+	if (done < budget) {
+		irq_poll_complete(iop);
+		/* Completions that raced with re-enabling get another run. */
+		if (!virtqueue_enable_cb(vbq->vq) &&
+		    !virtqueue_is_broken(vbq->vq)) {
+			virtqueue_disable_cb(vbq->vq);
+			irq_poll_sched(iop);
+		}
+	}
+
+	/* In case queue is stopped waiting for more buffers. */
+	if (done)
+		blk_mq_start_stopped_hw_queues(vblk->disk->queue, true);
+	spin_unlock_irqrestore(&vbq->lock, flags);
+
+	return done;
+}
+
 static void virtblk_done(struct virtqueue *vq)
 {
 	struct virtio_blk *vblk = vq->vdev->priv;
@@ -140,6 +200,12 @@ static void virtblk_done(struct virtqueue *vq)
 	unsigned long flags;
 	unsigned int len;
 
+	if (vblk->vqs[qid].poll) {
+		virtqueue_disable_cb(vq);
+		irq_poll_sched(&vblk->vqs[qid].iop);
+		return;
+	}
+
 	spin_lock_irqsave(&vblk->vqs[qid].lock, flags);
 	do {
 		virtqueue_disable_cb(vq);
@@ -157,12 +223,51 @@ static void virtblk_done(struct virtqueue *vq)
 	spin_unlock_irqrestore(&vblk->vqs[qid].lock, flags);
 }
 
+/*
+ * Write same is only advertised when the host supports write zeroes, and
+ * blkdev_issue_zeroout() is its only user that matters; anything else
+ * has to carry an all-zero block to be sent as write zeroes.
+ */
+static bool virtblk_write_same_is_zeroes(struct request *req)
+{
+	struct bio_vec *bv = bio_iovec(req->bio);
+	bool zeroes;
+	void *p;
+
+	if (bv->bv_page == ZERO_PAGE(0))
+		return true;
+
+	p = kmap_atomic(bv->bv_page);
+	zeroes = !memchr_inv(p + bv->bv_offset, 0, bv->bv_len);
+	kunmap_atomic(p);
+
+	return zeroes;
+}
+
+/*
+ * Discard and write same bios are only merged when they are contiguous,
+ * and the queue limits keep the request within one device segment, so
+ * the whole request always goes out as a single range.
+ */
+static void virtblk_setup_discard_write_zeroes(struct virtblk_req *vbr,
+					       bool unmap)
+{
+	struct request *req = vbr->req;
+
+	vbr->range.sector = cpu_to_le64(blk_rq_pos(req));
+	vbr->range.num_sectors = cpu_to_le32(blk_rq_sectors(req));
+	vbr->range.flags = unmap ?
+		cpu_to_le32(VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) : 0;
+}
+
 static int virtio_queue_rq(struct blk_mq_hw_ctx *hctx,
 			   const struct blk_mq_queue_data *bd)
 {
 	struct virtio_blk *vblk = hctx->queue->queuedata;
 	struct request *req = bd->rq;
 	struct virtblk_req *vbr = blk_mq_rq_to_pdu(req);
+	struct scatterlist range_sg, *data_sg = vbr->sg;
+	bool range = false;
 	unsigned long flags;
 	unsigned int num;
 	int qid = hctx->queue_num;
@@ -176,6 +281,16 @@ static int virtio_queue_rq(struct blk_mq_hw_ctx *hctx,
 		vbr->out_hdr.type = cpu_to_virtio32(vblk->vdev, VIRTIO_BLK_T_FLUSH);
 		vbr->out_hdr.sector = 0;
 		vbr->out_hdr.ioprio = cpu_to_virtio32(vblk->vdev, req_get_ioprio(vbr->req));
+	} else if (req->cmd_flags & REQ_DISCARD) {
+		vbr->out_hdr.type = cpu_to_virtio32(vblk->vdev, VIRTIO_BLK_T_DISCARD);
+		vbr->out_hdr.sector = 0;
+		vbr->out_hdr.ioprio = cpu_to_virtio32(vblk->vdev, req_get_ioprio(vbr->req));
+		range = true;
+	} else if (req->cmd_flags & REQ_WRITE_SAME) {
+		vbr->out_hdr.type = cpu_to_virtio32(vblk->vdev, VIRTIO_BLK_T_WRITE_ZEROES);
+		vbr->out_hdr.sector = 0;
+		vbr->out_hdr.ioprio = cpu_to_virtio32(vblk->vdev, req_get_ioprio(vbr->req));
+		range = true;
 	} else {
 		switch (req->cmd_type) {
 		case REQ_TYPE_FS:
@@ -201,16 +316,30 @@ static int virtio_queue_rq(struct blk_mq_hw_ctx *hctx,
 
 	blk_mq_start_request(req);
 
-	num = blk_rq_map_sg(hctx->queue, vbr->req, vbr->sg);
-	if (num) {
-		if (rq_data_dir(vbr->req) == WRITE)
-			vbr->out_hdr.type |= cpu_to_virtio32(vblk->vdev, VIRTIO_BLK_T_OUT);
-		else
-			vbr->out_hdr.type |= cpu_to_virtio32(vblk->vdev, VIRTIO_BLK_T_IN);
+	if (range) {
+		/* Both command types already have VIRTIO_BLK_T_OUT set. */
+		if ((req->cmd_flags & REQ_WRITE_SAME) &&
+		    !virtblk_write_same_is_zeroes(req))
+			return BLK_MQ_RQ_QUEUE_ERROR;
+
+		virtblk_setup_discard_write_zeroes(vbr,
+			(req->cmd_flags & REQ_WRITE_SAME) &&
+			vblk->write_zeroes_unmap);
+		sg_init_one(&range_sg, &vbr->range, sizeof(vbr->range));
+		data_sg = &range_sg;
+		num = 1;
+	} else {
+		num = blk_rq_map_sg(hctx->queue, vbr->req, vbr->sg);
+		if (num) {
+			if (rq_data_dir(vbr->req) == WRITE)
+				vbr->out_hdr.type |= cpu_to_virtio32(vblk->vdev, VIRTIO_BLK_T_OUT);
+			else
+				vbr->out_hdr.type |= cpu_to_virtio32(vblk->vdev, VIRTIO_BLK_T_IN);
+		}
 	}
 
 	spin_lock_irqsave(&vblk->vqs[qid].lock, flags);
-	err = __virtblk_add_req(vblk->vqs[qid].vq, vbr, vbr->sg, num);
+	err = __virtblk_add_req(vblk->vqs[qid].vq, vbr, data_sg, num);
 	if (err) {
 		virtqueue_kick(vblk->vqs[qid].vq);
 		blk_mq_stop_hw_queue(hctx);
@@ -424,6 +553,10 @@ static int init_vq(struct virtio_blk *vblk)
 	for (i = 0; i < num_vqs; i++) {
 		spin_lock_init(&vblk->vqs[i].lock);
 		vblk->vqs[i].vq = vqs[i];
+		vblk->vqs[i].poll = i < poll_queues;
+		if (vblk->vqs[i].poll)
+			irq_poll_init(&vblk->vqs[i].iop, VIRTBLK_POLL_WEIGHT,
+				      virtblk_poll);
 	}
 	vblk->num_vqs = num_vqs;
 
@@ -603,6 +736,7 @@ static int virtblk_probe(struct virtio_device *vdev)
 
 	vblk->vdev = vdev;
 	vblk->sg_elems = sg_elems;
+	vblk->write_zeroes_unmap = false;
 
 	INIT_WORK(&vblk->config_work, virtblk_config_changed_work);
 
@@ -729,6 +863,35 @@ static int virtblk_probe(struct virtio_device *vdev)
 	if (!err && opt_io_size)
 		blk_queue_io_opt(q, blk_size * opt_io_size);
 
+	if (virtio_has_feature(vdev, VIRTIO_BLK_F_DISCARD)) {
+		virtio_cread(vdev, struct virtio_blk_config,
+			     discard_sector_alignment, &v);
+		q->limits.discard_granularity = v ? v << 9 : blk_size;
+
+		virtio_cread(vdev, struct virtio_blk_config,
+			     max_discard_sectors, &v);
+		blk_queue_max_discard_sectors(q, v ? v : UINT_MAX);
+		queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, q);
+	}
+
+	/* Write zeroes is reached through write same of the zero page. */
+	if (virtio_has_feature(vdev, VIRTIO_BLK_F_WRITE_ZEROES)) {
+		u8 may_unmap;
+
+		/*
+		 * blkdev_issue_write_same() sizes its bios in bytes in 32
+		 * bits, so keep the limit within what that can express.
+		 */
+		virtio_cread(vdev, struct virtio_blk_config,
+			     max_write_zeroes_sectors, &v);
+		blk_queue_max_write_same_sectors(q,
+				min_t(u32, v ? v : UINT_MAX, UINT_MAX >> 9));
+
+		virtio_cread(vdev, struct virtio_blk_config,
+			     write_zeroes_may_unmap, &may_unmap);
+		vblk->write_zeroes_unmap = may_unmap;
+	}
+
 	virtio_device_ready(vdev);
 
 	add_disk(vblk->disk);
@@ -763,6 +926,15 @@ out:
 	return err;
 }
 
+static void virtblk_disable_poll(struct virtio_blk *vblk)
+{
+	int i;
+
+	for (i = 0; i < vblk->num_vqs; i++)
+		if (vblk->vqs[i].poll)
+			irq_poll_disable(&vblk->vqs[i].iop);
+}
+
 static void virtblk_remove(struct virtio_device *vdev)
 {
 	struct virtio_blk *vblk = vdev->priv;
@@ -779,6 +951,7 @@ static void virtblk_remove(struct virtio_device *vdev)
 
 	/* Stop all the virtqueues. */
 	vdev->config->reset(vdev);
+	virtblk_disable_poll(vblk);
 
 	refc = atomic_read(&disk_to_dev(vblk->disk)->kobj.kref.refcount);
 	put_disk(vblk->disk);
@@ -798,6 +971,7 @@ static int virtblk_freeze(struct virtio_device *vdev)
 
 	/* Ensure we don't receive any more interrupts */
 	vdev->config->reset(vdev);
+	virtblk_disable_poll(vblk);
 
 	/* Make sure no work handler is accessing the device. */
 	flush_work(&vblk->config_work);
@@ -833,14 +1007,14 @@ static unsigned int features_legacy[] = {
 	VIRTIO_BLK_F_SEG_MAX, VIRTIO_BLK_F_SIZE_MAX, VIRTIO_BLK_F_GEOMETRY,
 	VIRTIO_BLK_F_RO, VIRTIO_BLK_F_BLK_SIZE, VIRTIO_BLK_F_SCSI,
 	VIRTIO_BLK_F_WCE, VIRTIO_BLK_F_TOPOLOGY, VIRTIO_BLK_F_CONFIG_WCE,
-	VIRTIO_BLK_F_MQ,
+	VIRTIO_BLK_F_MQ, VIRTIO_BLK_F_DISCARD, VIRTIO_BLK_F_WRITE_ZEROES,
 }
 ;
 static unsigned int features[] = {
 	VIRTIO_BLK_F_SEG_MAX, VIRTIO_BLK_F_SIZE_MAX, VIRTIO_BLK_F_GEOMETRY,
 	VIRTIO_BLK_F_RO, VIRTIO_BLK_F_BLK_SIZE,
 	VIRTIO_BLK_F_WCE, VIRTIO_BLK_F_TOPOLOGY, VIRTIO_BLK_F_CONFIG_WCE,
-	VIRTIO_BLK_F_MQ,
+	VIRTIO_BLK_F_MQ, VIRTIO_BLK_F_DISCARD, VIRTIO_BLK_F_WRITE_ZEROES,
 };
 
 static struct virtio_driver virtio_blk = {
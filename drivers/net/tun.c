@@ -113,7 +113,7 @@ do {								\
 #define TUN_VNET_BE     0x40000000
 
 #define TUN_FEATURES (IFF_NO_PI | IFF_ONE_QUEUE | IFF_VNET_HDR | \
-		      IFF_MULTI_QUEUE)
+		      IFF_MULTI_QUEUE | IFF_NAPI | IFF_NAPI_FRAGS)
 #define GOODCOPY_LEN 128
 
 #define FLT_EXACT_COUNT 8
@@ -168,6 +168,11 @@ struct tun_file {
 	struct list_head next;
 	struct tun_struct *detached;
 	struct skb_array tx_array;
+	struct napi_struct napi;
+	bool napi_enabled;
+	bool napi_frags_enabled;
+	/* serializes writers building napi.skb in IFF_NAPI_FRAGS mode */
+	struct mutex napi_mutex;
 };
 
 struct tun_flow_entry {
@@ -484,6 +489,90 @@ static void tun_set_real_num_queues(struct tun_struct *tun)
 	netif_set_real_num_rx_queues(tun->dev, tun->numqueues);
 }
 
+/* IFF_NAPI: packets written by userspace are queued on sk_write_queue and
+ * fed to GRO from the queue's NAPI context instead of netif_rx_ni().
+ */
+static int tun_napi_receive(struct napi_struct *napi, int budget)
+{
+	struct tun_file *tfile = container_of(napi, struct tun_file, napi);
+	struct sk_buff_head *queue = &tfile->sk.sk_write_queue;
+	struct sk_buff_head process_queue;
+	struct sk_buff *skb;
+	int received = 0;
+
+	__skb_queue_head_init(&process_queue);
+
+	spin_lock(&queue->lock);
+	skb_queue_splice_tail_init(queue, &process_queue);
+	spin_unlock(&queue->lock);
+
+	while (received < budget && (skb = __skb_dequeue(&process_queue))) {
+		napi_gro_receive(napi, skb);
+		++received;
+	}
+
+	if (!skb_queue_empty(&process_queue)) {
+		spin_lock(&queue->lock);
+		skb_queue_splice(&process_queue, queue);
+		spin_unlock(&queue->lock);
+	}
+
+	return received;
+}
+
+static int tun_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct tun_file *tfile = container_of(napi, struct tun_file, napi);
+	int received;
+
+	received = tun_napi_receive(napi, budget);
+
+	if (received < budget) {
+		napi_complete_done(napi, received);
+		/* A writer that queued after the splice above saw us still
+		 * scheduled and did not reschedule; pick its packet up.
+		 */
+		smp_mb();
+		if (!skb_queue_empty(&tfile->sk.sk_write_queue))
+			napi_schedule(napi);
+	}
+
+	return received;
+}
+
+static void tun_napi_init(struct tun_struct *tun, struct tun_file *tfile,
+			  bool napi_en, bool napi_frags)
+{
+	tfile->napi_enabled = napi_en;
+	tfile->napi_frags_enabled = napi_en && napi_frags;
+	if (napi_en) {
+		netif_napi_add(tun->dev, &tfile->napi, tun_napi_poll,
+			       NAPI_POLL_WEIGHT);
+		napi_enable(&tfile->napi);
+	}
+}
+
+static void tun_napi_disable(struct tun_file *tfile)
+{
+	if (tfile->napi_enabled)
+		napi_disable(&tfile->napi);
+}
+
+static void tun_napi_del(struct tun_file *tfile)
+{
+	if (tfile->napi_enabled)
+		netif_napi_del(&tfile->napi);
+}
+
+/* IFF_NAPI_FRAGS: hand the packets GRO is holding on to the stack. */
+static void tun_napi_frags_flush(struct tun_file *tfile)
+{
+	local_bh_disable();
+	if (napi_schedule_prep(&tfile->napi))
+		napi_complete(&tfile->napi);
+	local_bh_enable();
+}
+
 static void tun_disable_queue(struct tun_struct *tun, struct tun_file *tfile)
 {
 	tfile->detached = tun;
@@ -518,6 +607,11 @@ static void __tun_detach(struct tun_file *tfile, bool clean)
 
 	tun = rtnl_dereference(tfile->tun);
 
+	if (tun && clean) {
+		tun_napi_disable(tfile);
+		tun_napi_del(tfile);
+	}
+
 	if (tun && !tfile->detached) {
 		u16 index = tfile->queue_index;
 		BUG_ON(index >= tun->numqueues);
@@ -578,11 +672,13 @@ static void tun_detach_all(struct net_device *dev)
 	for (i = 0; i < n; i++) {
 		tfile = rtnl_dereference(tun->tfiles[i]);
 		BUG_ON(!tfile);
+		tun_napi_disable(tfile);
 		wake_up_all(&tfile->wq.wait);
 		rcu_assign_pointer(tfile->tun, NULL);
 		--tun->numqueues;
 	}
 	list_for_each_entry(tfile, &tun->disabled, next) {
+		tun_napi_disable(tfile);
 		wake_up_all(&tfile->wq.wait);
 		rcu_assign_pointer(tfile->tun, NULL);
 	}
@@ -591,11 +687,13 @@ static void tun_detach_all(struct net_device *dev)
 	synchronize_net();
 	for (i = 0; i < n; i++) {
 		tfile = rtnl_dereference(tun->tfiles[i]);
+		tun_napi_del(tfile);
 		/* Drop read queue */
 		tun_queue_purge(tfile);
 		sock_put(&tfile->sk);
 	}
 	list_for_each_entry_safe(tfile, tmp, &tun->disabled, next) {
+		tun_napi_del(tfile);
 		tun_enable_queue(tfile);
 		tun_queue_purge(tfile);
 		sock_put(&tfile->sk);
@@ -606,7 +704,8 @@ static void tun_detach_all(struct net_device *dev)
 		module_put(THIS_MODULE);
 }
 
-static int tun_attach(struct tun_struct *tun, struct file *file, bool skip_filter)
+static int tun_attach(struct tun_struct *tun, struct file *file,
+		      bool skip_filter, bool napi, bool napi_frags)
 {
 	struct tun_file *tfile = file->private_data;
 	struct net_device *dev = tun->dev;
@@ -649,10 +748,12 @@ static int tun_attach(struct tun_struct *tun, struct file *file, bool skip_filte
 	rcu_assign_pointer(tun->tfiles[tun->numqueues], tfile);
 	tun->numqueues++;
 
-	if (tfile->detached)
+	if (tfile->detached) {
 		tun_enable_queue(tfile);
-	else
+	} else {
 		sock_hold(&tfile->sk);
+		tun_napi_init(tun, tfile, napi, napi_frags);
+	}
 
 	tun_set_real_num_queues(tun);
 
@@ -1122,6 +1223,61 @@ static struct sk_buff *tun_alloc_skb(struct tun_file *tfile,
 	return skb;
 }
 
+/* IFF_NAPI_FRAGS: build the packet in the queue's napi->skb, with up to
+ * @linear bytes in the head and the rest in page fragments, so that
+ * napi_gro_frags() can merge it without copying it again.  Called with
+ * napi_mutex held.
+ */
+static struct sk_buff *tun_napi_alloc_frags(struct tun_file *tfile,
+					    size_t len, size_t linear)
+{
+	struct sk_buff *skb;
+	size_t fragsz;
+	int i = 0;
+
+	local_bh_disable();
+	skb = napi_get_frags(&tfile->napi);
+	local_bh_enable();
+	if (!skb)
+		return ERR_PTR(-ENOMEM);
+
+	linear = min_t(size_t, linear, skb_tailroom(skb));
+	skb_put(skb, linear);
+
+	for (len -= linear; len; len -= fragsz) {
+		struct page *page;
+		void *frag;
+
+		fragsz = min_t(size_t, len, PAGE_SIZE);
+		frag = netdev_alloc_frag(fragsz);
+		if (!frag) {
+			napi_free_frags(&tfile->napi);
+			return ERR_PTR(-ENOMEM);
+		}
+
+		page = virt_to_head_page(frag);
+		skb_fill_page_desc(skb, i++, page, frag - page_address(page),
+				   fragsz);
+		skb->len += fragsz;
+		skb->data_len += fragsz;
+		skb->truesize += fragsz;
+	}
+
+	return skb;
+}
+
+static void tun_drop_skb(struct tun_file *tfile, struct sk_buff *skb,
+			 bool frags)
+{
+	if (frags) {
+		/* skb is tfile->napi.skb */
+		napi_free_frags(&tfile->napi);
+		mutex_unlock(&tfile->napi_mutex);
+	} else {
+		kfree_skb(skb);
+	}
+}
+
 /* set skb frags from iovec, this can move to core network code for reuse */
 static int zerocopy_sg_from_iovec(struct sk_buff *skb, const struct iovec *from,
 				  int offset, size_t count)
@@ -1275,6 +1431,7 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 	int offset = 0;
 	int copylen;
 	bool zerocopy = false;
+	bool frags;
 	int err;
 	u32 rxhash;
 
@@ -1312,6 +1469,12 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 			return -EINVAL;
 	}
 
+	/* Only plain writes of Ethernet frames that fit in the fragments of
+	 * one skb are built in place; vhost zerocopy keeps its own path.
+	 */
+	frags = tfile->napi_frags_enabled && !msg_control &&
+		len <= MAX_SKB_FRAGS * PAGE_SIZE;
+
 	good_linear = SKB_MAX_HEAD(align);
 
 	if (msg_control) {
@@ -1335,11 +1498,24 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 			linear = tun16_to_cpu(tun, gso.hdr_len);
 	}
 
-	skb = tun_alloc_skb(tfile, align, copylen, linear, noblock);
-	if (IS_ERR(skb)) {
-		if (PTR_ERR(skb) != -EAGAIN)
+	if (frags) {
+		/* Keep the Ethernet header linear for the flow dissector */
+		mutex_lock(&tfile->napi_mutex);
+		skb = tun_napi_alloc_frags(tfile, len,
+					   max_t(size_t, ETH_HLEN,
+						 tun16_to_cpu(tun, gso.hdr_len)));
+		if (IS_ERR(skb)) {
+			mutex_unlock(&tfile->napi_mutex);
 			this_cpu_inc(tun->pcpu_stats->rx_dropped);
-		return PTR_ERR(skb);
+			return PTR_ERR(skb);
+		}
+	} else {
+		skb = tun_alloc_skb(tfile, align, copylen, linear, noblock);
+		if (IS_ERR(skb)) {
+			if (PTR_ERR(skb) != -EAGAIN)
+				this_cpu_inc(tun->pcpu_stats->rx_dropped);
+			return PTR_ERR(skb);
+		}
 	}
 
 	if (zerocopy)
@@ -1354,7 +1530,7 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 
 	if (err) {
 		this_cpu_inc(tun->pcpu_stats->rx_dropped);
-		kfree_skb(skb);
+		tun_drop_skb(tfile, skb, frags);
 		return -EFAULT;
 	}
 
@@ -1362,7 +1538,7 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 		if (!skb_partial_csum_set(skb, tun16_to_cpu(tun, gso.csum_start),
 					  tun16_to_cpu(tun, gso.csum_offset))) {
 			this_cpu_inc(tun->pcpu_stats->rx_frame_errors);
-			kfree_skb(skb);
+			tun_drop_skb(tfile, skb, frags);
 			return -EINVAL;
 		}
 	}
@@ -1379,7 +1555,7 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 				break;
 			default:
 				this_cpu_inc(tun->pcpu_stats->rx_dropped);
-				kfree_skb(skb);
+				tun_drop_skb(tfile, skb, frags);
 				return -EINVAL;
 			}
 		}
@@ -1389,7 +1565,9 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 		skb->dev = tun->dev;
 		break;
 	case IFF_TAP:
-		skb->protocol = eth_type_trans(skb, tun->dev);
+		/* napi_gro_frags() parses the Ethernet header itself */
+		if (!frags)
+			skb->protocol = eth_type_trans(skb, tun->dev);
 		break;
 	}
 
@@ -1407,7 +1585,7 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 			break;
 		default:
 			this_cpu_inc(tun->pcpu_stats->rx_frame_errors);
-			kfree_skb(skb);
+			tun_drop_skb(tfile, skb, frags);
 			return -EINVAL;
 		}
 
@@ -1417,7 +1595,7 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 		skb_shinfo(skb)->gso_size = tun16_to_cpu(tun, gso.gso_size);
 		if (skb_shinfo(skb)->gso_size == 0) {
 			this_cpu_inc(tun->pcpu_stats->rx_frame_errors);
-			kfree_skb(skb);
+			tun_drop_skb(tfile, skb, frags);
 			return -EINVAL;
 		}
 
@@ -1433,15 +1611,68 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 		skb_shinfo(skb)->tx_flags |= SKBTX_SHARED_FRAG;
 	}
 
-	skb_reset_network_header(skb);
+	if (frags) {
+		/* napi.skb still starts with the Ethernet header, which
+		 * napi_gro_frags() pulls itself; just point the protocol and
+		 * network header past it so the flow can be hashed.
+		 */
+		skb_reset_mac_header(skb);
+		skb->protocol = eth_hdr(skb)->h_proto;
+		skb_set_network_header(skb, ETH_HLEN);
+	} else {
+		skb_reset_network_header(skb);
+	}
 	skb_probe_transport_header(skb, 0);
 
 	rxhash = __skb_get_hash_symmetric(skb);
+
+	if (tfile->napi_frags_enabled) {
+		/* Whoever holds NAPI_STATE_SCHED owns the GRO state: a writer
+		 * for the duration of one packet, or the poll loop. Packets
+		 * are held back while the sender says more are coming and
+		 * flushed by napi_complete() once its batch ends.
+		 */
+		local_bh_disable();
+		if (napi_schedule_prep(&tfile->napi)) {
+			if (frags)
+				napi_gro_frags(&tfile->napi);
+			else
+				napi_gro_receive(&tfile->napi, skb);
+			if (more)
+				__napi_complete(&tfile->napi);
+			else
+				napi_complete(&tfile->napi);
+		} else {
+			/* NAPI is being polled or disabled: bypass GRO. */
+			if (frags) {
+				tfile->napi.skb = NULL;
+				skb->protocol = eth_type_trans(skb, tun->dev);
+			}
+			netif_receive_skb(skb);
+		}
+		local_bh_enable();
+		if (frags)
+			mutex_unlock(&tfile->napi_mutex);
+	} else if (tfile->napi_enabled) {
+		struct sk_buff_head *queue = &tfile->sk.sk_write_queue;
+		int queue_len;
+
+		spin_lock_bh(&queue->lock);
+		__skb_queue_tail(queue, skb);
+		queue_len = skb_queue_len(queue);
+		spin_unlock(&queue->lock);
+
+		if (!more || queue_len > NAPI_POLL_WEIGHT)
+			napi_schedule(&tfile->napi);
+
+		local_bh_enable();
+	} else {
 #ifndef CONFIG_4KSTACKS
-	tun_rx_batched(tun, tfile, skb, more);
+		tun_rx_batched(tun, tfile, skb, more);
 #else
-	netif_rx_ni(skb);
+		netif_rx_ni(skb);
 #endif
+	}
 
 	stats = get_cpu_ptr(tun->pcpu_stats);
 	u64_stats_update_begin(&stats->syncp);
@@ -1645,21 +1876,24 @@ out:
 
 static ssize_t tun_do_read(struct tun_struct *tun, struct tun_file *tfile,
 			   struct kiocb *iocb, const struct iovec *iv,
-			   ssize_t len, int noblock)
+			   ssize_t len, int noblock, struct sk_buff *skb)
 {
-	struct sk_buff *skb;
 	ssize_t ret;
 	int err;
 
 	tun_debug(KERN_INFO, tun, "tun_do_read\n");
 
-	if (!len)
+	if (!len) {
+		kfree_skb(skb);
 		return 0;
+	}
 
-	/* Read frames from ring */
-	skb = tun_ring_recv(tun, tfile, noblock, &err);
-	if (!skb)
-		return err;
+	if (!skb) {
+		/* Read frames from ring */
+		skb = tun_ring_recv(tun, tfile, noblock, &err);
+		if (!skb)
+			return err;
+	}
 
 	ret = tun_put_user(tun, tfile, skb, iv, len);
 	if (unlikely(ret < 0))
@@ -1687,7 +1921,7 @@ static ssize_t tun_chr_aio_read(struct kiocb *iocb, const struct iovec *iv,
 	}
 
 	ret = tun_do_read(tun, tfile, iocb, iv, len,
-			  file->f_flags & O_NONBLOCK);
+			  file->f_flags & O_NONBLOCK, NULL);
 	ret = min_t(ssize_t, ret, len);
 out:
 	tun_put(tun);
@@ -1753,6 +1987,31 @@ static void tun_sock_write_space(struct sock *sk)
 	kill_fasync(&tfile->fasync, SIGIO, POLL_OUT);
 }
 
+/* Send a batch of packets described by @pkts. All but the last one are
+ * sent with "more" set so that the stack can defer its work until the end
+ * of the batch. A packet that fails is dropped and accounted for by
+ * tun_get_user(); the batch carries on with the next one. Returns the total
+ * number of bytes consumed, or the last error if nothing could be sent.
+ */
+static int tun_sendmsg_batched(struct tun_struct *tun, struct tun_file *tfile,
+			       struct tun_msg_pkt *pkts, unsigned int n,
+			       int noblock, bool more)
+{
+	ssize_t ret = 0, total = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		ret = tun_get_user(tun, tfile, NULL, pkts[i].iov, pkts[i].len,
+				   pkts[i].iovlen, noblock,
+				   more || i + 1 < n);
+		if (ret < 0)
+			continue;
+		total += ret;
+	}
+
+	return total ? total : ret;
+}
+
 static int tun_sendmsg(struct kiocb *iocb, struct socket *sock,
 		       struct msghdr *m, size_t total_len)
 {
@@ -1760,11 +2019,35 @@ static int tun_sendmsg(struct kiocb *iocb, struct socket *sock,
 	struct tun_file *tfile = container_of(sock, struct tun_file, socket);
 	struct tun_struct *tun = __tun_get(tfile);
 
+	struct tun_msg_ctl *ctl = m->msg_control;
+	void *msg_control = NULL;
+
 	if (!tun)
 		return -EBADFD;
-	ret = tun_get_user(tun, tfile, m->msg_control, m->msg_iov, total_len,
+
+	if (ctl) {
+		switch (ctl->type) {
+		case TUN_MSG_UBUF:
+			msg_control = ctl->ptr;
+			break;
+		case TUN_MSG_PTR:
+			ret = tun_sendmsg_batched(tun, tfile, ctl->ptr, ctl->num,
+						  m->msg_flags & MSG_DONTWAIT,
+						  m->msg_flags & MSG_MORE);
+			goto out;
+		default:
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	ret = tun_get_user(tun, tfile, msg_control, m->msg_iov, total_len,
 			   m->msg_iovlen, m->msg_flags & MSG_DONTWAIT,
 			   m->msg_flags & MSG_MORE);
+out:
+	/* Flush what a batch left behind if its last packet failed */
+	if (tfile->napi_frags_enabled && !(m->msg_flags & MSG_MORE))
+		tun_napi_frags_flush(tfile);
 	tun_put(tun);
 	return ret;
 }
@@ -1778,15 +2061,21 @@ static int tun_recvmsg(struct kiocb *iocb, struct socket *sock,
 	struct tun_struct *tun = __tun_get(tfile);
 	int ret;
 
-	if (!tun)
+	if (!tun) {
+		kfree_skb(m->msg_control);
 		return -EBADFD;
+	}
 
 	if (flags & ~(MSG_DONTWAIT|MSG_TRUNC)) {
+		kfree_skb(m->msg_control);
 		ret = -EINVAL;
 		goto out;
 	}
+	/* A caller that has already dequeued the skb with
+	 * tun_get_skb_array() hands it over in msg_control.
+	 */
 	ret = tun_do_read(tun, tfile, iocb, m->msg_iov, total_len,
-			  flags & MSG_DONTWAIT);
+			  flags & MSG_DONTWAIT, m->msg_control);
 	if (ret > total_len) {
 		m->msg_flags |= MSG_TRUNC;
 		ret = flags & MSG_TRUNC ? ret : total_len;
@@ -1879,6 +2168,11 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 	if (tfile->detached)
 		return -EINVAL;
 
+	/* napi_gro_frags() expects an Ethernet header */
+	if ((ifr->ifr_flags & IFF_NAPI_FRAGS) &&
+	    (!(ifr->ifr_flags & IFF_NAPI) || !(ifr->ifr_flags & IFF_TAP)))
+		return -EINVAL;
+
 	dev = __dev_get_by_name(net, ifr->ifr_name);
 	if (dev) {
 		if (ifr->ifr_flags & IFF_TUN_EXCL)
@@ -1900,7 +2194,9 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 		if (err < 0)
 			return err;
 
-		err = tun_attach(tun, file, ifr->ifr_flags & IFF_NOFILTER);
+		err = tun_attach(tun, file, ifr->ifr_flags & IFF_NOFILTER,
+				 ifr->ifr_flags & IFF_NAPI,
+				 ifr->ifr_flags & IFF_NAPI_FRAGS);
 		if (err < 0)
 			return err;
 
@@ -1987,7 +2283,8 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 				       NETIF_F_HW_VLAN_STAG_TX);
 
 		INIT_LIST_HEAD(&tun->disabled);
-		err = tun_attach(tun, file, false);
+		err = tun_attach(tun, file, false, ifr->ifr_flags & IFF_NAPI,
+				 ifr->ifr_flags & IFF_NAPI_FRAGS);
 		if (err < 0)
 			goto err_free_flow;
 
@@ -2138,7 +2435,8 @@ static int tun_set_queue(struct file *file, struct ifreq *ifr)
 		ret = security_tun_dev_attach_queue(tun->security);
 		if (ret < 0)
 			goto unlock;
-		ret = tun_attach(tun, file, false);
+		ret = tun_attach(tun, file, false, tun->flags & IFF_NAPI,
+				 tun->flags & IFF_NAPI_FRAGS);
 	} else if (ifr->ifr_flags & IFF_DETACH_QUEUE) {
 		tun = rtnl_dereference(tfile->tun);
 		if (!tun || !(tun->flags & IFF_MULTI_QUEUE) || tfile->detached)
@@ -2518,6 +2816,7 @@ static int tun_chr_open(struct inode *inode, struct file * file)
 	file->private_data = tfile;
 	set_bit(SOCK_EXTERNALLY_ALLOCATED, &tfile->socket.flags);
 	INIT_LIST_HEAD(&tfile->next);
+	mutex_init(&tfile->napi_mutex);
 
 	sock_set_flag(&tfile->sk, SOCK_ZEROCOPY);
 
@@ -2745,6 +3044,22 @@ struct socket *tun_get_socket(struct file *file)
 }
 EXPORT_SYMBOL_GPL(tun_get_socket);
 
+/* Get the transmit ring of the queue behind a tun file, so that a consumer
+ * such as vhost-net can dequeue packets in batches and hand them back one
+ * at a time through recvmsg() msg_control. */
+struct skb_array *tun_get_skb_array(struct file *file)
+{
+	struct tun_file *tfile;
+
+	if (file->f_op != &tun_fops)
+		return ERR_PTR(-EINVAL);
+	tfile = file->private_data;
+	if (!tfile)
+		return ERR_PTR(-EBADFD);
+	return &tfile->tx_array;
+}
+EXPORT_SYMBOL_GPL(tun_get_skb_array);
+
 module_init(tun_init);
 module_exit(tun_cleanup);
 MODULE_DESCRIPTION(DRV_DESCRIPTION);
@@ -13,6 +13,7 @@
 #include <linux/ethtool.h>
 #include <linux/etherdevice.h>
 #include <linux/u64_stats_sync.h>
+#include <linux/ptr_ring.h>
 
 #include <net/rtnetlink.h>
 #include <net/dst.h>
@@ -26,16 +27,32 @@
 #define MIN_MTU 68		/* Min L3 MTU */
 #define MAX_MTU 65535		/* Max L3 MTU (arbitrary) */
 
+#define VETH_RING_SIZE		256
+#define VETH_RX_BATCH		16
+
 struct pcpu_vstats {
 	u64			packets;
 	u64			bytes;
 	struct u64_stats_sync	syncp;
 };
 
+/*
+ * Per rx queue state.  The peer's veth_xmit() produces skbs into the
+ * ring and veth_poll() hands them to GRO from NAPI context.
+ */
+struct veth_rq {
+	struct napi_struct	napi;
+	/* Points to napi while the device is up, NULL otherwise */
+	struct napi_struct __rcu *napi_ptr;
+	bool			rx_notify_masked;
+	struct ptr_ring		ring;
+};
+
 struct veth_priv {
 	struct net_device __rcu	*peer;
 	atomic64_t		dropped;
 	unsigned		requested_headroom;
+	struct veth_rq		*rq;
 };
 
 /*
@@ -106,11 +123,41 @@ static const struct ethtool_ops veth_ethtool_ops = {
 	.get_ethtool_stats	= veth_get_ethtool_stats,
 };
 
+static void __veth_rx_kick(struct veth_rq *rq)
+{
+	/* Write ptr_ring before reading rx_notify_masked */
+	smp_mb();
+	if (!rq->rx_notify_masked) {
+		rq->rx_notify_masked = true;
+		napi_schedule(&rq->napi);
+	}
+}
+
+static int veth_forward_skb(struct net_device *dev, struct sk_buff *skb,
+			    struct veth_rq *rq)
+{
+	if (!rq)
+		return dev_forward_skb(dev, skb);
+
+	if (__dev_forward_skb(dev, skb))
+		return NET_RX_DROP;
+
+	if (unlikely(ptr_ring_produce(&rq->ring, skb))) {
+		kfree_skb(skb);
+		return NET_RX_DROP;
+	}
+
+	return NET_RX_SUCCESS;
+}
+
 static netdev_tx_t veth_xmit(struct sk_buff *skb, struct net_device *dev)
 {
-	struct veth_priv *priv = netdev_priv(dev);
+	struct veth_priv *rcv_priv, *priv = netdev_priv(dev);
+	struct veth_rq *rq = NULL;
 	struct net_device *rcv;
 	int length = skb->len;
+	bool more = skb->xmit_more;
+	int rxq;
 
 	rcu_read_lock();
 	rcv = rcu_dereference(priv->peer);
@@ -119,7 +166,13 @@ static netdev_tx_t veth_xmit(struct sk_buff *skb, struct net_device *dev)
 		goto drop;
 	}
 
-	if (likely(dev_forward_skb(rcv, skb) == NET_RX_SUCCESS)) {
+	rcv_priv = netdev_priv(rcv);
+	rxq = skb_get_queue_mapping(skb);
+	if (rxq < rcv->real_num_rx_queues &&
+	    rcu_access_pointer(rcv_priv->rq[rxq].napi_ptr))
+		rq = &rcv_priv->rq[rxq];
+
+	if (likely(veth_forward_skb(rcv, skb, rq) == NET_RX_SUCCESS)) {
 		struct pcpu_vstats *stats = this_cpu_ptr(dev->vstats);
 
 		u64_stats_update_begin(&stats->syncp);
@@ -130,6 +183,11 @@ static netdev_tx_t veth_xmit(struct sk_buff *skb, struct net_device *dev)
 drop:
 		atomic64_inc(&priv->dropped);
 	}
+
+	/* Kick the peer's NAPI once per burst rather than per skb. */
+	if (rq && !more)
+		__veth_rx_kick(rq);
+
 	rcu_read_unlock();
 	return NETDEV_TX_OK;
 }
@@ -184,14 +242,113 @@ static struct rtnl_link_stats64 *veth_get_stats64(struct net_device *dev,
 	return tot;
 }
 
+static int veth_rx(struct veth_rq *rq, int budget)
+{
+	void *skbs[VETH_RX_BATCH];
+	int i, n, done = 0;
+
+	while (done < budget) {
+		n = __ptr_ring_consume_batched(&rq->ring, skbs,
+					       min(budget - done, VETH_RX_BATCH));
+		if (!n)
+			break;
+
+		for (i = 0; i < n; i++)
+			napi_gro_receive(&rq->napi, skbs[i]);
+		done += n;
+	}
+
+	return done;
+}
+
+static int veth_poll(struct napi_struct *napi, int budget)
+{
+	struct veth_rq *rq = container_of(napi, struct veth_rq, napi);
+	int done;
+
+	done = veth_rx(rq, budget);
+
+	if (done < budget) {
+		napi_complete_done(napi, done);
+
+		/* Write rx_notify_masked before reading ptr_ring */
+		set_mb(rq->rx_notify_masked, false);
+		if (unlikely(!__ptr_ring_empty(&rq->ring))) {
+			rq->rx_notify_masked = true;
+			napi_schedule(&rq->napi);
+		}
+	}
+
+	return done;
+}
+
+static void veth_ptr_free(void *ptr)
+{
+	kfree_skb(ptr);
+}
+
+static int veth_napi_add(struct net_device *dev)
+{
+	struct veth_priv *priv = netdev_priv(dev);
+	int err, i;
+
+	for (i = 0; i < dev->real_num_rx_queues; i++) {
+		err = ptr_ring_init(&priv->rq[i].ring, VETH_RING_SIZE,
+				    GFP_KERNEL);
+		if (err)
+			goto err_ring;
+	}
+
+	for (i = 0; i < dev->real_num_rx_queues; i++) {
+		struct veth_rq *rq = &priv->rq[i];
+
+		rq->rx_notify_masked = false;
+		netif_napi_add(dev, &rq->napi, veth_poll, NAPI_POLL_WEIGHT);
+		napi_enable(&rq->napi);
+		rcu_assign_pointer(rq->napi_ptr, &rq->napi);
+	}
+
+	return 0;
+
+err_ring:
+	while (i--)
+		ptr_ring_cleanup(&priv->rq[i].ring, veth_ptr_free);
+	return err;
+}
+
+static void veth_napi_del(struct net_device *dev)
+{
+	struct veth_priv *priv = netdev_priv(dev);
+	int i;
+
+	for (i = 0; i < dev->real_num_rx_queues; i++)
+		RCU_INIT_POINTER(priv->rq[i].napi_ptr, NULL);
+
+	/* The peer no longer produces once it has left veth_xmit(). */
+	synchronize_net();
+
+	for (i = 0; i < dev->real_num_rx_queues; i++) {
+		struct veth_rq *rq = &priv->rq[i];
+
+		napi_disable(&rq->napi);
+		netif_napi_del(&rq->napi);
+		ptr_ring_cleanup(&rq->ring, veth_ptr_free);
+	}
+}
+
 static int veth_open(struct net_device *dev)
 {
 	struct veth_priv *priv = netdev_priv(dev);
 	struct net_device *peer = rtnl_dereference(priv->peer);
+	int err;
 
 	if (!peer)
 		return -ENOTCONN;
 
+	err = veth_napi_add(dev);
+	if (err)
+		return err;
+
 	if (peer->flags & IFF_UP) {
 		netif_carrier_on(dev);
 		netif_carrier_on(peer);
@@ -208,6 +365,8 @@ static int veth_close(struct net_device *dev)
 	if (peer)
 		netif_carrier_off(peer);
 
+	veth_napi_del(dev);
+
 	return 0;
 }
 
@@ -226,15 +385,26 @@ static int veth_change_mtu(struct net_device *dev, int new_mtu)
 
 static int veth_dev_init(struct net_device *dev)
 {
+	struct veth_priv *priv = netdev_priv(dev);
+
 	dev->vstats = alloc_percpu(struct pcpu_vstats);
 	if (!dev->vstats)
 		return -ENOMEM;
 
+	priv->rq = kcalloc(dev->num_rx_queues, sizeof(*priv->rq), GFP_KERNEL);
+	if (!priv->rq) {
+		free_percpu(dev->vstats);
+		return -ENOMEM;
+	}
+
 	return 0;
 }
 
 static void veth_dev_free(struct net_device *dev)
 {
+	struct veth_priv *priv = netdev_priv(dev);
+
+	kfree(priv->rq);
 	free_percpu(dev->vstats);
 	free_netdev(dev);
 }
@@ -25,6 +25,7 @@
 #include <linux/if_tun.h>
 #include <linux/if_macvlan.h>
 #include <linux/if_vlan.h>
+#include <linux/skb_array.h>
 
 #include <net/sock.h>
 
@@ -43,6 +44,11 @@ MODULE_PARM_DESC(experimental_zcopytx, "Enable Zero Copy TX;"
 #define VHOST_MAX_PEND 128
 #define VHOST_GOODCOPY_LEN 256
 
+/* Max number of packets moved between the guest and a tun backend per
+ * sendmsg/ring lock, and max number of used buffers held back before
+ * the used ring is updated. */
+#define VHOST_NET_BATCH 64
+
 /*
  * For transmit, used buffer len is unused; we override it to track buffer
  * status internally; used for zerocopy tx only.
@@ -63,7 +69,8 @@ enum {
 			 (1ULL << VHOST_NET_F_VIRTIO_NET_HDR) |
 			 (1ULL << VIRTIO_NET_F_MRG_RXBUF) |
 			 (1ULL << VIRTIO_F_VERSION_1) |
-			 (1ULL << VIRTIO_F_IOMMU_PLATFORM)
+			 (1ULL << VIRTIO_F_IOMMU_PLATFORM) |
+			 (1ULL << VIRTIO_F_RING_PACKED)
 };
 
 enum {
@@ -83,6 +90,12 @@ struct vhost_net_ubuf_ref {
 	struct vhost_virtqueue *vq;
 };
 
+struct vhost_net_buf {
+	struct sk_buff **queue;
+	int tail;
+	int head;
+};
+
 struct vhost_net_virtqueue {
 	struct vhost_virtqueue vq;
 	/* hdr is used to store the virtio header.
@@ -94,13 +107,26 @@ struct vhost_net_virtqueue {
 	/* vhost zerocopy support fields below: */
 	/* last used idx for outstanding DMA zerocopy buffers */
 	int upend_idx;
-	/* first used idx for DMA done zerocopy buffers */
+	/* first used idx for DMA done zerocopy buffers; on rx, number of
+	 * heads waiting for the batched used ring update */
 	int done_idx;
 	/* an array of userspace buffers info */
 	struct ubuf_info *ubuf_info;
 	/* Reference counting for outstanding ubufs.
 	 * Protected by vq mutex. Writers must also take device mutex. */
 	struct vhost_net_ubuf_ref *ubufs;
+	/* Ring of the tun backend we dequeue rx skbs from in batches,
+	 * and the skbs dequeued but not yet passed to recvmsg. */
+	struct skb_array *rx_array;
+	struct vhost_net_buf rxq;
+	/* Backend accepts TUN_MSG_PTR batches on the copy tx path. */
+	bool tx_batch;
+	/* Packets gathered for the next batched sendmsg, and their heads.
+	 * Kept apart from vq->heads, which tracks outstanding zerocopy
+	 * buffers. */
+	int tx_batched;
+	struct tun_msg_pkt tx_pkts[VHOST_NET_BATCH];
+	struct vring_used_elem tx_heads[VHOST_NET_BATCH];
 };
 
 struct vhost_net {
@@ -119,6 +145,71 @@ struct vhost_net {
 
 static unsigned vhost_net_zcopy_mask __read_mostly;
 
+static void *vhost_net_buf_get_ptr(struct vhost_net_buf *rxq)
+{
+	if (rxq->tail != rxq->head)
+		return rxq->queue[rxq->head];
+	else
+		return NULL;
+}
+
+static int vhost_net_buf_get_size(struct vhost_net_buf *rxq)
+{
+	return rxq->tail - rxq->head;
+}
+
+static int vhost_net_buf_is_empty(struct vhost_net_buf *rxq)
+{
+	return rxq->tail == rxq->head;
+}
+
+static void *vhost_net_buf_consume(struct vhost_net_buf *rxq)
+{
+	void *ret = vhost_net_buf_get_ptr(rxq);
+	++rxq->head;
+	return ret;
+}
+
+static int vhost_net_buf_produce(struct vhost_net_virtqueue *nvq)
+{
+	struct vhost_net_buf *rxq = &nvq->rxq;
+
+	rxq->head = 0;
+	rxq->tail = skb_array_consume_batched(nvq->rx_array, rxq->queue,
+					      VHOST_NET_BATCH);
+	return rxq->tail;
+}
+
+static void vhost_net_buf_unproduce(struct vhost_net_virtqueue *nvq)
+{
+	struct vhost_net_buf *rxq = &nvq->rxq;
+
+	if (nvq->rx_array && !vhost_net_buf_is_empty(rxq)) {
+		skb_array_unconsume(nvq->rx_array, rxq->queue + rxq->head,
+				    vhost_net_buf_get_size(rxq));
+		rxq->head = rxq->tail = 0;
+	}
+}
+
+static int vhost_net_buf_peek(struct vhost_net_virtqueue *nvq)
+{
+	struct vhost_net_buf *rxq = &nvq->rxq;
+
+	if (!vhost_net_buf_is_empty(rxq))
+		goto out;
+
+	if (!vhost_net_buf_produce(nvq))
+		return 0;
+
+out:
+	return __skb_array_len_with_tag(vhost_net_buf_get_ptr(rxq));
+}
+
+static void vhost_net_buf_init(struct vhost_net_buf *rxq)
+{
+	rxq->head = rxq->tail = 0;
+}
+
 static void vhost_net_enable_zcopy(int vq)
 {
 	vhost_net_zcopy_mask |= 0x1 << vq;
@@ -303,6 +394,19 @@ static int vhost_zerocopy_signal_used(struct vhost_net *net,
 	return j;
 }
 
+/* Return the rx buffers gathered in heads[0..done_idx) to the guest with
+ * a single used ring update. */
+static void vhost_net_signal_used(struct vhost_net_virtqueue *nvq)
+{
+	struct vhost_virtqueue *vq = &nvq->vq;
+
+	if (!nvq->done_idx)
+		return;
+
+	vhost_add_used_and_signal_n(vq->dev, vq, vq->heads, nvq->done_idx);
+	nvq->done_idx = 0;
+}
+
 static void vhost_zerocopy_callback(struct ubuf_info *ubuf, bool success)
 {
 	struct vhost_net_ubuf_ref *ubufs = ubuf->ctx;
@@ -375,6 +479,129 @@ static bool vhost_exceeds_maxpend(struct vhost_net *net)
 		== nvq->done_idx;
 }
 
+/* Hand the packets gathered by handle_tx_batched() to the backend in one
+ * sendmsg() and complete their descriptors with one used ring update. */
+static int vhost_tx_batch(struct vhost_net_virtqueue *nvq,
+			  struct socket *sock)
+{
+	struct vhost_virtqueue *vq = &nvq->vq;
+	struct tun_msg_ctl ctl = {
+		.type = TUN_MSG_PTR,
+		.num = nvq->tx_batched,
+		.ptr = nvq->tx_pkts,
+	};
+	struct msghdr msg = {
+		.msg_control = &ctl,
+		.msg_controllen = sizeof(ctl),
+		.msg_flags = MSG_DONTWAIT,
+	};
+	size_t len = 0;
+	int i, err;
+
+	if (!nvq->tx_batched)
+		return 0;
+
+	for (i = 0; i < nvq->tx_batched; i++)
+		len += nvq->tx_pkts[i].len;
+
+	err = sock->ops->sendmsg(NULL, sock, &msg, len);
+	if (unlikely(err < 0))
+		vhost_discard_vq_desc(vq, nvq->tx_batched);
+	else
+		vhost_add_used_and_signal_n(vq->dev, vq, nvq->tx_heads,
+					    nvq->tx_batched);
+	nvq->tx_batched = 0;
+	return err < 0 ? err : 0;
+}
+
+/* Copy tx path for a tun backend: gather up to VHOST_NET_BATCH descriptors
+ * and send them with a single sendmsg(). */
+static void handle_tx_batched(struct vhost_net *net, struct socket *sock)
+{
+	struct vhost_net_virtqueue *nvq = &net->vqs[VHOST_NET_VQ_TX];
+	struct vhost_virtqueue *vq = &nvq->vq;
+	struct tun_msg_pkt *pkt;
+	unsigned out, in, s, seg = 0;
+	size_t len, total_len = 0;
+	int head;
+
+	for (;;) {
+		/* Only busy poll once the pending batch has been sent. */
+		if (nvq->tx_batched)
+			head = vhost_get_vq_desc(vq, vq->iov + seg,
+						 ARRAY_SIZE(vq->iov) - seg,
+						 &out, &in, NULL, NULL);
+		else
+			head = vhost_net_tx_get_vq_desc(net, vq, vq->iov,
+							ARRAY_SIZE(vq->iov),
+							&out, &in);
+		/* Out of iovecs for this batch: send it and retry. */
+		if (unlikely(head == -ENOBUFS) && nvq->tx_batched) {
+			if (vhost_tx_batch(nvq, sock) < 0)
+				break;
+			seg = 0;
+			continue;
+		}
+		/* On error, stop handling until the next kick. */
+		if (unlikely(head < 0))
+			break;
+		/* Nothing new?  Flush what we have, then wait for eventfd
+		 * to tell us they refilled. */
+		if (head == vq->num) {
+			if (nvq->tx_batched) {
+				if (vhost_tx_batch(nvq, sock) < 0)
+					break;
+				seg = 0;
+				continue;
+			}
+			if (unlikely(vhost_enable_notify(&net->dev, vq))) {
+				vhost_disable_notify(&net->dev, vq);
+				continue;
+			}
+			break;
+		}
+		if (in) {
+			vq_err(vq, "Unexpected descriptor format for TX: "
+			       "out %d, int %d\n", out, in);
+			break;
+		}
+		/* Skip header. TODO: support TSO. */
+		s = move_iovec_hdr(vq->iov + seg, nvq->hdr, nvq->vhost_hlen,
+				   out);
+		len = iov_length(vq->iov + seg, out);
+		/* Sanity check */
+		if (!len) {
+			vq_err(vq, "Unexpected header len for TX: "
+			       "%zd expected %zd\n",
+			       iov_length(nvq->hdr, s), nvq->vhost_hlen);
+			break;
+		}
+
+		pkt = &nvq->tx_pkts[nvq->tx_batched];
+		pkt->iov = vq->iov + seg;
+		pkt->iovlen = out;
+		pkt->len = len;
+		nvq->tx_heads[nvq->tx_batched].id = cpu_to_vhost32(vq, head);
+		nvq->tx_heads[nvq->tx_batched].len = 0;
+		++nvq->tx_batched;
+		seg += out;
+
+		total_len += len;
+		if (nvq->tx_batched == VHOST_NET_BATCH ||
+		    seg >= ARRAY_SIZE(vq->iov) / 2) {
+			if (vhost_tx_batch(nvq, sock) < 0)
+				break;
+			seg = 0;
+		}
+		if (unlikely(total_len >= VHOST_NET_WEIGHT)) {
+			vhost_poll_queue(&vq->poll);
+			break;
+		}
+	}
+
+	vhost_tx_batch(nvq, sock);
+}
+
 /* Expects to be always run from workqueue - which acts as
  * read-size critical section for our kind of RCU. */
 static void handle_tx(struct vhost_net *net)
@@ -396,6 +623,7 @@ static void handle_tx(struct vhost_net *net)
 	size_t hdr_size;
 	struct socket *sock;
 	struct vhost_net_ubuf_ref *uninitialized_var(ubufs);
+	struct tun_msg_ctl ctl;
 	bool zcopy, zcopy_used;
 
 	mutex_lock(&vq->mutex);
@@ -411,6 +639,11 @@ static void handle_tx(struct vhost_net *net)
 	hdr_size = nvq->vhost_hlen;
 	zcopy = nvq->ubufs;
 
+	if (!zcopy && nvq->tx_batch) {
+		handle_tx_batched(net, sock);
+		goto out;
+	}
+
 	for (;;) {
 		/* Release DMAs done buffers first */
 		if (zcopy)
@@ -475,8 +708,10 @@ static void handle_tx(struct vhost_net *net)
 				ubuf->callback = vhost_zerocopy_callback;
 				ubuf->ctx = nvq->ubufs;
 				ubuf->desc = nvq->upend_idx;
-				msg.msg_control = ubuf;
-				msg.msg_controllen = sizeof(ubuf);
+				ctl.type = TUN_MSG_UBUF;
+				ctl.ptr = ubuf;
+				msg.msg_control = &ctl;
+				msg.msg_controllen = sizeof(ctl);
 				ubufs = nvq->ubufs;
 				atomic_inc(&ubufs->refcount);
 			}
@@ -522,13 +757,16 @@ out:
 	mutex_unlock(&vq->mutex);
 }
 
-static int peek_head_len(struct sock *sk)
+static int peek_head_len(struct vhost_net_virtqueue *rvq, struct sock *sk)
 {
 	struct socket *sock = sk->sk_socket;
 	struct sk_buff *head;
 	int len = 0;
 	unsigned long flags;
 
+	if (rvq->rx_array)
+		return vhost_net_buf_peek(rvq);
+
 	if (sock->ops->peek_len)
 		return sock->ops->peek_len(sock);
 
@@ -556,10 +794,11 @@ static int sk_has_rx_data(struct sock *sk)
 
 static int vhost_net_rx_peek_head_len(struct vhost_net *net, struct sock *sk)
 {
+	struct vhost_net_virtqueue *rvq = &net->vqs[VHOST_NET_VQ_RX];
 	struct vhost_net_virtqueue *nvq = &net->vqs[VHOST_NET_VQ_TX];
 	struct vhost_virtqueue *vq = &nvq->vq;
 	unsigned long uninitialized_var(endtime);
-	int len = peek_head_len(sk);
+	int len = peek_head_len(rvq, sk);
 
 	if (!len && vq->busyloop_timeout) {
 		/* Both tx vq and rx socket were polled here */
@@ -580,7 +819,7 @@ static int vhost_net_rx_peek_head_len(struct vhost_net *net, struct sock *sk)
 			vhost_poll_queue(&vq->poll);
 		mutex_unlock(&vq->mutex);
 
-		len = peek_head_len(sk);
+		len = peek_head_len(rvq, sk);
 	}
 
 	return len;
@@ -710,22 +949,19 @@ static void handle_rx(struct vhost_net *net)
 	while ((sock_len = vhost_net_rx_peek_head_len(net, sock->sk))) {
 		sock_len += sock_hlen;
 		vhost_len = sock_len + vhost_hlen;
-		headcount = get_rx_bufs(vq, vq->heads, vhost_len,
-					&in, vq_log, &log,
-					likely(mergeable) ? UIO_MAXIOV : 1);
+		/* Heads are gathered behind those still waiting for the
+		 * batched used ring update. */
+		headcount = get_rx_bufs(vq, vq->heads + nvq->done_idx,
+					vhost_len, &in, vq_log, &log,
+					likely(mergeable) ?
+					UIO_MAXIOV - nvq->done_idx : 1);
 		/* On error, stop handling until the next kick. */
 		if (unlikely(headcount < 0))
 			break;
-		/* On overrun, truncate and discard */
-		if (unlikely(headcount > UIO_MAXIOV)) {
-			msg.msg_iovlen = 1;
-			err = sock->ops->recvmsg(NULL, sock, &msg,
-						 1, MSG_DONTWAIT | MSG_TRUNC);
-			pr_debug("Discarded rx packet: len %zd\n", sock_len);
-			continue;
-		}
 		/* OK, now we need to know about added descriptors. */
 		if (!headcount) {
+			/* Let the guest see what we have before waiting. */
+			vhost_net_signal_used(nvq);
 			if (unlikely(vhost_enable_notify(&net->dev, vq))) {
 				/* They have slipped one in as we were
 				 * doing that: check again. */
@@ -736,6 +972,18 @@ static void handle_rx(struct vhost_net *net)
 			 * they refilled. */
 			break;
 		}
+		/* The skb peeked above was dequeued from the tun ring
+		 * already: hand it over to recvmsg. */
+		if (nvq->rx_array)
+			msg.msg_control = vhost_net_buf_consume(&nvq->rxq);
+		/* On overrun, truncate and discard */
+		if (unlikely(headcount > UIO_MAXIOV)) {
+			msg.msg_iovlen = 1;
+			err = sock->ops->recvmsg(NULL, sock, &msg,
+						 1, MSG_DONTWAIT | MSG_TRUNC);
+			pr_debug("Discarded rx packet: len %zd\n", sock_len);
+			continue;
+		}
 		/* We don't need to be notified again. */
 		if (unlikely((vhost_hlen)))
 			/* Skip header. TODO: support TSO. */
@@ -774,8 +1022,9 @@ static void handle_rx(struct vhost_net *net)
 			vhost_discard_vq_desc(vq, headcount);
 			break;
 		}
-		vhost_add_used_and_signal_n(&net->dev, vq, vq->heads,
-					    headcount);
+		nvq->done_idx += headcount;
+		if (nvq->done_idx > VHOST_NET_BATCH)
+			vhost_net_signal_used(nvq);
 		if (unlikely(vq_log))
 			vhost_log_write(vq, vq_log, log, vhost_len);
 		total_len += vhost_len;
@@ -784,6 +1033,7 @@ static void handle_rx(struct vhost_net *net)
 			break;
 		}
 	}
+	vhost_net_signal_used(nvq);
 out:
 	mutex_unlock(&vq->mutex);
 }
@@ -833,6 +1083,7 @@ static int vhost_net_open(struct inode *inode, struct file *f)
 	struct vhost_net *n;
 	struct vhost_dev *dev;
 	struct vhost_virtqueue **vqs;
+	struct sk_buff **queue;
 	int r, i;
 
 	n = kmalloc(sizeof *n, GFP_KERNEL | __GFP_NOWARN | __GFP_REPEAT);
@@ -847,6 +1098,14 @@ static int vhost_net_open(struct inode *inode, struct file *f)
 		return -ENOMEM;
 	}
 
+	queue = kmalloc_array(VHOST_NET_BATCH, sizeof(*queue), GFP_KERNEL);
+	if (!queue) {
+		kfree(vqs);
+		vhost_net_free(n);
+		return -ENOMEM;
+	}
+	n->vqs[VHOST_NET_VQ_RX].rxq.queue = queue;
+
 	dev = &n->dev;
 	vqs[VHOST_NET_VQ_TX] = &n->vqs[VHOST_NET_VQ_TX].vq;
 	vqs[VHOST_NET_VQ_RX] = &n->vqs[VHOST_NET_VQ_RX].vq;
@@ -859,9 +1118,14 @@ static int vhost_net_open(struct inode *inode, struct file *f)
 		n->vqs[i].done_idx = 0;
 		n->vqs[i].vhost_hlen = 0;
 		n->vqs[i].sock_hlen = 0;
+		n->vqs[i].rx_array = NULL;
+		n->vqs[i].tx_batch = false;
+		n->vqs[i].tx_batched = 0;
+		vhost_net_buf_init(&n->vqs[i].rxq);
 	}
 	r = vhost_dev_init(dev, vqs, VHOST_NET_VQ_MAX);
 	if (r < 0) {
+		kfree(queue);
 		kfree(n);
 		kfree(vqs);
 		return r;
@@ -904,12 +1168,17 @@ static int vhost_net_enable_vq(struct vhost_net *n,
 static struct socket *vhost_net_stop_vq(struct vhost_net *n,
 					struct vhost_virtqueue *vq)
 {
+	struct vhost_net_virtqueue *nvq =
+		container_of(vq, struct vhost_net_virtqueue, vq);
 	struct socket *sock;
 
 	mutex_lock(&vq->mutex);
 	sock = vq->private_data;
 	vhost_net_disable_vq(n, vq);
 	vq->private_data = NULL;
+	vhost_net_buf_unproduce(nvq);
+	nvq->rx_array = NULL;
+	nvq->tx_batch = false;
 	mutex_unlock(&vq->mutex);
 	return sock;
 }
@@ -964,6 +1233,7 @@ static int vhost_net_release(struct inode *inode, struct file *f)
 	/* We do an extra flush before freeing memory,
 	 * since jobs can re-queue themselves. */
 	vhost_net_flush(n);
+	kfree(n->vqs[VHOST_NET_VQ_RX].rxq.queue);
 	kfree(n->dev.vqs);
 	vhost_net_free(n);
 	return 0;
@@ -1040,6 +1310,7 @@ static long vhost_net_set_backend(struct vhost_net *n, unsigned index, int fd)
 	struct vhost_virtqueue *vq;
 	struct vhost_net_virtqueue *nvq;
 	struct vhost_net_ubuf_ref *ubufs, *oldubufs = NULL;
+	struct skb_array *rx_array;
 	int r;
 
 	mutex_lock(&n->dev.mutex);
@@ -1078,6 +1349,9 @@ static long vhost_net_set_backend(struct vhost_net *n, unsigned index, int fd)
 
 		vhost_net_disable_vq(n, vq);
 		vq->private_data = sock;
+		vhost_net_buf_unproduce(nvq);
+		nvq->rx_array = NULL;
+		nvq->tx_batch = false;
 		r = vhost_init_used(vq);
 		if (r)
 			goto err_used;
@@ -1088,6 +1362,15 @@ static long vhost_net_set_backend(struct vhost_net *n, unsigned index, int fd)
 		oldubufs = nvq->ubufs;
 		nvq->ubufs = ubufs;
 
+		/* Batching only applies to a tun backend. */
+		if (sock && index == VHOST_NET_VQ_RX) {
+			rx_array = tun_get_skb_array(sock->file);
+			if (!IS_ERR(rx_array))
+				nvq->rx_array = rx_array;
+		} else if (sock) {
+			nvq->tx_batch = !IS_ERR(tun_get_socket(sock->file));
+		}
+
 		n->tx_packets = 0;
 		n->tx_zcopy_err = 0;
 		n->tx_flush = false;
@@ -39,6 +39,18 @@ static int max_iotlb_entries = 2048;
 module_param(max_iotlb_entries, int, 0444);
 MODULE_PARM_DESC(max_iotlb_entries,
 	"Maximum number of iotlb entries. (default: 2048)");
+static unsigned int max_devs_per_worker = 1;
+module_param(max_devs_per_worker, uint, 0644);
+MODULE_PARM_DESC(max_devs_per_worker,
+	"Maximum number of devices of one owner sharing a worker thread. (default: 1)");
+static unsigned int worker_poll_us;
+module_param(worker_poll_us, uint, 0644);
+MODULE_PARM_DESC(worker_poll_us,
+	"Time a worker polls for new work before sleeping, in us. (default: 0)");
+
+/* Workers in use, protected by vhost_workers_mutex */
+static LIST_HEAD(vhost_workers);
+static DEFINE_MUTEX(vhost_workers_mutex);
 
 enum {
 	VHOST_MEMORY_F_LOG = 0x1,
@@ -246,16 +258,18 @@ void vhost_work_queue(struct vhost_dev *dev, struct vhost_work *work)
 		 * sure it was not in the list.
 		 */
 		smp_mb();
-		llist_add(&work->node, &dev->work_list);
-		wake_up_process(dev->worker);
+		llist_add(&work->node, &dev->worker->work_list);
+		wake_up_process(dev->worker->task);
 	}
 }
 EXPORT_SYMBOL_GPL(vhost_work_queue);
 
-/* A lockless hint for busy polling code to exit the loop */
+/* A lockless hint for busy polling code to exit the loop. With a shared
+ * worker this includes work queued by the other devices on it.
+ */
 bool vhost_has_work(struct vhost_dev *dev)
 {
-	return !llist_empty(&dev->work_list);
+	return !llist_empty(&dev->worker->work_list);
 }
 EXPORT_SYMBOL_GPL(vhost_has_work);
 
@@ -293,6 +307,8 @@ static void vhost_vq_reset(struct vhost_dev *dev,
 	vq->last_used_idx = 0;
 	vq->signalled_used = 0;
 	vq->signalled_used_valid = false;
+	vq->last_avail_wrap_counter = true;
+	vq->last_used_wrap_counter = true;
 	vq->used_flags = 0;
 	vq->log_used = false;
 	vq->log_addr = -1ull;
@@ -313,17 +329,38 @@ static void vhost_vq_reset(struct vhost_dev *dev,
 	__vhost_vq_meta_reset(vq);
 }
 
+/* Spin for up to worker_poll_us waiting for any device on the worker to
+ * queue more work, so that back-to-back kicks do not each cost a sleep
+ * and a wakeup.
+ */
+static void vhost_worker_poll(struct vhost_worker *worker)
+{
+	unsigned long endtime;
+
+	if (!worker_poll_us)
+		return;
+
+	endtime = (local_clock() >> 10) + worker_poll_us;
+	while (llist_empty(&worker->work_list) &&
+	       !need_resched() && !kthread_should_stop() &&
+	       !time_after(local_clock() >> 10, endtime))
+		cpu_relax();
+}
+
 static int vhost_worker(void *data)
 {
-	struct vhost_dev *dev = data;
+	struct vhost_worker *worker = data;
 	struct vhost_work *work, *work_next;
 	struct llist_node *node;
 	mm_segment_t oldfs = get_fs();
 
 	set_fs(USER_DS);
-	use_mm(dev->mm);
+	use_mm(worker->mm);
 
 	for (;;) {
+		if (llist_empty(&worker->work_list))
+			vhost_worker_poll(worker);
+
 		/* mb paired w/ kthread_stop */
 		set_current_state(TASK_INTERRUPTIBLE);
 
@@ -332,7 +369,7 @@ static int vhost_worker(void *data)
 			break;
 		}
 
-		node = llist_del_all(&dev->work_list);
+		node = llist_del_all(&worker->work_list);
 		if (!node)
 			schedule();
 
@@ -347,11 +384,73 @@ static int vhost_worker(void *data)
 				schedule();
 		}
 	}
-	unuse_mm(dev->mm);
+	unuse_mm(worker->mm);
 	set_fs(oldfs);
 	return 0;
 }
 
+/* Find a worker of the same owner with room for @dev, or start a new one.
+ * Only devices sharing dev->mm, i.e. owned by one process, share a worker,
+ * so all the worker's time is charged to that process's cgroups.
+ */
+static struct vhost_worker *vhost_worker_get(struct vhost_dev *dev)
+{
+	struct vhost_worker *worker;
+	struct task_struct *task;
+
+	mutex_lock(&vhost_workers_mutex);
+
+	list_for_each_entry(worker, &vhost_workers, node) {
+		if (worker->mm == dev->mm &&
+		    worker->users < max_devs_per_worker) {
+			worker->users++;
+			goto out;
+		}
+	}
+
+	worker = kzalloc(sizeof(*worker), GFP_KERNEL);
+	if (!worker) {
+		worker = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+
+	init_llist_head(&worker->work_list);
+	worker->mm = dev->mm;
+	worker->users = 1;
+
+	task = kthread_create(vhost_worker, worker, "vhost-%d", current->pid);
+	if (IS_ERR(task)) {
+		kfree(worker);
+		worker = ERR_CAST(task);
+		goto out;
+	}
+
+	atomic_inc(&worker->mm->mm_users);
+	worker->task = task;
+	list_add(&worker->node, &vhost_workers);
+	wake_up_process(task);		/* avoid contributing to loadavg */
+out:
+	mutex_unlock(&vhost_workers_mutex);
+	return worker;
+}
+
+/* The caller must have flushed its work; other users' work may be queued. */
+static void vhost_worker_put(struct vhost_worker *worker)
+{
+	mutex_lock(&vhost_workers_mutex);
+	if (--worker->users) {
+		mutex_unlock(&vhost_workers_mutex);
+		return;
+	}
+	list_del(&worker->node);
+	mutex_unlock(&vhost_workers_mutex);
+
+	WARN_ON(!llist_empty(&worker->work_list));
+	kthread_stop(worker->task);
+	mmput(worker->mm);
+	kfree(worker);
+}
+
 static void vhost_vq_free_iovecs(struct vhost_virtqueue *vq)
 {
 	kfree(vq->indirect);
@@ -360,6 +459,8 @@ static void vhost_vq_free_iovecs(struct vhost_virtqueue *vq)
 	vq->log = NULL;
 	kfree(vq->heads);
 	vq->heads = NULL;
+	kvfree(vq->desc_count);
+	vq->desc_count = NULL;
 }
 
 /* Helper to allocate iovec buffers for all vqs. */
@@ -408,7 +509,6 @@ long vhost_dev_init(struct vhost_dev *dev,
 	dev->iotlb = NULL;
 	dev->mm = NULL;
 	dev->worker = NULL;
-	init_llist_head(&dev->work_list);
 	init_waitqueue_head(&dev->wait);
 	INIT_LIST_HEAD(&dev->read_list);
 	INIT_LIST_HEAD(&dev->pending_list);
@@ -418,6 +518,7 @@ long vhost_dev_init(struct vhost_dev *dev,
 		dev->vqs[i]->log = NULL;
 		dev->vqs[i]->indirect = NULL;
 		dev->vqs[i]->heads = NULL;
+		dev->vqs[i]->desc_count = NULL;
 		dev->vqs[i]->dev = dev;
 		mutex_init(&dev->vqs[i]->mutex);
 		vhost_vq_reset(dev, dev->vqs[i]);
@@ -473,7 +574,7 @@ EXPORT_SYMBOL_GPL(vhost_dev_has_owner);
 /* Caller should have device mutex */
 long vhost_dev_set_owner(struct vhost_dev *dev)
 {
-	struct task_struct *worker;
+	struct vhost_worker *worker;
 	int err;
 
 	/* Is there an owner already? */
@@ -484,14 +585,13 @@ long vhost_dev_set_owner(struct vhost_dev *dev)
 
 	/* No owner, become one */
 	dev->mm = get_task_mm(current);
-	worker = kthread_create(vhost_worker, dev, "vhost-%d", current->pid);
+	worker = vhost_worker_get(dev);
 	if (IS_ERR(worker)) {
 		err = PTR_ERR(worker);
 		goto err_worker;
 	}
 
 	dev->worker = worker;
-	wake_up_process(worker);	/* avoid contributing to loadavg */
 
 	err = vhost_attach_cgroups(dev);
 	if (err)
@@ -503,7 +603,7 @@ long vhost_dev_set_owner(struct vhost_dev *dev)
 
 	return 0;
 err_cgroup:
-	kthread_stop(worker);
+	vhost_worker_put(worker);
 	dev->worker = NULL;
 err_worker:
 	if (dev->mm)
@@ -633,9 +733,8 @@ void vhost_dev_cleanup(struct vhost_dev *dev, bool locked)
 	dev->iotlb = NULL;
 	vhost_clear_msg(dev);
 	wake_up_interruptible_poll(&dev->wait, POLLIN | POLLRDNORM);
-	WARN_ON(!llist_empty(&dev->work_list));
 	if (dev->worker) {
-		kthread_stop(dev->worker);
+		vhost_worker_put(dev->worker);
 		dev->worker = NULL;
 	}
 	if (dev->mm)
@@ -847,7 +946,7 @@ static inline void __user *__vhost_get_user(struct vhost_virtqueue *vq,
 	return __vhost_get_user_slow(vq, addr, size, type);
 }
 
-#define vhost_put_user(vq, x, ptr)		\
+#define vhost_put_user(vq, x, ptr, type)		\
 ({ \
 	int ret = -EFAULT; \
 	if (!vq->iotlb) { \
@@ -855,7 +954,7 @@ static inline void __user *__vhost_get_user(struct vhost_virtqueue *vq,
 	} else { \
 		__typeof__(ptr) to = \
 			(__typeof__(ptr)) __vhost_get_user(vq, ptr,	\
-					  sizeof(*ptr), VHOST_ADDR_USED); \
+					  sizeof(*ptr), type); \
 		if (to != NULL) \
 			ret = __put_user(x, to); \
 		else \
@@ -882,12 +981,21 @@ static inline void __user *__vhost_get_user(struct vhost_virtqueue *vq,
 	ret; \
 })
 
+#define vhost_put_used(vq, x, ptr) \
+	vhost_put_user(vq, x, ptr, VHOST_ADDR_USED)
+
+#define vhost_put_desc(vq, x, ptr) \
+	vhost_put_user(vq, x, ptr, VHOST_ADDR_DESC)
+
 #define vhost_get_avail(vq, x, ptr) \
 	vhost_get_user(vq, x, ptr, VHOST_ADDR_AVAIL)
 
 #define vhost_get_used(vq, x, ptr) \
 	vhost_get_user(vq, x, ptr, VHOST_ADDR_USED)
 
+#define vhost_get_desc(vq, x, ptr) \
+	vhost_get_user(vq, x, ptr, VHOST_ADDR_DESC)
+
 static void vhost_dev_lock_vqs(struct vhost_dev *d)
 {
 	int i = 0;
@@ -1128,6 +1236,16 @@ static int vhost_iotlb_miss(struct vhost_virtqueue *vq, u64 iova, int access)
 	return 0;
 }
 
+static int vq_access_ok_packed(struct vhost_virtqueue *vq, unsigned int num,
+			       struct vring_packed_desc __user *desc,
+			       struct vring_packed_desc_event __user *driver_event,
+			       struct vring_packed_desc_event __user *device_event)
+{
+	return access_ok(VERIFY_WRITE, desc, num * sizeof(*desc)) &&
+	       access_ok(VERIFY_READ, driver_event, sizeof(*driver_event)) &&
+	       access_ok(VERIFY_WRITE, device_event, sizeof(*device_event));
+}
+
 static int vq_access_ok(struct vhost_virtqueue *vq, unsigned int num,
 			struct vring_desc __user *desc,
 			struct vring_avail __user *avail,
@@ -1135,6 +1253,11 @@ static int vq_access_ok(struct vhost_virtqueue *vq, unsigned int num,
 {
 	size_t s = vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
 
+	if (vhost_vq_is_packed(vq))
+		return vq_access_ok_packed(vq, num, (void __user *)desc,
+					   (void __user *)avail,
+					   (void __user *)used);
+
 	return access_ok(VERIFY_READ, desc, num * sizeof(*desc)) &&
 	       access_ok(VERIFY_READ, avail,
 			 sizeof(*avail) + num * sizeof(*avail->ring) + s) &&
@@ -1149,7 +1272,11 @@ static void vhost_vq_meta_update(struct vhost_virtqueue *vq,
 	int access = (type == VHOST_ADDR_USED) ?
 		     VHOST_ACCESS_WO : VHOST_ACCESS_RO;
 
-	if (likely(node->perm & access))
+	/* A packed ring writes used entries back to the descriptor ring. */
+	if (type == VHOST_ADDR_DESC && vhost_vq_is_packed(vq))
+		access = VHOST_ACCESS_RW;
+
+	if (likely((node->perm & access) == access))
 		vq->meta_iotlb[type] = node;
 }
 
@@ -1197,6 +1324,20 @@ int vq_iotlb_prefetch(struct vhost_virtqueue *vq)
 	if (!vq->iotlb)
 		return 1;
 
+	if (vhost_vq_is_packed(vq))
+		return iotlb_access_ok(vq, VHOST_ACCESS_RW,
+				       (u64)(uintptr_t)vq->desc_packed,
+				       num * sizeof(*vq->desc_packed),
+				       VHOST_ADDR_DESC) &&
+		       iotlb_access_ok(vq, VHOST_ACCESS_RO,
+				       (u64)(uintptr_t)vq->driver_event,
+				       sizeof(*vq->driver_event),
+				       VHOST_ADDR_AVAIL) &&
+		       iotlb_access_ok(vq, VHOST_ACCESS_WO,
+				       (u64)(uintptr_t)vq->device_event,
+				       sizeof(*vq->device_event),
+				       VHOST_ADDR_USED);
+
 	return iotlb_access_ok(vq, VHOST_ACCESS_RO, (u64)(uintptr_t)vq->desc,
 			       num * sizeof(*vq->desc), VHOST_ADDR_DESC) &&
 	       iotlb_access_ok(vq, VHOST_ACCESS_RO, (u64)(uintptr_t)vq->avail,
@@ -1218,24 +1359,37 @@ int vhost_log_access_ok(struct vhost_dev *dev)
 }
 EXPORT_SYMBOL_GPL(vhost_log_access_ok);
 
+/* Size of the area logged through log_addr: the used ring, or the
+ * descriptor ring of a packed ring, where used entries are written. */
+static size_t vhost_get_used_size(struct vhost_virtqueue *vq,
+				  unsigned int num)
+{
+	size_t s = vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
+
+	if (vhost_vq_is_packed(vq))
+		return num * sizeof(struct vring_packed_desc);
+
+	return sizeof *vq->used + num * sizeof *vq->used->ring + s;
+}
+
 /* Verify access for write logging. */
 /* Caller should have vq mutex and device mutex */
 static int vq_log_access_ok(struct vhost_virtqueue *vq,
 			    void __user *log_base)
 {
-	size_t s = vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
-
 	return vq_memory_access_ok(log_base, vq->umem,
 				   vhost_has_feature(vq, VHOST_F_LOG_ALL)) &&
 		(!vq->log_used || log_access_ok(log_base, vq->log_addr,
-					sizeof *vq->used +
-					vq->num * sizeof *vq->used->ring + s));
+					vhost_get_used_size(vq, vq->num)));
 }
 
 /* Can we start vq? */
 /* Caller should have vq mutex and device mutex */
 int vhost_vq_access_ok(struct vhost_virtqueue *vq)
 {
+	if (vhost_vq_is_packed(vq) && !vq->desc_count)
+		return 0;
+
 	if (vq->iotlb) {
 		/* When device IOTLB was used, the access validation
 		 * will be validated during prefetching.
@@ -1338,6 +1492,7 @@ long vhost_vring_ioctl(struct vhost_dev *d, int ioctl, void __user *argp)
 	struct vhost_vring_state s;
 	struct vhost_vring_file f;
 	struct vhost_vring_addr a;
+	u16 *desc_count;
 	u32 idx;
 	long r;
 
@@ -1367,6 +1522,13 @@ long vhost_vring_ioctl(struct vhost_dev *d, int ioctl, void __user *argp)
 			r = -EINVAL;
 			break;
 		}
+		desc_count = vhost_kvzalloc(s.num * sizeof(*desc_count));
+		if (!desc_count) {
+			r = -ENOMEM;
+			break;
+		}
+		kvfree(vq->desc_count);
+		vq->desc_count = desc_count;
 		vq->num = s.num;
 		break;
 	case VHOST_SET_VRING_BASE:
@@ -1380,6 +1542,20 @@ long vhost_vring_ioctl(struct vhost_dev *d, int ioctl, void __user *argp)
 			r = -EFAULT;
 			break;
 		}
+		/* The packed encoding is only valid once the feature has been
+		 * acked; both indices must point into the ring. */
+		if (vhost_vq_is_packed(vq)) {
+			if ((s.num & 0x7fff) >= vq->num ||
+			    ((s.num >> 16) & 0x7fff) >= vq->num) {
+				r = -EINVAL;
+				break;
+			}
+			vq->last_avail_idx = s.num & 0x7fff;
+			vq->last_avail_wrap_counter = !!(s.num & 0x8000);
+			vq->last_used_idx = (s.num >> 16) & 0x7fff;
+			vq->last_used_wrap_counter = !!(s.num & 0x80000000);
+			break;
+		}
 		if (s.num > 0xffff) {
 			r = -EINVAL;
 			break;
@@ -1390,7 +1566,13 @@ long vhost_vring_ioctl(struct vhost_dev *d, int ioctl, void __user *argp)
 		break;
 	case VHOST_GET_VRING_BASE:
 		s.index = idx;
-		s.num = vq->last_avail_idx;
+		if (vhost_vq_is_packed(vq))
+			s.num = vq->last_avail_idx |
+				(vq->last_avail_wrap_counter << 15) |
+				(vq->last_used_idx << 16) |
+				((u32)vq->last_used_wrap_counter << 31);
+		else
+			s.num = vq->last_avail_idx;
 		if (copy_to_user(argp, &s, sizeof s))
 			r = -EFAULT;
 		break;
@@ -1437,8 +1619,7 @@ long vhost_vring_ioctl(struct vhost_dev *d, int ioctl, void __user *argp)
 			/* Also validate log access for used ring if enabled. */
 			if ((a.flags & (0x1 << VHOST_VRING_F_LOG)) &&
 			    !log_access_ok(vq->log_base, a.log_guest_addr,
-					   sizeof *vq->used +
-					   vq->num * sizeof *vq->used->ring)) {
+					   vhost_get_used_size(vq, vq->num))) {
 				r = -EINVAL;
 				break;
 			}
@@ -1726,10 +1907,42 @@ int vhost_log_write(struct vhost_virtqueue *vq, struct vhost_log *log,
 }
 EXPORT_SYMBOL_GPL(vhost_log_write);
 
+/* Mirror used_flags into the device event suppression structure of a
+ * packed ring.  That structure lives outside the area covered by
+ * log_addr, so the write is not logged. */
+static int vhost_update_device_event_packed(struct vhost_virtqueue *vq)
+{
+	u16 flags, off_wrap;
+
+	if (vq->used_flags & VRING_USED_F_NO_NOTIFY) {
+		flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+	} else if (vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX)) {
+		off_wrap = vq->last_avail_idx |
+			   (vq->last_avail_wrap_counter <<
+			    VRING_PACKED_EVENT_F_WRAP_CTR);
+		if (vhost_put_used(vq, cpu_to_le16(off_wrap),
+				   &vq->device_event->off_wrap))
+			return -EFAULT;
+		/* Make sure the offset is seen before the flags using it. */
+		smp_wmb();
+		flags = VRING_PACKED_EVENT_FLAG_DESC;
+	} else {
+		flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+	}
+
+	if (vhost_put_used(vq, cpu_to_le16(flags), &vq->device_event->flags))
+		return -EFAULT;
+	return 0;
+}
+
 static int vhost_update_used_flags(struct vhost_virtqueue *vq)
 {
 	void __user *used;
-	if (vhost_put_user(vq, cpu_to_vhost16(vq, vq->used_flags),
+
+	if (vhost_vq_is_packed(vq))
+		return vhost_update_device_event_packed(vq);
+
+	if (vhost_put_used(vq, cpu_to_vhost16(vq, vq->used_flags),
 			   &vq->used->flags) < 0)
 		return -EFAULT;
 	if (unlikely(vq->log_used)) {
@@ -1748,7 +1961,7 @@ static int vhost_update_used_flags(struct vhost_virtqueue *vq)
 
 static int vhost_update_avail_event(struct vhost_virtqueue *vq, u16 avail_event)
 {
-	if (vhost_put_user(vq, cpu_to_vhost16(vq, vq->avail_idx),
+	if (vhost_put_used(vq, cpu_to_vhost16(vq, vq->avail_idx),
 			   vhost_avail_event(vq)))
 		return -EFAULT;
 	if (unlikely(vq->log_used)) {
@@ -1781,6 +1994,15 @@ int vhost_init_used(struct vhost_virtqueue *vq)
 	if (r)
 		return r;
 	vq->signalled_used_valid = false;
+	/* A packed ring gets last_used_idx from VHOST_SET_VRING_BASE. The
+	 * base may have been set before the feature was acked, so check that
+	 * both indices still fall inside the ring. */
+	if (vhost_vq_is_packed(vq)) {
+		if (vq->last_avail_idx >= vq->num ||
+		    vq->last_used_idx >= vq->num)
+			return -EINVAL;
+		return 0;
+	}
 	if (!vq->iotlb &&
 	    !access_ok(VERIFY_READ, &vq->used->idx, sizeof(vq->used->idx)))
 		return -EFAULT;
@@ -1961,6 +2183,254 @@ static int get_indirect(struct vhost_virtqueue *vq,
 	return 0;
 }
 
+static int get_indirect_packed(struct vhost_virtqueue *vq,
+			       struct iovec iov[], unsigned int iov_size,
+			       unsigned int *out_num, unsigned int *in_num,
+			       struct vhost_log *log, unsigned int *log_num,
+			       struct vring_packed_desc *indirect)
+{
+	struct vring_packed_desc desc;
+	unsigned int i, count;
+	u32 len = le32_to_cpu(indirect->len);
+	u16 flags;
+	int ret, access;
+
+	/* Sanity check */
+	if (unlikely(len % sizeof desc)) {
+		vq_err(vq, "Invalid length in indirect descriptor: "
+		       "len 0x%llx not multiple of 0x%zx\n",
+		       (unsigned long long)len,
+		       sizeof desc);
+		return -EINVAL;
+	}
+
+	ret = translate_desc(vq, le64_to_cpu(indirect->addr), len, vq->indirect,
+			     UIO_MAXIOV, VHOST_ACCESS_RO);
+	if (unlikely(ret < 0)) {
+		if (ret != -EAGAIN)
+			vq_err(vq, "Translation failure %d in indirect.\n", ret);
+		return ret;
+	}
+
+	/* We will use the result as an address to read from, so most
+	 * architectures only need a compiler barrier here. */
+	read_barrier_depends();
+
+	count = len / sizeof desc;
+	/* A packed indirect table is walked in order, not chained, but
+	 * keep the same limit as the split ring. */
+	if (unlikely(count > USHRT_MAX + 1)) {
+		vq_err(vq, "Indirect buffer length too big: %d\n", len);
+		return -E2BIG;
+	}
+
+	for (i = 0; i < count; i++) {
+		unsigned iov_count = *in_num + *out_num;
+
+		if (unlikely(memcpy_fromiovec((unsigned char *)&desc,
+					      vq->indirect, sizeof desc))) {
+			vq_err(vq, "Failed indirect descriptor: idx %d, %zx\n",
+			       i, (size_t)le64_to_cpu(indirect->addr) + i * sizeof desc);
+			return -EINVAL;
+		}
+		flags = le16_to_cpu(desc.flags);
+		if (unlikely(flags & VRING_DESC_F_INDIRECT)) {
+			vq_err(vq, "Nested indirect descriptor: idx %d, %zx\n",
+			       i, (size_t)le64_to_cpu(indirect->addr) + i * sizeof desc);
+			return -EINVAL;
+		}
+
+		if (flags & VRING_DESC_F_WRITE)
+			access = VHOST_ACCESS_WO;
+		else
+			access = VHOST_ACCESS_RO;
+
+		ret = translate_desc(vq, le64_to_cpu(desc.addr),
+				     le32_to_cpu(desc.len), iov + iov_count,
+				     iov_size - iov_count, access);
+		if (unlikely(ret < 0)) {
+			if (ret != -EAGAIN)
+				vq_err(vq, "Translation failure %d indirect idx %d\n",
+					ret, i);
+			return ret;
+		}
+		/* If this is an input descriptor, increment that count. */
+		if (access == VHOST_ACCESS_WO) {
+			*in_num += ret;
+			if (unlikely(log)) {
+				log[*log_num].addr = le64_to_cpu(desc.addr);
+				log[*log_num].len = le32_to_cpu(desc.len);
+				++*log_num;
+			}
+		} else {
+			/* If it's an output descriptor, they're all supposed
+			 * to come before any input descriptors. */
+			if (unlikely(*in_num)) {
+				vq_err(vq, "Indirect descriptor "
+				       "has out after in: idx %d\n", i);
+				return -EINVAL;
+			}
+			*out_num += ret;
+		}
+	}
+	return 0;
+}
+
+/* Returns 1 if the guest made the packed ring descriptor at idx available
+ * for the given wrap counter, 0 if not, or a negative error. */
+static int vhost_desc_avail_packed(struct vhost_virtqueue *vq, u16 idx,
+				   bool wrap_counter)
+{
+	__le16 flags;
+	bool avail, used;
+
+	if (unlikely(vhost_get_desc(vq, flags, &vq->desc_packed[idx].flags))) {
+		vq_err(vq, "Failed to get descriptor flags: idx %d addr %p\n",
+		       idx, &vq->desc_packed[idx].flags);
+		return -EFAULT;
+	}
+
+	avail = !!(le16_to_cpu(flags) & (1 << VRING_PACKED_DESC_F_AVAIL));
+	used = !!(le16_to_cpu(flags) & (1 << VRING_PACKED_DESC_F_USED));
+
+	return avail == wrap_counter && used != wrap_counter;
+}
+
+/* Packed ring version of vhost_get_vq_desc: the buffer starts at
+ * last_avail_idx and its descriptors follow it in the ring. */
+static int vhost_get_vq_desc_packed(struct vhost_virtqueue *vq,
+				    struct iovec iov[], unsigned int iov_size,
+				    unsigned int *out_num, unsigned int *in_num,
+				    struct vhost_log *log, unsigned int *log_num)
+{
+	struct vring_packed_desc desc;
+	unsigned int i, idx, found = 0;
+	bool wrap_counter;
+	u16 id = 0, flags;
+	int ret, access;
+
+	i = vq->last_avail_idx;
+	wrap_counter = vq->last_avail_wrap_counter;
+	if (unlikely(i >= vq->num)) {
+		vq_err(vq, "Avail index %u out of range %u\n", i, vq->num);
+		return -EINVAL;
+	}
+
+	ret = vhost_desc_avail_packed(vq, i, wrap_counter);
+	if (unlikely(ret < 0))
+		return ret;
+
+	/* If there's nothing new since last we looked, return invalid. */
+	if (!ret)
+		return vq->num;
+
+	/* Only get the descriptors after they have been exposed by guest. */
+	smp_rmb();
+
+	/* When we start there are none of either input nor output. */
+	*out_num = *in_num = 0;
+	if (unlikely(log))
+		*log_num = 0;
+
+	do {
+		unsigned iov_count = *in_num + *out_num;
+
+		if (unlikely(++found > vq->num)) {
+			vq_err(vq, "Loop detected: last one at %u "
+			       "vq size %u head %u\n",
+			       i, vq->num, vq->last_avail_idx);
+			return -EINVAL;
+		}
+		ret = vhost_copy_from_user(vq, &desc, vq->desc_packed + i,
+					   sizeof desc);
+		if (unlikely(ret)) {
+			vq_err(vq, "Failed to get descriptor: idx %d addr %p\n",
+			       i, vq->desc_packed + i);
+			return -EFAULT;
+		}
+
+		idx = i;
+		if (++i >= vq->num) {
+			i = 0;
+			wrap_counter ^= 1;
+		}
+
+		flags = le16_to_cpu(desc.flags);
+		/* The buffer id is in the last descriptor of the list. */
+		id = le16_to_cpu(desc.id);
+
+		if (flags & VRING_DESC_F_INDIRECT) {
+			if (unlikely(flags & VRING_DESC_F_NEXT)) {
+				vq_err(vq, "Chained indirect descriptor "
+				       "at idx %d\n", idx);
+				return -EINVAL;
+			}
+			ret = get_indirect_packed(vq, iov, iov_size,
+						  out_num, in_num,
+						  log, log_num, &desc);
+			if (unlikely(ret < 0)) {
+				if (ret != -EAGAIN)
+					vq_err(vq, "Failure detected "
+					       "in indirect descriptor at idx %d\n", idx);
+				return ret;
+			}
+			continue;
+		}
+
+		if (flags & VRING_DESC_F_WRITE)
+			access = VHOST_ACCESS_WO;
+		else
+			access = VHOST_ACCESS_RO;
+		ret = translate_desc(vq, le64_to_cpu(desc.addr),
+				     le32_to_cpu(desc.len), iov + iov_count,
+				     iov_size - iov_count, access);
+		if (unlikely(ret < 0)) {
+			if (ret != -EAGAIN)
+				vq_err(vq, "Translation failure %d descriptor idx %d\n",
+					ret, idx);
+			return ret;
+		}
+		if (access == VHOST_ACCESS_WO) {
+			/* If this is an input descriptor,
+			 * increment that count. */
+			*in_num += ret;
+			if (unlikely(log)) {
+				log[*log_num].addr = le64_to_cpu(desc.addr);
+				log[*log_num].len = le32_to_cpu(desc.len);
+				++*log_num;
+			}
+		} else {
+			/* If it's an output descriptor, they're all supposed
+			 * to come before any input descriptors. */
+			if (unlikely(*in_num)) {
+				vq_err(vq, "Descriptor has out after in: "
+				       "idx %d\n", idx);
+				return -EINVAL;
+			}
+			*out_num += ret;
+		}
+	} while (flags & VRING_DESC_F_NEXT);
+
+	/* If their number is silly, that's an error. */
+	if (unlikely(id >= vq->num)) {
+		vq_err(vq, "Guest says buffer id %u > %u is available",
+		       id, vq->num);
+		return -EINVAL;
+	}
+
+	/* Remember how far to move the used index when id comes back. */
+	vq->desc_count[id] = found;
+
+	/* On success, move past the buffer. */
+	vq->last_avail_idx = i;
+	vq->last_avail_wrap_counter = wrap_counter;
+
+	/* Assume notifications from guest are disabled at this point,
+	 * if they aren't we would need to update the device event. */
+	BUG_ON(!(vq->used_flags & VRING_USED_F_NO_NOTIFY));
+	return id;
+}
+
 /* This looks in the virtqueue and for the first available buffer, and converts
  * it to an iovec for convenient access.  Since descriptors consist of some
  * number of output then some number of input descriptors, it's actually two
@@ -1981,6 +2451,10 @@ int vhost_get_vq_desc(struct vhost_virtqueue *vq,
 	__virtio16 ring_head;
 	int ret, access;
 
+	if (vhost_vq_is_packed(vq))
+		return vhost_get_vq_desc_packed(vq, iov, iov_size, out_num,
+						in_num, log, log_num);
+
 	/* Check it isn't doing very strange things with descriptor numbers. */
 	last_avail_idx = vq->last_avail_idx;
 	if (unlikely(vhost_get_avail(vq, avail_idx, &vq->avail->idx))) {
@@ -2105,9 +2579,51 @@ int vhost_get_vq_desc(struct vhost_virtqueue *vq,
 }
 EXPORT_SYMBOL_GPL(vhost_get_vq_desc);
 
+static void vhost_discard_vq_desc_packed(struct vhost_virtqueue *vq, int n)
+{
+	unsigned int i = vq->last_avail_idx;
+	bool wrap_counter = vq->last_avail_wrap_counter;
+	__le16 id;
+	u16 count;
+
+	while (n--) {
+		/* Step back to the last descriptor of the previous buffer,
+		 * which carries its id, then over the rest of its list. */
+		if (i == 0) {
+			i = vq->num;
+			wrap_counter ^= 1;
+		}
+		i--;
+		if (unlikely(vhost_get_desc(vq, id, &vq->desc_packed[i].id))) {
+			vq_err(vq, "Failed to get descriptor id: idx %d\n", i);
+			return;
+		}
+		count = vq->desc_count[le16_to_cpu(id) % vq->num];
+		if (unlikely(!count || count > vq->num)) {
+			vq_err(vq, "Bad descriptor count %u for id %u\n",
+			       count, le16_to_cpu(id));
+			return;
+		}
+		/* The buffer goes back to the guest unused. */
+		vq->desc_count[le16_to_cpu(id) % vq->num] = 0;
+		if (count - 1 > i) {
+			i += vq->num;
+			wrap_counter ^= 1;
+		}
+		i -= count - 1;
+	}
+
+	vq->last_avail_idx = i;
+	vq->last_avail_wrap_counter = wrap_counter;
+}
+
 /* Reverse the effect of vhost_get_vq_desc. Useful for error handling. */
 void vhost_discard_vq_desc(struct vhost_virtqueue *vq, int n)
 {
+	if (vhost_vq_is_packed(vq)) {
+		vhost_discard_vq_desc_packed(vq, n);
+		return;
+	}
 	vq->last_avail_idx -= n;
 }
 EXPORT_SYMBOL_GPL(vhost_discard_vq_desc);
@@ -2136,11 +2652,11 @@ static int __vhost_add_used_n(struct vhost_virtqueue *vq,
 	start = vq->last_used_idx & (vq->num - 1);
 	used = vq->used->ring + start;
 	if (count == 1) {
-		if (vhost_put_user(vq, heads[0].id, &used->id)) {
+		if (vhost_put_used(vq, heads[0].id, &used->id)) {
 			vq_err(vq, "Failed to write used id");
 			return -EFAULT;
 		}
-		if (vhost_put_user(vq, heads[0].len, &used->len)) {
+		if (vhost_put_used(vq, heads[0].len, &used->len)) {
 			vq_err(vq, "Failed to write used len");
 			return -EFAULT;
 		}
@@ -2168,6 +2684,89 @@ static int __vhost_add_used_n(struct vhost_virtqueue *vq,
 	return 0;
 }
 
+/* Write used entries back into a packed ring.  Each one goes to the slot
+ * of the next buffer and the used index then skips over the descriptors
+ * that buffer took.  The flags of the first entry are written last so the
+ * guest sees the whole batch at once. */
+static int vhost_add_used_n_packed(struct vhost_virtqueue *vq,
+				   struct vring_used_elem *heads,
+				   unsigned count)
+{
+	struct vring_packed_desc __user *desc, *first = NULL;
+	__le16 flags, uninitialized_var(first_flags);
+	unsigned int i;
+	u16 id;
+
+	for (i = 0; i < count; i++) {
+		id = vhost32_to_cpu(vq, heads[i].id);
+		if (unlikely(id >= vq->num || !vq->desc_count[id])) {
+			vq_err(vq, "Used buffer id %u is not in flight", id);
+			return -EINVAL;
+		}
+
+		desc = vq->desc_packed + vq->last_used_idx;
+		flags = cpu_to_le16(vq->last_used_wrap_counter ?
+				    (1 << VRING_PACKED_DESC_F_AVAIL |
+				     1 << VRING_PACKED_DESC_F_USED) : 0);
+
+		if (vhost_put_desc(vq, cpu_to_le16(id), &desc->id) ||
+		    vhost_put_desc(vq, cpu_to_le32(vhost32_to_cpu(vq,
+							heads[i].len)),
+				   &desc->len)) {
+			vq_err(vq, "Failed to write used desc");
+			return -EFAULT;
+		}
+
+		if (!first) {
+			first = desc;
+			first_flags = flags;
+		} else {
+			if (vhost_put_desc(vq, flags, &desc->flags)) {
+				vq_err(vq, "Failed to write used flags");
+				return -EFAULT;
+			}
+			if (unlikely(vq->log_used)) {
+				/* Make sure data is seen before log. */
+				smp_wmb();
+				log_write(vq->log_base, vq->log_addr +
+					  ((void __user *)desc -
+					   (void __user *)vq->desc_packed),
+					  sizeof *desc);
+			}
+		}
+
+		vq->last_used_idx += vq->desc_count[id];
+		if (vq->last_used_idx >= vq->num) {
+			vq->last_used_idx -= vq->num;
+			vq->last_used_wrap_counter ^= 1;
+			/* vring_need_event() cannot compare across a wrap. */
+			vq->signalled_used_valid = false;
+		}
+		vq->desc_count[id] = 0;
+	}
+
+	if (!first)
+		return 0;
+
+	/* Make sure the rest of the batch is written before its head. */
+	smp_wmb();
+	if (vhost_put_desc(vq, first_flags, &first->flags)) {
+		vq_err(vq, "Failed to write used flags");
+		return -EFAULT;
+	}
+	if (unlikely(vq->log_used)) {
+		/* Make sure data is seen before log. */
+		smp_wmb();
+		log_write(vq->log_base, vq->log_addr +
+			  ((void __user *)first -
+			   (void __user *)vq->desc_packed),
+			  sizeof *first);
+		if (vq->log_ctx)
+			eventfd_signal(vq->log_ctx, 1);
+	}
+	return 0;
+}
+
 /* After we've used one of their buffers, we tell them about it.  We'll then
  * want to notify the guest, using eventfd. */
 int vhost_add_used_n(struct vhost_virtqueue *vq, struct vring_used_elem *heads,
@@ -2175,6 +2774,9 @@ int vhost_add_used_n(struct vhost_virtqueue *vq, struct vring_used_elem *heads,
 {
 	int start, n, r;
 
+	if (vhost_vq_is_packed(vq))
+		return vhost_add_used_n_packed(vq, heads, count);
+
 	start = vq->last_used_idx & (vq->num - 1);
 	n = vq->num - start;
 	if (n < count) {
@@ -2188,7 +2790,7 @@ int vhost_add_used_n(struct vhost_virtqueue *vq, struct vring_used_elem *heads,
 
 	/* Make sure buffer is written before we update index. */
 	smp_wmb();
-	if (vhost_put_user(vq, cpu_to_vhost16(vq, vq->last_used_idx),
+	if (vhost_put_used(vq, cpu_to_vhost16(vq, vq->last_used_idx),
 			   &vq->used->idx)) {
 		vq_err(vq, "Failed to increment used idx");
 		return -EFAULT;
@@ -2205,11 +2807,58 @@ int vhost_add_used_n(struct vhost_virtqueue *vq, struct vring_used_elem *heads,
 }
 EXPORT_SYMBOL_GPL(vhost_add_used_n);
 
+static bool vhost_notify_packed(struct vhost_dev *dev,
+				struct vhost_virtqueue *vq)
+{
+	__le16 flags, off_wrap;
+	u16 old, new, event;
+	bool v;
+	/* Flush out used descriptor updates. This is paired
+	 * with the barrier that the Guest executes when enabling
+	 * interrupts. */
+	smp_mb();
+
+	if (vhost_get_avail(vq, flags, &vq->driver_event->flags)) {
+		vq_err(vq, "Failed to get driver event flags");
+		return true;
+	}
+	if (flags == cpu_to_le16(VRING_PACKED_EVENT_FLAG_DISABLE))
+		return false;
+	if (flags != cpu_to_le16(VRING_PACKED_EVENT_FLAG_DESC) ||
+	    !vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX))
+		return true;
+
+	old = vq->signalled_used;
+	v = vq->signalled_used_valid;
+	new = vq->signalled_used = vq->last_used_idx;
+	vq->signalled_used_valid = true;
+
+	if (unlikely(!v))
+		return true;
+
+	/* The guest writes the offset before the flags asking for it. */
+	smp_rmb();
+	if (vhost_get_avail(vq, off_wrap, &vq->driver_event->off_wrap)) {
+		vq_err(vq, "Failed to get driver event offset");
+		return true;
+	}
+	event = le16_to_cpu(off_wrap) & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if ((le16_to_cpu(off_wrap) >> VRING_PACKED_EVENT_F_WRAP_CTR) !=
+	    vq->last_used_wrap_counter)
+		event -= vq->num;
+
+	return vring_need_event(event, new, old);
+}
+
 static bool vhost_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 {
 	__u16 old, new;
 	__virtio16 event;
 	bool v;
+
+	if (vhost_vq_is_packed(vq))
+		return vhost_notify_packed(dev, vq);
+
 	/* Flush out used index updates. This is paired
 	 * with the barrier that the Guest executes when enabling
 	 * interrupts. */
@@ -2277,6 +2926,10 @@ bool vhost_vq_avail_empty(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	__virtio16 avail_idx;
 	int r;
 
+	if (vhost_vq_is_packed(vq))
+		return vhost_desc_avail_packed(vq, vq->last_avail_idx,
+					       vq->last_avail_wrap_counter) == 0;
+
 	if (vq->avail_idx != vq->last_avail_idx)
 		return false;
 
@@ -2298,6 +2951,19 @@ bool vhost_enable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	if (!(vq->used_flags & VRING_USED_F_NO_NOTIFY))
 		return false;
 	vq->used_flags &= ~VRING_USED_F_NO_NOTIFY;
+	if (vhost_vq_is_packed(vq)) {
+		r = vhost_update_device_event_packed(vq);
+		if (r) {
+			vq_err(vq, "Failed to enable notification at %p: %d\n",
+			       &vq->device_event->flags, r);
+			return false;
+		}
+		/* They could have slipped one in as we were doing that: make
+		 * sure it's written, then check again. */
+		smp_mb();
+		return vhost_desc_avail_packed(vq, vq->last_avail_idx,
+					       vq->last_avail_wrap_counter) > 0;
+	}
 	if (!vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX)) {
 		r = vhost_update_used_flags(vq);
 		if (r) {
@@ -2335,7 +3001,8 @@ void vhost_disable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	if (vq->used_flags & VRING_USED_F_NO_NOTIFY)
 		return;
 	vq->used_flags |= VRING_USED_F_NO_NOTIFY;
-	if (!vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX)) {
+	if (!vhost_has_feature(vq, VIRTIO_RING_F_EVENT_IDX) ||
+	    vhost_vq_is_packed(vq)) {
 		r = vhost_update_used_flags(vq);
 		if (r)
 			vq_err(vq, "Failed to enable notification at %p: %d\n",
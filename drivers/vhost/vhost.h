@@ -90,9 +90,20 @@ struct vhost_virtqueue {
 	/* The actual ring of buffers. */
 	struct mutex mutex;
 	unsigned int num;
-	struct vring_desc __user *desc;
-	struct vring_avail __user *avail;
-	struct vring_used __user *used;
+	/* A packed ring keeps descriptors and used entries in desc and its
+	 * event suppression structures in the avail and used areas. */
+	union {
+		struct vring_desc __user *desc;
+		struct vring_packed_desc __user *desc_packed;
+	};
+	union {
+		struct vring_avail __user *avail;
+		struct vring_packed_desc_event __user *driver_event;
+	};
+	union {
+		struct vring_used __user *used;
+		struct vring_packed_desc_event __user *device_event;
+	};
 	const struct vhost_umem_node *meta_iotlb[VHOST_NUM_ADDRS];
 	struct file *kick;
 	struct file *call;
@@ -124,6 +135,13 @@ struct vhost_virtqueue {
 	/* Last used index value we have signalled on */
 	bool signalled_used_valid;
 
+	/* Packed ring wrap counters of last_avail_idx and last_used_idx */
+	bool last_avail_wrap_counter;
+	bool last_used_wrap_counter;
+
+	/* Packed ring: number of descriptors used by each buffer id */
+	u16 *desc_count;
+
 	/* Log writes to used structure. */
 	bool log_used;
 	u64 log_addr;
@@ -157,6 +175,15 @@ struct vhost_msg_node {
 	struct list_head node;
 };
 
+/* A worker thread, shared by up to max_devs_per_worker devices of one owner */
+struct vhost_worker {
+	struct task_struct *task;
+	struct llist_head work_list;
+	struct mm_struct *mm;
+	struct list_head node;
+	int users;
+};
+
 struct vhost_dev {
 	struct mm_struct *mm;
 	struct mutex mutex;
@@ -164,8 +191,7 @@ struct vhost_dev {
 	int nvqs;
 	struct file *log_file;
 	struct eventfd_ctx *log_ctx;
-	struct llist_head work_list;
-	struct task_struct *worker;
+	struct vhost_worker *worker;
 	struct vhost_umem *umem;
 	struct vhost_umem *iotlb;
 	spinlock_t iotlb_lock;
@@ -242,6 +268,11 @@ static inline bool vhost_has_feature(struct vhost_virtqueue *vq, int bit)
 	return vq->acked_features & (1ULL << bit);
 }
 
+static inline bool vhost_vq_is_packed(struct vhost_virtqueue *vq)
+{
+	return vhost_has_feature(vq, VIRTIO_F_RING_PACKED);
+}
+
 static inline bool vhost_is_little_endian(struct vhost_virtqueue *vq)
 {
 	return vq->is_le;
@@ -17,8 +17,30 @@
 
 #include <uapi/linux/if_tun.h>
 
+#define TUN_MSG_UBUF 1
+#define TUN_MSG_PTR  2
+
+/* Passed in msghdr->msg_control to the sendmsg() of tun and macvtap
+ * sockets. TUN_MSG_UBUF carries the zerocopy ubuf_info of a single packet,
+ * TUN_MSG_PTR an array of @num struct tun_msg_pkt sent in one call.
+ */
+struct tun_msg_ctl {
+	unsigned short type;
+	unsigned short num;
+	void *ptr;
+};
+
+struct tun_msg_pkt {
+	struct iovec *iov;
+	unsigned int iovlen;
+	size_t len;
+};
+
+struct skb_array;
+
 #if defined(CONFIG_TUN) || defined(CONFIG_TUN_MODULE)
 struct socket *tun_get_socket(struct file *);
+struct skb_array *tun_get_skb_array(struct file *file);
 #else
 #include <linux/err.h>
 #include <linux/errno.h>
@@ -28,5 +50,9 @@ static inline struct socket *tun_get_socket(struct file *f)
 {
 	return ERR_PTR(-EINVAL);
 }
+static inline struct skb_array *tun_get_skb_array(struct file *f)
+{
+	return ERR_PTR(-EINVAL);
+}
 #endif /* CONFIG_TUN */
 #endif /* __IF_TUN_H */
@@ -25,6 +25,7 @@
 #include <linux/irqflags.h>
 #include <linux/context_tracking.h>
 #include <linux/irqbypass.h>
+#include <linux/hashtable.h>
 #include <asm/signal.h>
 
 #include <linux/kvm.h>
@@ -33,6 +34,7 @@
 #include <linux/kvm_types.h>
 
 #include <asm/kvm_host.h>
+#include <linux/kvm_dirty_ring.h>
 
 #ifndef KVM_MMIO_SIZE
 #define KVM_MMIO_SIZE 8
@@ -165,6 +167,9 @@ struct kvm_io_range {
 
 #define NR_IOBUS_DEVS 1000
 
+/* buckets for datamatch ioeventfds, see virt/kvm/eventfd.c */
+#define KVM_IOEVENTFD_HASH_BITS 8
+
 struct kvm_io_bus {
 	int dev_count;
 	int ioeventfd_count;
@@ -227,6 +232,13 @@ struct kvm_mmio_fragment {
 	unsigned len;
 };
 
+/*
+ * Halt-to-wakeup intervals are counted in log2 buckets of microseconds:
+ * bucket 0 is below 1us, bucket n covers [2^(n-1), 2^n) us and the last
+ * bucket takes everything longer.
+ */
+#define KVM_HALT_HIST_BUCKETS	16
+
 struct kvm_vcpu {
 	struct kvm *kvm;
 #ifdef CONFIG_PREEMPT_NOTIFIERS
@@ -254,6 +266,9 @@ struct kvm_vcpu {
 	sigset_t sigset;
 	struct kvm_vcpu_stat stat;
 	unsigned int halt_poll_ns;
+	/* Running average of halts woken within the poll window, 1024 = all */
+	unsigned int halt_poll_success_avg;
+	u64 halt_hist[KVM_HALT_HIST_BUCKETS];
 
 #ifdef CONFIG_HAS_IOMEM
 	int mmio_needed;
@@ -288,6 +303,7 @@ struct kvm_vcpu {
 	bool preempted;
 	struct kvm_vcpu_arch arch;
 	struct dentry *debugfs_dentry;
+	struct kvm_dirty_ring dirty_ring;
 };
 
 static inline int kvm_vcpu_exiting_guest_mode(struct kvm_vcpu *vcpu)
@@ -309,6 +325,7 @@ struct kvm_memory_slot {
 	unsigned long userspace_addr;
 	u32 flags;
 	short id;
+	u16 as_id;
 };
 
 static inline unsigned long kvm_dirty_bitmap_bytes(struct kvm_memory_slot *memslot)
@@ -373,8 +390,21 @@ struct kvm_memslots {
 	int used_slots;
 };
 
+/* Halt-polling policy; KVM_CAP_HALT_POLL may override max_ns per VM */
+struct kvm_halt_poll {
+	unsigned int max_ns;
+	unsigned int grow;
+	unsigned int shrink;
+	/* Stop polling below this percentage of halts woken within max_ns */
+	unsigned int min_success;
+};
+
 struct kvm {
+#ifdef KVM_HAVE_MMU_RWLOCK
+	rwlock_t mmu_lock;
+#else
 	spinlock_t mmu_lock;
+#endif /* KVM_HAVE_MMU_RWLOCK */
 	struct mutex slots_lock;
 	struct mm_struct *mm; /* userspace tied to this vm */
 	struct kvm_memslots *memslots[KVM_ADDRESS_SPACE_NUM];
@@ -394,6 +424,8 @@ struct kvm {
 		struct mutex      resampler_lock;
 	} irqfds;
 	struct list_head ioeventfds;
+	struct list_head ioeventfd_groups;
+	DECLARE_HASHTABLE(ioeventfd_hash, KVM_IOEVENTFD_HASH_BITS);
 #endif
 	struct kvm_vm_stat stat;
 	struct kvm_arch arch;
@@ -424,6 +456,11 @@ struct kvm {
 	struct list_head devices;
 	struct dentry *debugfs_dentry;
 	struct kvm_stat_data **debugfs_stat_data;
+	/* Size of each vcpu dirty ring in bytes, 0 if not enabled */
+	u32 dirty_ring_size;
+	/* Set once userspace configured halt_poll with KVM_CAP_HALT_POLL */
+	bool override_halt_poll_ns;
+	unsigned int max_halt_poll_ns;
 };
 
 #define kvm_err(fmt, ...) \
@@ -475,6 +512,7 @@ void kvm_vcpu_uninit(struct kvm_vcpu *vcpu);
 
 int __must_check vcpu_load(struct kvm_vcpu *vcpu);
 void vcpu_put(struct kvm_vcpu *vcpu);
+struct kvm_vcpu *kvm_get_running_vcpu(void);
 
 #ifdef __KVM_HAVE_IOAPIC
 void kvm_vcpu_request_scan_ioapic(struct kvm *kvm);
@@ -1115,6 +1153,7 @@ extern bool kvm_rebooting;
 extern unsigned int halt_poll_ns;
 extern unsigned int halt_poll_ns_grow;
 extern unsigned int halt_poll_ns_shrink;
+extern unsigned int halt_poll_min_success;
 
 struct kvm_device {
 	struct kvm_device_ops *ops;
@@ -2195,7 +2195,10 @@ struct napi_gro_cb {
 	/* Used to determine if flush_id can be ignored */
 	u8	is_atomic:1;
 
-	/* 2 bit hole */
+	/* Merged as plain UDP datagrams (UDP_GRO), not as a tunnel */
+	u8	is_udp_l4:1;
+
+	/* 1 bit hole */
 
 	/* used to support CHECKSUM_COMPLETE for tunneling protocols */
 	__wsum	csum;
@@ -3272,6 +3275,8 @@ int netdev_rx_handler_register(struct net_device *dev,
 			       rx_handler_func_t *rx_handler,
 			       void *rx_handler_data);
 void netdev_rx_handler_unregister(struct net_device *dev);
+int netdev_flow_offload_register(rx_handler_func_t *hook);
+void netdev_flow_offload_unregister(void);
 
 bool dev_valid_name(const char *name);
 int dev_ioctl(struct net *net, unsigned int cmd, void __user *);
@@ -4086,6 +4091,12 @@ static inline bool net_gso_ok(netdev_features_t features, int gso_type)
 
 static inline bool skb_gso_ok(struct sk_buff *skb, netdev_features_t features)
 {
+	/* NETIF_F_UFO means IP fragmentation, which is not what a UDP
+	 * segmentation packet wants: always split those in software.
+	 */
+	if (unlikely(skb_shinfo(skb)->tx_flags & SKBTX_GSO_UDP_L4))
+		return false;
+
 	return net_gso_ok(features, skb_shinfo(skb)->gso_type) &&
 	       (!skb_has_frag_list(skb) || (features & NETIF_F_FRAGLIST));
 }
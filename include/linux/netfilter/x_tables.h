@@ -211,6 +211,22 @@ struct xt_table {
 
 #include <linux/netfilter_ipv4.h>
 
+struct xt_classifier_stats {
+	u64	packets;	/* packets that traversed the table */
+	u64	evaluated;	/* rules looked at for those packets */
+};
+
+/* Optional lookup index over a loaded ruleset.  Built by the family's
+ * table code after the entries have been checked, released together with
+ * the xt_table_info that holds it.
+ */
+struct xt_classifier {
+	/* rules covered by the index, 0 if only stats are kept */
+	unsigned int				rules;
+	struct xt_classifier_stats __percpu	*stats;
+	void (*destroy)(struct xt_classifier *cls);
+};
+
 /* The table itself */
 struct xt_table_info {
 	/* Size per table */
@@ -232,6 +248,8 @@ struct xt_table_info {
 	unsigned int __percpu *stackptr;
 	void ***jumpstack;
 
+	RH_KABI_EXTEND(struct xt_classifier *classifier)
+
 	unsigned char entries[0] __aligned(8);
 };
 
@@ -272,6 +290,8 @@ struct xt_table_info *xt_replace_table(struct xt_table *table,
 				       struct xt_table_info *newinfo,
 				       int *error);
 
+extern atomic_t xt_table_gen;
+
 struct xt_match *xt_find_match(u8 af, const char *name, u8 revision);
 struct xt_target *xt_find_target(u8 af, const char *name, u8 revision);
 struct xt_match *xt_request_find_match(u8 af, const char *name, u8 revision);
@@ -422,6 +422,12 @@ enum {
 	 * all frags to avoid possible bad checksum
 	 */
 	SKBTX_SHARED_FRAG = 1 << 5,
+
+	/* SKB_GSO_UDP packet that is split into UDP datagrams of gso_size
+	 * bytes each (UDP_SEGMENT, UDP GRO) rather than IP fragmented.
+	 * There is no free gso_type bit left, so the distinction lives here.
+	 */
+	SKBTX_GSO_UDP_L4 = 1 << 6,
 };
 
 #define SKBTX_ANY_SW_TSTAMP	SKBTX_SW_TSTAMP
@@ -3714,6 +3720,18 @@ static inline bool skb_is_gso_v6(const struct sk_buff *skb)
 	return skb_shinfo(skb)->gso_type & SKB_GSO_TCPV6;
 }
 
+static inline bool skb_is_gso_udp_l4(const struct sk_buff *skb)
+{
+	return skb_is_gso(skb) &&
+	       (skb_shinfo(skb)->tx_flags & SKBTX_GSO_UDP_L4);
+}
+
+static inline void skb_set_gso_udp_l4(struct sk_buff *skb)
+{
+	skb_shinfo(skb)->gso_type |= SKB_GSO_UDP;
+	skb_shinfo(skb)->tx_flags |= SKBTX_GSO_UDP_L4;
+}
+
 void __skb_warn_lro_forwarding(const struct sk_buff *skb);
 
 static inline bool skb_warn_if_lro(const struct sk_buff *skb)
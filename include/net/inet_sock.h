@@ -112,6 +112,7 @@ struct inet_cork {
 	__u8			ttl;
 	__s16			tos;
 	char			priority;
+	RH_KABI_FILL_HOLE(__u16 gso_size)
 };
 
 struct inet_cork_full {
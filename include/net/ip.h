@@ -63,6 +63,7 @@ struct ipcm_cookie {
 	__u8			ttl;
 	__s16			tos;
 	char			priority;
+	RH_KABI_FILL_HOLE(__u16 gso_size)
 };
 
 #define IPCB(skb) ((struct inet_skb_parm*)((skb)->cb))
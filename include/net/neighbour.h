@@ -119,9 +119,14 @@ struct neigh_statistics {
 	unsigned long forced_gc_runs;	/* number of forced GC runs */
 
 	unsigned long unres_discards;	/* number of unresolved drops */
+
+	unsigned long gc_scanned;	/* entries examined by GC */
+	unsigned long gc_usecs;		/* time spent in GC */
 };
 
 #define NEIGH_CACHE_STAT_INC(tbl, field) this_cpu_inc((tbl)->stats->field)
+#define NEIGH_CACHE_STAT_ADD(tbl, field, val) \
+	this_cpu_add((tbl)->stats->field, (val))
 
 struct neighbour {
 	struct neighbour __rcu	*next;
@@ -147,6 +152,7 @@ struct neighbour {
 	const struct neigh_ops	*ops;
 	struct rcu_head		rcu;
 	struct net_device	*dev;
+	struct list_head	gc_list;
 	u8			primary_key[0];
 };
 
@@ -209,6 +215,11 @@ struct neigh_table {
 	struct neigh_statistics	__percpu *stats;
 	struct neigh_hash_table __rcu *nht;
 	struct pneigh_entry	**phash_buckets;
+	/* entries the forced GC may evict, oldest first */
+	struct list_head	gc_list;
+	atomic_t		gc_entries;
+	/* next hash bucket for the periodic GC */
+	unsigned int		gc_bucket;
 };
 
 static inline int neigh_parms_family(struct neigh_parms *p)
@@ -13,6 +13,7 @@
 #define _NF_CONNTRACK_CORE_H
 
 #include <linux/netfilter.h>
+#include <linux/workqueue.h>
 #include <net/netfilter/nf_conntrack_l3proto.h>
 #include <net/netfilter/nf_conntrack_l4proto.h>
 #include <net/netfilter/nf_conntrack_ecache.h>
@@ -23,6 +24,17 @@
 unsigned int nf_conntrack_in(struct net *net, u_int8_t pf, unsigned int hooknum,
 			     struct sk_buff *skb);
 
+/* Per-netns conntrack core state kept outside of struct netns_ct,
+ * see net_generic(net, nf_conntrack_net_id).
+ */
+struct nf_conntrack_net {
+	struct delayed_work	gc_work;
+	struct net		*net;
+	unsigned int		gc_next_bucket;
+};
+
+extern int nf_conntrack_net_id;
+
 int nf_conntrack_init_net(struct net *net);
 void nf_conntrack_cleanup_net(struct net *net);
 void nf_conntrack_cleanup_net_list(struct list_head *net_exit_list);
@@ -197,11 +197,13 @@ struct nft_set_desc {
  *	enum nft_set_class - performance class
  *
  *	@NFT_LOOKUP_O_1: constant, O(1)
+ *	@NFT_LOOKUP_O_LOG_N_NOLOCK: logarithmic, O(log N), lockless lookups
  *	@NFT_LOOKUP_O_LOG_N: logarithmic, O(log N)
  *	@NFT_LOOKUP_O_N: linear, O(N)
  */
 enum nft_set_class {
 	NFT_SET_CLASS_O_1,
+	NFT_SET_CLASS_O_LOG_N_NOLOCK,
 	NFT_SET_CLASS_O_LOG_N,
 	NFT_SET_CLASS_O_N,
 };
@@ -229,6 +231,7 @@ struct nft_expr;
  *	@activate: activate new element in the next generation
  *	@deactivate: deactivate element in the next generation
  *	@remove: remove element from set
+ *	@commit: prepare lookups for the next generation, called before it starts
  *	@walk: iterate over all set elemeennts
  *	@privsize: function to return size of set private data
  *	@init: initialize private data of new set instance
@@ -259,6 +262,7 @@ struct nft_set_ops {
 						      const struct nft_set_elem *elem);
 	void				(*remove)(const struct nft_set *set,
 						  const struct nft_set_elem *elem);
+	void				(*commit)(const struct nft_set *set);
 	void				(*walk)(const struct nft_ctx *ctx,
 						const struct nft_set *set,
 						struct nft_set_iter *iter);
@@ -366,6 +366,8 @@ enum {
 	TCA_HTB_RATE64,
 	TCA_HTB_CEIL64,
 	TCA_HTB_PAD,
+	TCA_HTB_PERCPU,		/* flag: lockless per-cpu enqueue */
+	TCA_HTB_DEQUEUE_BATCH,	/* u32: max packets per class visit */
 	__TCA_HTB_MAX,
 };
 
@@ -124,7 +124,10 @@ struct vhost_memory {
 #define VHOST_SET_VRING_NUM _IOW(VHOST_VIRTIO, 0x10, struct vhost_vring_state)
 /* Set addresses for the ring. */
 #define VHOST_SET_VRING_ADDR _IOW(VHOST_VIRTIO, 0x11, struct vhost_vring_addr)
-/* Base value where queue looks for available descriptors */
+/* Base value where queue looks for available descriptors.  For a packed
+ * ring (VIRTIO_F_RING_PACKED) the low 16 bits hold the next available
+ * descriptor index with its wrap counter in bit 15, and the high 16 bits
+ * the next used descriptor index and wrap counter in the same format. */
 #define VHOST_SET_VRING_BASE _IOW(VHOST_VIRTIO, 0x12, struct vhost_vring_state)
 /* Get accessor: reads index, writes value in num */
 #define VHOST_GET_VRING_BASE _IOWR(VHOST_VIRTIO, 0x12, struct vhost_vring_state)
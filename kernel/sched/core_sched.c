@@ -0,0 +1,391 @@
+/*
+ * Core scheduling
+ *
+ * SMT siblings share the caches and execution resources of their core, so
+ * a task can observe whatever runs on the other hardware threads. Core
+ * scheduling gives tasks that trust each other the same cookie and only
+ * lets siblings run tasks with matching cookies at the same time; a sibling
+ * with nothing compatible to run is forced idle until the core frees up.
+ *
+ * Cookies come from the cpu cgroup (cpu.core_tag) or from
+ * prctl(PR_SCHED_CORE). The default cookie 0 only matches itself.
+ *
+ * The core-wide state lives in the rq of the first cpu of the SMT mask and
+ * is serialized by its core_lock, which nests inside rq->lock.
+ */
+
+#include <linux/cgroup.h>
+#include <linux/prctl.h>
+#include <linux/ptrace.h>
+#include <linux/uaccess.h>
+
+#include "sched.h"
+
+struct static_key __sched_core_enabled = STATIC_KEY_INIT_FALSE;
+
+static DEFINE_MUTEX(sched_core_mutex);
+static bool sched_core_active;
+static atomic_long_t sched_core_cookie_seq;
+
+/*
+ * Core scheduling is switched on by the first cookie handed out and stays
+ * on; untagged systems never pay for the core-wide pick.
+ */
+static void sched_core_get(void)
+{
+	mutex_lock(&sched_core_mutex);
+	if (!sched_core_active) {
+		sched_core_active = true;
+		static_key_slow_inc(&__sched_core_enabled);
+	}
+	mutex_unlock(&sched_core_mutex);
+}
+
+static unsigned long sched_core_alloc_cookie(void)
+{
+	return atomic_long_inc_return(&sched_core_cookie_seq);
+}
+
+static inline struct rq *sched_core_rq(struct rq *rq)
+{
+	return cpu_rq(cpumask_first(cpu_smt_mask(cpu_of(rq))));
+}
+
+static void sched_core_kick(int cpu)
+{
+	WRITE_ONCE(cpu_rq(cpu)->core_kick, 1);
+	smp_send_reschedule(cpu);
+}
+
+/*
+ * Make the siblings re-pick when the core state changed under them: a
+ * forced idle sibling may now run, a running one may no longer match.
+ */
+static void sched_core_kick_siblings(struct rq *rq, struct rq *core)
+{
+	int cpu = cpu_of(rq);
+	int i;
+
+	for_each_cpu(i, cpu_smt_mask(cpu)) {
+		struct rq *srq = cpu_rq(i);
+
+		if (i == cpu)
+			continue;
+
+		if (srq->core_forceidle ||
+		    (srq->core_owner &&
+		     srq->core_run_cookie != core->core_cookie))
+			sched_core_kick(i);
+	}
+}
+
+/*
+ * Has a forced idle sibling waited long enough for a task that is at least
+ * as important as @prio? Then the core should be handed over to it.
+ */
+static bool sched_core_starved(struct rq *rq, int prio, u64 now)
+{
+	int cpu = cpu_of(rq);
+	int i;
+
+	for_each_cpu(i, cpu_smt_mask(cpu)) {
+		struct rq *srq = cpu_rq(i);
+
+		if (i == cpu || !srq->core_forceidle ||
+		    !READ_ONCE(srq->nr_running))
+			continue;
+
+		if (srq->core_wait_prio <= prio &&
+		    now - srq->core_wait_start >= sysctl_sched_min_granularity)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * A forced idle sibling is waiting with something more important than
+ * @prio: kick it so it can preempt, however briefly it has waited.
+ */
+static void sched_core_kick_outranking(struct rq *rq, int prio)
+{
+	int cpu = cpu_of(rq);
+	int i;
+
+	for_each_cpu(i, cpu_smt_mask(cpu)) {
+		struct rq *srq = cpu_rq(i);
+
+		if (i == cpu || !srq->core_forceidle ||
+		    !READ_ONCE(srq->nr_running))
+			continue;
+
+		if (srq->core_wait_prio < prio)
+			sched_core_kick(i);
+	}
+}
+
+static void sched_core_take(struct rq *rq, struct rq *core,
+			    struct task_struct *p)
+{
+	core->core_cookie = p->core_cookie;
+	core->core_busy++;
+	rq->core_owner = core;
+	rq->core_run_cookie = p->core_cookie;
+	rq->core_prio = p->prio;
+}
+
+/*
+ * Called by __schedule() with rq->lock held once @next has been picked.
+ * Returns the task to run: @next when it may run next to what the siblings
+ * are running, otherwise a queued task with a matching cookie, or NULL when
+ * this cpu has to go (or stay) forced idle.
+ *
+ * A cpu may take the core when nothing else runs on it, or join with a
+ * matching cookie. A mismatching task only preempts the siblings when it
+ * is strictly more important than all of them. A cpu that has been kept
+ * idle for longer than the minimum granularity gets the core handed over
+ * the next time it is free, and one waiting for a more important task than
+ * the one taking the core is kicked right away.
+ *
+ * A cpu whose best task is held back stays marked forced idle even while
+ * it runs a compatible task in the meantime, so that the held back task
+ * keeps its claim on the core.
+ */
+struct task_struct *sched_core_pick(struct rq *rq, struct task_struct *next)
+{
+	struct rq *core = sched_core_rq(rq);
+	bool was_forceidle = rq->core_forceidle;
+	int cpu = cpu_of(rq);
+	unsigned long old_cookie;
+	bool preempt = false;
+	u64 now = local_clock();
+	int i;
+
+	raw_spin_lock(&core->core_lock);
+	old_cookie = core->core_cookie;
+
+	rq->core_kick = 0;
+	rq->core_forceidle = 0;
+
+	if (rq->core_owner) {
+		rq->core_owner->core_busy--;
+		rq->core_owner = NULL;
+	}
+
+	/* The stopper always runs; it must never wait for a sibling. */
+	if (next == rq->idle || next->sched_class == &stop_sched_class)
+		goto unlock;
+
+	if (!core->core_busy) {
+		if (sched_core_starved(rq, next->prio, now))
+			goto force_idle;
+		goto take;
+	}
+
+	if (next->core_cookie == core->core_cookie)
+		goto take;
+
+	for_each_cpu(i, cpu_smt_mask(cpu)) {
+		struct rq *srq = cpu_rq(i);
+
+		if (i == cpu || !srq->core_owner)
+			continue;
+
+		if (srq->core_prio <= next->prio)
+			goto force_idle;
+	}
+	preempt = true;
+
+take:
+	sched_core_take(rq, core, next);
+	sched_core_kick_outranking(rq, next->prio);
+	goto unlock;
+
+force_idle:
+	rq->core_forceidle = 1;
+	rq->core_wait_prio = next->prio;
+	if (!was_forceidle)
+		rq->core_wait_start = now;
+
+	next->sched_class->put_prev_task(rq, next);
+	next = NULL;
+
+	/*
+	 * While the siblings keep the core, run a queued task that may share
+	 * it rather than wasting the thread. A free core is left to the
+	 * starved sibling.
+	 */
+	if (core->core_busy) {
+		next = pick_next_task_fair_cookie(rq, core->core_cookie);
+		if (next) {
+			sched_core_take(rq, core, next);
+			sched_core_kick_outranking(rq, next->prio);
+		}
+	}
+
+unlock:
+	if (preempt || !core->core_busy || core->core_cookie != old_cookie)
+		sched_core_kick_siblings(rq, core);
+	raw_spin_unlock(&core->core_lock);
+
+	return next;
+}
+
+/*
+ * Called from scheduler_tick() with rq->lock held: a task that keeps the
+ * core while a sibling is being starved is asked to reschedule, so the core
+ * is handed over on its next pick.
+ */
+void sched_core_tick(struct rq *rq)
+{
+	struct rq *core;
+
+	if (!rq->core_owner)
+		return;
+
+	core = sched_core_rq(rq);
+	raw_spin_lock(&core->core_lock);
+	if (sched_core_starved(rq, rq->core_prio, local_clock()))
+		resched_curr(rq);
+	raw_spin_unlock(&core->core_lock);
+}
+
+static void __sched_core_set_cookie(struct task_struct *p, unsigned long cookie)
+{
+	unsigned long flags;
+	struct rq *rq;
+
+	rq = task_rq_lock(p, &flags);
+	p->core_cookie = cookie;
+	/* Let the core re-evaluate what may run next to @p. */
+	if (task_running(rq, p))
+		resched_curr(rq);
+	task_rq_unlock(rq, p, &flags);
+}
+
+#ifdef CONFIG_CGROUP_SCHED
+/*
+ * cpu.core_tag: all tasks of a tagged cgroup share one cookie. Tagging
+ * overrides cookies set through prctl; untagging clears them.
+ */
+int sched_core_tag_cgroup(struct cgroup *cgrp, struct task_group *tg, u64 val)
+{
+	struct cgroup_iter it;
+	struct task_struct *p;
+	unsigned long cookie;
+
+	if (val > 1)
+		return -ERANGE;
+
+	if (tg == &root_task_group)
+		return -EINVAL;
+
+	if (val)
+		sched_core_get();
+
+	mutex_lock(&sched_core_mutex);
+	if (!!tg->core_cookie == !!val) {
+		mutex_unlock(&sched_core_mutex);
+		return 0;
+	}
+
+	cookie = val ? sched_core_alloc_cookie() : 0;
+	WRITE_ONCE(tg->core_cookie, cookie);
+	cgroup_iter_start(cgrp, &it);
+	while ((p = cgroup_iter_next(cgrp, &it)))
+		__sched_core_set_cookie(p, cookie);
+	cgroup_iter_end(cgrp, &it);
+	mutex_unlock(&sched_core_mutex);
+
+	return 0;
+}
+
+/*
+ * @p moves to @tg: it picks up the new group's cookie, and drops the old
+ * group's one. Cookies set through prctl survive moves between untagged
+ * groups.
+ */
+void sched_core_cgroup_move(struct task_struct *p, struct task_group *tg)
+{
+	struct task_group *old = p->sched_task_group;
+	unsigned long cookie = READ_ONCE(tg->core_cookie);
+
+	if (!cookie && (!old->core_cookie || p->core_cookie != old->core_cookie))
+		return;
+
+	if (p->core_cookie != cookie)
+		__sched_core_set_cookie(p, cookie);
+}
+#endif /* CONFIG_CGROUP_SCHED */
+
+/*
+ * prctl(PR_SCHED_CORE, cmd, pid, 0, uaddr)
+ *
+ *  PR_SCHED_CORE_GET:        store @pid's cookie at @uaddr
+ *  PR_SCHED_CORE_CREATE:     give @pid a new, unique cookie
+ *  PR_SCHED_CORE_SHARE_TO:   give @pid the caller's cookie
+ *  PR_SCHED_CORE_SHARE_FROM: give the caller @pid's cookie
+ *
+ * A @pid of 0 means the caller.
+ */
+int sched_core_share_pid(unsigned int cmd, pid_t pid, unsigned long uaddr)
+{
+	struct task_struct *task;
+	unsigned long cookie;
+	int err = 0;
+
+	rcu_read_lock();
+	if (pid == 0) {
+		task = current;
+	} else {
+		task = find_task_by_vpid(pid);
+		if (!task) {
+			rcu_read_unlock();
+			return -ESRCH;
+		}
+	}
+	get_task_struct(task);
+	rcu_read_unlock();
+
+	/*
+	 * Check if this process has the right to modify the specified
+	 * process. Use the regular "ptrace_may_access()" checks.
+	 */
+	if (!ptrace_may_access(task, PTRACE_MODE_READ)) {
+		err = -EPERM;
+		goto out;
+	}
+
+	switch (cmd) {
+	case PR_SCHED_CORE_GET:
+		if (put_user(task->core_cookie, (unsigned long __user *)uaddr))
+			err = -EFAULT;
+		break;
+
+	case PR_SCHED_CORE_CREATE:
+		sched_core_get();
+		__sched_core_set_cookie(task, sched_core_alloc_cookie());
+		break;
+
+	case PR_SCHED_CORE_SHARE_TO:
+		cookie = current->core_cookie;
+		if (cookie)
+			sched_core_get();
+		__sched_core_set_cookie(task, cookie);
+		break;
+
+	case PR_SCHED_CORE_SHARE_FROM:
+		cookie = task->core_cookie;
+		if (cookie)
+			sched_core_get();
+		__sched_core_set_cookie(current, cookie);
+		break;
+
+	default:
+		err = -EINVAL;
+	}
+
+out:
+	put_task_struct(task);
+	return err;
+}
@@ -268,38 +268,75 @@ static inline struct cfs_rq *group_cfs_rq(struct sched_entity *grp)
 static void update_cfs_rq_blocked_load(struct cfs_rq *cfs_rq,
 				       int force_update);
 
-static inline void list_add_leaf_cfs_rq(struct cfs_rq *cfs_rq)
+/*
+ * Add @cfs_rq to the leaf list so that every child appears before its
+ * parent, which update_blocked_averages() relies on to walk the hierarchy
+ * bottom-up. Returns true once the branch being added is connected to the
+ * rest of the list.
+ */
+static inline bool list_add_leaf_cfs_rq(struct cfs_rq *cfs_rq)
 {
-	if (!cfs_rq->on_list) {
-		/*
-		 * Ensure we either appear before our parent (if already
-		 * enqueued) or force our parent to appear after us when it is
-		 * enqueued.  The fact that we always enqueue bottom-up
-		 * reduces this to two cases.
-		 */
-		if (cfs_rq->tg->parent &&
-		    cfs_rq->tg->parent->cfs_rq[cpu_of(rq_of(cfs_rq))]->on_list) {
-			list_add_rcu(&cfs_rq->leaf_cfs_rq_list,
-				&rq_of(cfs_rq)->leaf_cfs_rq_list);
-		} else {
-			list_add_tail_rcu(&cfs_rq->leaf_cfs_rq_list,
-				&rq_of(cfs_rq)->leaf_cfs_rq_list);
-		}
+	struct rq *rq = rq_of(cfs_rq);
+	int cpu = cpu_of(rq);
+
+	if (cfs_rq->on_list)
+		return rq->tmp_alone_branch == &rq->leaf_cfs_rq_list;
+
+	cfs_rq->on_list = 1;
+	/* We should have no load, but we need to update last_decay. */
+	update_cfs_rq_blocked_load(cfs_rq, 0);
+
+	/*
+	 * The parent is already on the list: insert right before it, which
+	 * also puts the branch of children added so far (between
+	 * tmp_alone_branch and us) ahead of the parent.
+	 */
+	if (cfs_rq->tg->parent &&
+	    cfs_rq->tg->parent->cfs_rq[cpu]->on_list) {
+		list_add_tail_rcu(&cfs_rq->leaf_cfs_rq_list,
+			&(cfs_rq->tg->parent->cfs_rq[cpu]->leaf_cfs_rq_list));
+		rq->tmp_alone_branch = &rq->leaf_cfs_rq_list;
+		return true;
+	}
 
-		cfs_rq->on_list = 1;
-		/* We should have no load, but we need to update last_decay. */
-		update_cfs_rq_blocked_load(cfs_rq, 0);
+	/* The root cfs_rq goes last and closes the branch. */
+	if (!cfs_rq->tg->parent) {
+		list_add_tail_rcu(&cfs_rq->leaf_cfs_rq_list,
+			&rq->leaf_cfs_rq_list);
+		rq->tmp_alone_branch = &rq->leaf_cfs_rq_list;
+		return true;
 	}
+
+	/*
+	 * The parent is not on the list yet: add us after the children of
+	 * the current branch and remember where our parent has to go.
+	 */
+	list_add_rcu(&cfs_rq->leaf_cfs_rq_list, rq->tmp_alone_branch);
+	rq->tmp_alone_branch = &cfs_rq->leaf_cfs_rq_list;
+	return false;
 }
 
 static inline void list_del_leaf_cfs_rq(struct cfs_rq *cfs_rq)
 {
 	if (cfs_rq->on_list) {
+		struct rq *rq = rq_of(cfs_rq);
+
+		/* Don't leave the branch pointer on a removed entry. */
+		if (rq->tmp_alone_branch == &cfs_rq->leaf_cfs_rq_list)
+			rq->tmp_alone_branch = cfs_rq->leaf_cfs_rq_list.prev;
+
 		list_del_rcu(&cfs_rq->leaf_cfs_rq_list);
 		cfs_rq->on_list = 0;
 	}
 }
 
+static inline void assert_list_leaf_cfs_rq(struct rq *rq)
+{
+#ifdef CONFIG_SCHED_DEBUG
+	WARN_ON_ONCE(rq->tmp_alone_branch != &rq->leaf_cfs_rq_list);
+#endif
+}
+
 /* Iterate thr' all leaf cfs_rq's on a runqueue */
 #define for_each_leaf_cfs_rq(rq, cfs_rq) \
 	list_for_each_entry_rcu(cfs_rq, &rq->leaf_cfs_rq_list, leaf_cfs_rq_list)
@@ -398,14 +435,19 @@ static inline struct cfs_rq *group_cfs_rq(struct sched_entity *grp)
 	return NULL;
 }
 
-static inline void list_add_leaf_cfs_rq(struct cfs_rq *cfs_rq)
+static inline bool list_add_leaf_cfs_rq(struct cfs_rq *cfs_rq)
 {
+	return true;
 }
 
 static inline void list_del_leaf_cfs_rq(struct cfs_rq *cfs_rq)
 {
 }
 
+static inline void assert_list_leaf_cfs_rq(struct rq *rq)
+{
+}
+
 #define for_each_leaf_cfs_rq(rq, cfs_rq) \
 		for (cfs_rq = &rq->cfs; cfs_rq; cfs_rq = NULL)
 
@@ -3419,6 +3461,16 @@ void unthrottle_cfs_rq(struct cfs_rq *cfs_rq)
 	if (!se)
 		rq->nr_running += task_delta;
 
+	/*
+	 * A throttled ancestor stops the walk above before the branch of
+	 * newly listed cfs_rqs is connected; add the remaining parents.
+	 */
+	for_each_sched_entity(se) {
+		if (list_add_leaf_cfs_rq(cfs_rq_of(se)))
+			break;
+	}
+	assert_list_leaf_cfs_rq(rq);
+
 	/* determine whether we need to wake up potentially idle cpu */
 	if (rq->curr == rq->idle && rq->cfs.nr_running)
 		resched_curr(rq);
@@ -3959,6 +4011,20 @@ enqueue_task_fair(struct rq *rq, struct task_struct *p, int flags)
 		update_rq_runnable_avg(rq, rq->nr_running);
 		inc_nr_running(rq);
 	}
+
+	if (cfs_bandwidth_used()) {
+		/*
+		 * A throttled cfs_rq ends the walks above before the branch
+		 * of newly listed cfs_rqs is connected; add the remaining
+		 * parents.
+		 */
+		for_each_sched_entity(se) {
+			if (list_add_leaf_cfs_rq(cfs_rq_of(se)))
+				break;
+		}
+	}
+	assert_list_leaf_cfs_rq(rq);
+
 	hrtick_update(rq);
 }
 
@@ -4422,48 +4488,250 @@ find_idlest_cpu(struct sched_group *group, struct task_struct *p, int this_cpu)
 	return idlest;
 }
 
+DEFINE_PER_CPU(cpumask_var_t, select_idle_mask);
+
+/*
+ * Per-LLC "has idle cores" hint. There is no structure shared by all the
+ * cpus of an LLC in this tree, so the hint lives in the per-cpu slot of
+ * the LLC's first cpu, which is what sd_llc_id names.
+ */
+static DEFINE_PER_CPU(int, sd_llc_idle_cores);
+
+static inline void set_idle_cores(int cpu, int val)
+{
+	int llc = per_cpu(sd_llc_id, cpu);
+
+	if (per_cpu(sd_llc_idle_cores, llc) != val)
+		WRITE_ONCE(per_cpu(sd_llc_idle_cores, llc), val);
+}
+
+static inline bool test_idle_cores(int cpu, bool def)
+{
+	if (!rcu_dereference(per_cpu(sd_llc, cpu)))
+		return def;
+
+	return READ_ONCE(per_cpu(sd_llc_idle_cores, per_cpu(sd_llc_id, cpu)));
+}
+
+#ifdef CONFIG_SCHED_SMT
+/*
+ * Called when a cpu goes idle: if all of its SMT siblings are idle as
+ * well, advertise that this LLC has an idle core. The hint is cleared
+ * lazily by select_idle_core() once a scan fails to find one.
+ */
+void __update_idle_core(struct rq *rq)
+{
+	int core = cpu_of(rq);
+	int cpu;
+
+	rcu_read_lock();
+	if (test_idle_cores(core, true))
+		goto unlock;
+
+	for_each_cpu(cpu, cpu_smt_mask(core)) {
+		if (cpu == core)
+			continue;
+
+		if (!idle_cpu(cpu))
+			goto unlock;
+	}
+
+	set_idle_cores(core, 1);
+unlock:
+	rcu_read_unlock();
+}
+
+/*
+ * Scan the entire LLC domain for idle cores; this dynamically switches off
+ * if there are no idle cores left in the system; tracked through
+ * sd_llc_idle_cores and enabled through __update_idle_core() above.
+ */
+static int select_idle_core(struct task_struct *p, struct sched_domain *sd,
+			    int target)
+{
+	struct cpumask *cpus = __get_cpu_var(select_idle_mask);
+	struct rq *this_rq = this_rq();
+	int core, cpu;
+
+	if (!test_idle_cores(target, false))
+		return -1;
+
+	cpumask_and(cpus, sched_domain_span(sd), tsk_cpus_allowed(p));
+
+	for_each_cpu_wrap(core, cpus, target) {
+		bool idle = true;
+
+		for_each_cpu(cpu, cpu_smt_mask(core)) {
+			cpumask_clear_cpu(cpu, cpus);
+			schedstat_inc(this_rq, sis_scanned);
+			if (!idle_cpu(cpu))
+				idle = false;
+		}
+
+		if (idle)
+			return core;
+	}
+
+	/*
+	 * Failed to find an idle core; stop looking for one.
+	 */
+	set_idle_cores(target, 0);
+
+	return -1;
+}
+
+/*
+ * Scan the local SMT mask for idle CPUs.
+ */
+static int select_idle_smt(struct task_struct *p, struct sched_domain *sd,
+			   int target)
+{
+	struct rq *this_rq = this_rq();
+	int cpu;
+
+	for_each_cpu(cpu, cpu_smt_mask(target)) {
+		if (!cpumask_test_cpu(cpu, tsk_cpus_allowed(p)))
+			continue;
+		schedstat_inc(this_rq, sis_scanned);
+		if (idle_cpu(cpu))
+			return cpu;
+	}
+
+	return -1;
+}
+
+#else /* CONFIG_SCHED_SMT */
+
+static inline int select_idle_core(struct task_struct *p,
+				   struct sched_domain *sd, int target)
+{
+	return -1;
+}
+
+static inline int select_idle_smt(struct task_struct *p,
+				  struct sched_domain *sd, int target)
+{
+	return -1;
+}
+
+#endif /* CONFIG_SCHED_SMT */
+
+/*
+ * Scan the LLC domain for idle CPUs; this is dynamically regulated by
+ * comparing the average scan cost (tracked in sd->avg_scan_cost) against
+ * the average idle time for this rq (as found in rq->avg_idle).
+ */
+static int select_idle_cpu(struct task_struct *p, struct sched_domain *sd,
+			   int target)
+{
+	struct sched_domain *this_sd;
+	struct rq *this_rq = this_rq();
+	u64 avg_cost, avg_idle;
+	u64 time, cost;
+	s64 delta;
+	int cpu, nr = INT_MAX;
+
+	this_sd = rcu_dereference(__get_cpu_var(sd_llc));
+	if (!this_sd)
+		return -1;
+
+	/*
+	 * Due to large variance we need a large fuzz factor; hackbench in
+	 * particularly is sensitive here.
+	 */
+	avg_idle = this_rq->avg_idle / 512;
+	avg_cost = this_sd->avg_scan_cost + 1;
+
+	if (sched_feat(SIS_PROP)) {
+		u64 span_avg = sd->span_weight * avg_idle;
+
+		if (span_avg > 4 * avg_cost)
+			nr = div_u64(span_avg, avg_cost);
+		else
+			nr = 4;
+	}
+
+	time = local_clock();
+
+	for_each_cpu_wrap(cpu, sched_domain_span(sd), target) {
+		if (!--nr)
+			return -1;
+		if (!cpumask_test_cpu(cpu, tsk_cpus_allowed(p)))
+			continue;
+		schedstat_inc(this_rq, sis_scanned);
+		if (idle_cpu(cpu))
+			break;
+	}
+
+	time = local_clock() - time;
+	cost = this_sd->avg_scan_cost;
+	delta = (s64)(time - cost) / 8;
+	this_sd->avg_scan_cost += delta;
+
+	return cpu < nr_cpumask_bits ? cpu : -1;
+}
+
 /*
- * Try and locate an idle CPU in the sched_domain.
+ * Try and locate an idle core/thread in the LLC cache domain.
+ *
+ * The cheap candidates come first: the target itself, the cpu the task
+ * last ran on and the cpu it was last woken from, all provided they share
+ * the target's cache. Only then is the LLC scanned, first for a fully idle
+ * core, then for any idle cpu within the scan budget, and finally for an
+ * idle SMT sibling of the target.
  */
-static int select_idle_sibling(struct task_struct *p, int target)
+static int select_idle_sibling(struct task_struct *p, int prev, int target)
 {
 	struct sched_domain *sd;
-	struct sched_group *sg;
-	int i = task_cpu(p);
+	struct rq *this_rq = this_rq();
+	int i, recent_used_cpu;
+
+	schedstat_inc(this_rq, sis_search);
 
 	if (idle_cpu(target))
 		return target;
 
 	/*
-	 * If the prevous cpu is cache affine and idle, don't be stupid.
+	 * If the previous cpu is cache affine and idle, don't be stupid.
 	 */
-	if (i != target && cpus_share_cache(i, target) && idle_cpu(i))
-		return i;
+	if (prev != target && cpus_share_cache(prev, target) && idle_cpu(prev))
+		return prev;
+
+	/* Check a recently used CPU as a potential idle candidate */
+	recent_used_cpu = p->recent_used_cpu;
+	if (recent_used_cpu != prev &&
+	    recent_used_cpu != target &&
+	    cpus_share_cache(recent_used_cpu, target) &&
+	    idle_cpu(recent_used_cpu) &&
+	    cpumask_test_cpu(recent_used_cpu, tsk_cpus_allowed(p))) {
+		/*
+		 * Replace recent_used_cpu with prev as it is a potential
+		 * candidate for the next wake.
+		 */
+		p->recent_used_cpu = prev;
+		return recent_used_cpu;
+	}
 
-	/*
-	 * Otherwise, iterate the domains and find an elegible idle cpu.
-	 */
 	sd = rcu_dereference(per_cpu(sd_llc, target));
-	for_each_lower_domain(sd) {
-		sg = sd->groups;
-		do {
-			if (!cpumask_intersects(sched_group_cpus(sg),
-						tsk_cpus_allowed(p)))
-				goto next;
+	if (!sd)
+		return target;
 
-			for_each_cpu(i, sched_group_cpus(sg)) {
-				if (i == target || !idle_cpu(i))
-					goto next;
-			}
+	schedstat_inc(this_rq, sis_domain_search);
+
+	i = select_idle_core(p, sd, target);
+	if ((unsigned)i < nr_cpumask_bits)
+		return i;
+
+	i = select_idle_cpu(p, sd, target);
+	if ((unsigned)i < nr_cpumask_bits)
+		return i;
+
+	i = select_idle_smt(p, sd, target);
+	if ((unsigned)i < nr_cpumask_bits)
+		return i;
+
+	schedstat_inc(this_rq, sis_failed);
 
-			target = cpumask_first_and(sched_group_cpus(sg),
-					tsk_cpus_allowed(p));
-			goto done;
-next:
-			sg = sg->next;
-		} while (sg != sd->groups);
-	}
-done:
 	return target;
 }
 
@@ -4493,6 +4761,13 @@ select_task_rq_fair(struct task_struct *p, int prev_cpu, int sd_flag, int wake_f
 		new_cpu = prev_cpu;
 	}
 
+	/*
+	 * Remember the cpu the waker runs on; it is cache hot for the
+	 * waker and a cheap candidate when the waker itself is woken.
+	 */
+	if (want_affine)
+		current->recent_used_cpu = cpu;
+
 	rcu_read_lock();
 	for_each_domain(cpu, tmp) {
 		if (!(tmp->flags & SD_LOAD_BALANCE))
@@ -4513,10 +4788,12 @@ select_task_rq_fair(struct task_struct *p, int prev_cpu, int sd_flag, int wake_f
 	}
 
 	if (affine_sd) {
+		int target = prev_cpu;
+
 		if (cpu != prev_cpu && wake_affine(affine_sd, p, sync))
-			prev_cpu = cpu;
+			target = cpu;
 
-		new_cpu = select_idle_sibling(p, prev_cpu);
+		new_cpu = select_idle_sibling(p, prev_cpu, target);
 		goto unlock;
 	}
 
@@ -4778,6 +5055,37 @@ static struct task_struct *pick_next_task_fair(struct rq *rq)
 	return p;
 }
 
+#ifdef CONFIG_SCHED_CORE
+/*
+ * Core scheduling holds back the task this cpu would have picked. Rather
+ * than idling, run a queued fair task whose cookie matches what the SMT
+ * siblings are running. Called with nothing current on the rq.
+ */
+struct task_struct *pick_next_task_fair_cookie(struct rq *rq,
+					       unsigned long cookie)
+{
+	struct sched_entity *se;
+	struct task_struct *p;
+
+	list_for_each_entry(p, &rq->cfs_tasks, se.group_node) {
+		if (p->core_cookie != cookie ||
+		    throttled_hierarchy(cfs_rq_of(&p->se)))
+			continue;
+
+		se = &p->se;
+		for_each_sched_entity(se)
+			set_next_entity(cfs_rq_of(se), se);
+
+		if (hrtick_enabled(rq))
+			hrtick_start_fair(rq, p);
+
+		return p;
+	}
+
+	return NULL;
+}
+#endif
+
 /*
  * Account for a descheduled task:
  */
@@ -5313,6 +5621,25 @@ next:
 }
 
 #ifdef CONFIG_FAIR_GROUP_SCHED
+/*
+ * A cfs_rq is fully decayed once it holds no tasks and neither it nor its
+ * contribution to the task group carries any load; there is nothing left
+ * for update_blocked_averages() to do for it until something is enqueued.
+ */
+static inline bool cfs_rq_is_decayed(struct cfs_rq *cfs_rq)
+{
+	if (cfs_rq->load.weight || cfs_rq->nr_running)
+		return false;
+
+	if (cfs_rq->runnable_load_avg || cfs_rq->blocked_load_avg)
+		return false;
+
+	if (cfs_rq->tg_load_contrib || atomic64_read(&cfs_rq->removed_load))
+		return false;
+
+	return true;
+}
+
 /*
  * update tg->load_weight by folding this cpu's load_avg
  */
@@ -5328,17 +5655,19 @@ static void __update_blocked_averages_cpu(struct task_group *tg, int cpu)
 	update_cfs_rq_blocked_load(cfs_rq, 1);
 
 	if (se) {
+		/*
+		 * The group entity's contribution depends on tg->load_avg,
+		 * which other cpus move as well, so always re-evaluate it.
+		 */
 		update_entity_load_avg(se, 1);
+
 		/*
-		 * We pivot on our runnable average having decayed to zero for
-		 * list removal.  This generally implies that all our children
-		 * have also been removed (modulo rounding error or bandwidth
-		 * control); however, such cases are rare and we can fix these
-		 * at enqueue.
-		 *
-		 * TODO: fix up out-of-order children on enqueue.
+		 * Drop the cfs_rq from the leaf list once it and its group
+		 * entity have fully decayed. Its blocked load includes the
+		 * contribution of its children, so they have been removed
+		 * before us and the bottom-up order of the list is kept.
 		 */
-		if (!se->avg.runnable_avg_sum && !cfs_rq->nr_running)
+		if (!se->avg.runnable_avg_sum && cfs_rq_is_decayed(cfs_rq))
 			list_del_leaf_cfs_rq(cfs_rq);
 	} else {
 		struct rq *rq = rq_of(cfs_rq);
@@ -40,6 +40,7 @@ static struct task_struct *pick_next_task_idle(struct rq *rq)
 	/* Trigger the post schedule to do an idle_enter for CFS */
 	rq->post_schedule = 1;
 #endif
+	update_idle_core(rq);
 	return rq->idle;
 }
 
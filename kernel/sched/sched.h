@@ -8,6 +8,7 @@
 #include <linux/stop_machine.h>
 #include <linux/tick.h>
 #include <linux/slab.h>
+#include <linux/irq_work.h>
 
 #include <linux/rh_kabi.h>
 
@@ -270,6 +271,11 @@ struct task_group {
 	RH_KABI_EXTEND(atomic64_t load_avg ____cacheline_aligned_in_smp)
 	RH_KABI_EXTEND(atomic_t runnable_avg)
 #endif
+
+#ifdef CONFIG_SCHED_CORE
+	/* core scheduling cookie of the tasks in this group, 0 if untagged */
+	RH_KABI_EXTEND(unsigned long core_cookie)
+#endif
 };
 
 #ifdef CONFIG_FAIR_GROUP_SCHED
@@ -510,6 +516,14 @@ struct dl_rq {
  * object.
  *
  */
+/*
+ * Pulling RT tasks by having the overloaded cpus push them, kicked through
+ * a chained irq_work, avoids taking every overloaded rq's lock in turn.
+ */
+#ifdef CONFIG_IRQ_WORK
+#define HAVE_RT_PUSH_IPI
+#endif
+
 struct root_domain {
 	atomic_t refcount;
 	atomic_t rto_count;
@@ -534,10 +548,31 @@ struct root_domain {
 	RH_KABI_EXTEND(atomic_t dlo_count)
 	RH_KABI_EXTEND(struct dl_bw dl_bw)
 	RH_KABI_EXTEND(struct cpudl cpudl)
+
+#ifdef HAVE_RT_PUSH_IPI
+	/*
+	 * For IPI pull requests, loop across the rto_mask.
+	 */
+	RH_KABI_EXTEND(struct irq_work rto_push_work)
+	RH_KABI_EXTEND(raw_spinlock_t rto_lock)
+	/* These are only updated and read within rto_lock */
+	RH_KABI_EXTEND(int rto_loop)
+	RH_KABI_EXTEND(int rto_cpu)
+	/* These atomics are updated outside of a lock */
+	RH_KABI_EXTEND(atomic_t rto_loop_next)
+	RH_KABI_EXTEND(atomic_t rto_loop_start)
+#endif
 };
 
 extern struct root_domain def_root_domain;
 
+extern void sched_get_rd(struct root_domain *rd);
+extern void sched_put_rd(struct root_domain *rd);
+
+#ifdef HAVE_RT_PUSH_IPI
+extern void rto_push_irq_work_func(struct irq_work *work);
+#endif
+
 #endif /* CONFIG_SMP */
 
 /*
@@ -683,6 +718,33 @@ struct rq {
 	/* try_to_wake_up() stats */
 	unsigned int ttwu_count;
 	unsigned int ttwu_local;
+
+	/* select_idle_sibling() stats */
+	unsigned int sis_search;
+	unsigned int sis_domain_search;
+	unsigned int sis_scanned;
+	unsigned int sis_failed;
+
+#ifdef CONFIG_FAIR_GROUP_SCHED
+	/* where list_add_leaf_cfs_rq() inserts a branch not yet connected */
+	struct list_head *tmp_alone_branch;
+#endif
+
+#ifdef CONFIG_SCHED_CORE
+	/* per-core state, only used in the rq of the core's first cpu */
+	raw_spinlock_t core_lock;
+	unsigned long core_cookie;
+	unsigned int core_busy;
+
+	/* per-cpu state, protected by the core's core_lock */
+	struct rq *core_owner;
+	unsigned long core_run_cookie;
+	int core_prio;
+	unsigned int core_forceidle;
+	int core_wait_prio;
+	u64 core_wait_start;
+	unsigned int core_kick;
+#endif
 #endif /* __GENKSYMS__ */
 };
 
@@ -1252,12 +1314,25 @@ static inline void idle_enter_fair(struct rq *this_rq) {}
 static inline void idle_exit_fair(struct rq *this_rq) {}
 #endif
 
+#ifdef CONFIG_SCHED_SMT
+extern void __update_idle_core(struct rq *rq);
+
+static inline void update_idle_core(struct rq *rq)
+{
+	__update_idle_core(rq);
+}
+#else
+static inline void update_idle_core(struct rq *rq) {}
+#endif
+
 #else	/* CONFIG_SMP */
 
 static inline void idle_balance(int cpu, struct rq *rq)
 {
 }
 
+static inline void update_idle_core(struct rq *rq) {}
+
 #endif
 
 extern void sysrq_sched_debug_show(void);
@@ -1438,6 +1513,55 @@ task_rq_unlock(struct rq *rq, struct task_struct *p, unsigned long *flags)
 	raw_spin_unlock_irqrestore(&p->pi_lock, *flags);
 }
 
+#ifdef CONFIG_SCHED_CORE
+extern struct static_key __sched_core_enabled;
+
+static inline bool sched_core_enabled(void)
+{
+	return static_key_false(&__sched_core_enabled);
+}
+
+extern struct task_struct *sched_core_pick(struct rq *rq,
+					   struct task_struct *next);
+extern struct task_struct *pick_next_task_fair_cookie(struct rq *rq,
+						      unsigned long cookie);
+extern void sched_core_tick(struct rq *rq);
+#ifdef CONFIG_CGROUP_SCHED
+extern int sched_core_tag_cgroup(struct cgroup *cgrp, struct task_group *tg,
+				 u64 val);
+extern void sched_core_cgroup_move(struct task_struct *p,
+				   struct task_group *tg);
+#endif
+
+/* A sibling changed the core state under us; see scheduler_ipi(). */
+static inline bool sched_core_kicked(struct rq *rq)
+{
+	if (!READ_ONCE(rq->core_kick))
+		return false;
+
+	rq->core_kick = 0;
+	return true;
+}
+#else
+static inline bool sched_core_enabled(void)
+{
+	return false;
+}
+
+static inline struct task_struct *sched_core_pick(struct rq *rq,
+						  struct task_struct *next)
+{
+	return next;
+}
+
+static inline void sched_core_tick(struct rq *rq) {}
+
+static inline bool sched_core_kicked(struct rq *rq)
+{
+	return false;
+}
+#endif /* CONFIG_SCHED_CORE */
+
 #ifdef CONFIG_SMP
 #ifdef CONFIG_PREEMPT
 
@@ -3046,6 +3046,18 @@ static inline int __dev_xmit_skb(struct sk_buff *skb, struct Qdisc *q,
 
 	qdisc_pkt_len_init(skb);
 	qdisc_calculate_pkt_len(skb, q);
+
+	if (q->flags & TCQ_F_NOLOCK) {
+		if (unlikely(test_bit(__QDISC_STATE_DEACTIVATED, &q->state))) {
+			kfree_skb(skb);
+			rc = NET_XMIT_DROP;
+		} else {
+			rc = q->enqueue(skb, q) & NET_XMIT_MASK;
+			qdisc_run(q);
+		}
+		return rc;
+	}
+
 	/*
 	 * Heuristic to force contended enqueues to serialize on a
 	 * separate lock before trying to get qdisc main lock.
@@ -3758,6 +3770,13 @@ static void net_tx_action(struct softirq_action *h)
 
 			head = head->next_sched;
 
+			if (q->flags & TCQ_F_NOLOCK) {
+				smp_mb__before_atomic();
+				clear_bit(__QDISC_STATE_SCHED, &q->state);
+				qdisc_run(q);
+				continue;
+			}
+
 			root_lock = qdisc_lock(q);
 			if (spin_trylock(root_lock)) {
 				smp_mb__before_clear_bit();
@@ -3787,6 +3806,48 @@ int (*br_fdb_test_addr_hook)(struct net_device *dev,
 EXPORT_SYMBOL_GPL(br_fdb_test_addr_hook);
 #endif
 
+#ifdef CONFIG_NETFILTER
+/* Forwarding fast path of the netfilter flow table, consulted for every
+ * received packet before the protocol handlers once a table is loaded.
+ */
+static rx_handler_func_t __rcu *flow_offload_hook __read_mostly;
+static struct static_key flow_offload_needed __read_mostly;
+
+/**
+ *	netdev_flow_offload_register - register the flow table fast path
+ *	@hook: receive hook, returns RX_HANDLER_CONSUMED for packets it forwarded
+ *
+ *	Only one fast path may be registered at a time.
+ */
+int netdev_flow_offload_register(rx_handler_func_t *hook)
+{
+	ASSERT_RTNL();
+
+	if (rtnl_dereference(flow_offload_hook))
+		return -EBUSY;
+
+	rcu_assign_pointer(flow_offload_hook, hook);
+	static_key_slow_inc(&flow_offload_needed);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(netdev_flow_offload_register);
+
+/**
+ *	netdev_flow_offload_unregister - unregister the flow table fast path
+ *
+ *	Waits for packets in flight through the hook before returning.
+ */
+void netdev_flow_offload_unregister(void)
+{
+	ASSERT_RTNL();
+
+	static_key_slow_dec(&flow_offload_needed);
+	RCU_INIT_POINTER(flow_offload_hook, NULL);
+	synchronize_net();
+}
+EXPORT_SYMBOL_GPL(netdev_flow_offload_unregister);
+#endif
+
 #ifdef CONFIG_NET_CLS_ACT
 static inline struct sk_buff *handle_ing(struct sk_buff *skb,
 					 struct packet_type **pt_prev,
@@ -3995,6 +4056,22 @@ ncls:
 			goto out;
 	}
 
+#ifdef CONFIG_NETFILTER
+	if (static_key_false(&flow_offload_needed) && !pfmemalloc) {
+		rx_handler = rcu_dereference(flow_offload_hook);
+		if (rx_handler) {
+			if (pt_prev) {
+				ret = deliver_skb(skb, pt_prev, orig_dev);
+				pt_prev = NULL;
+			}
+			if (rx_handler(&skb) == RX_HANDLER_CONSUMED) {
+				ret = NET_RX_SUCCESS;
+				goto out;
+			}
+		}
+	}
+#endif
+
 	rx_handler = rcu_dereference(skb->dev->rx_handler);
 	if (rx_handler) {
 		if (pt_prev) {
@@ -4324,6 +4401,7 @@ static enum gro_result dev_gro_receive(struct napi_struct *napi, struct sk_buff
 		NAPI_GRO_CB(skb)->encap_mark = 0;
 		NAPI_GRO_CB(skb)->recursion_counter = 0;
 		NAPI_GRO_CB(skb)->is_atomic = 1;
+		NAPI_GRO_CB(skb)->is_udp_l4 = 0;
 		NAPI_GRO_CB(skb)->gro_remcsum_start = 0;
 
 		/* Setup for GRO checksum validation */
@@ -123,49 +123,120 @@ unsigned long neigh_rand_reach_time(unsigned long base)
 EXPORT_SYMBOL(neigh_rand_reach_time);
 
 
-static int neigh_forced_gc(struct neigh_table *tbl)
+static void neigh_mark_dead(struct neighbour *n)
 {
-	int shrunk = 0;
-	int i;
-	struct neigh_hash_table *nht;
+	n->dead = 1;
+	if (!list_empty(&n->gc_list)) {
+		list_del_init(&n->gc_list);
+		atomic_dec(&n->tbl->gc_entries);
+	}
+}
 
-	NEIGH_CACHE_STAT_INC(tbl, forced_gc_runs);
+static void neigh_update_gc_list(struct neighbour *n)
+{
+	struct neigh_table *tbl = n->tbl;
+	bool on_gc_list, exempt;
 
 	write_lock_bh(&tbl->lock);
+	write_lock(&n->lock);
+
+	if (n->dead)
+		goto out;
+
+	/* permanent entries are never evicted */
+	exempt = n->nud_state & NUD_PERMANENT;
+	on_gc_list = !list_empty(&n->gc_list);
+
+	if (exempt && on_gc_list) {
+		list_del_init(&n->gc_list);
+		atomic_dec(&tbl->gc_entries);
+	} else if (!exempt && !on_gc_list) {
+		list_add_tail(&n->gc_list, &tbl->gc_list);
+		atomic_inc(&tbl->gc_entries);
+	}
+out:
+	write_unlock(&n->lock);
+	write_unlock_bh(&tbl->lock);
+}
+
+static bool neigh_del(struct neighbour *n, struct neighbour __rcu **np,
+		      struct neigh_table *tbl)
+{
+	bool retval = false;
+
+	write_lock(&n->lock);
+	if (atomic_read(&n->refcnt) == 1 &&
+	    !(n->nud_state & NUD_PERMANENT)) {
+		rcu_assign_pointer(*np,
+				   rcu_dereference_protected(n->next,
+						lockdep_is_held(&tbl->lock)));
+		neigh_mark_dead(n);
+		retval = true;
+	}
+	write_unlock(&n->lock);
+	if (retval)
+		neigh_cleanup_and_release(n);
+	return retval;
+}
+
+static bool neigh_remove_one(struct neighbour *ndel, struct neigh_table *tbl)
+{
+	struct neigh_hash_table *nht;
+	struct neighbour __rcu **np;
+	struct neighbour *n;
+	u32 hash_val;
+
 	nht = rcu_dereference_protected(tbl->nht,
 					lockdep_is_held(&tbl->lock));
-	for (i = 0; i < (1 << nht->hash_shift); i++) {
-		struct neighbour *n;
-		struct neighbour __rcu **np;
+	hash_val = tbl->hash(ndel->primary_key, ndel->dev, nht->hash_rnd);
+	hash_val >>= (32 - nht->hash_shift);
 
-		np = &nht->hash_buckets[i];
-		while ((n = rcu_dereference_protected(*np,
+	np = &nht->hash_buckets[hash_val];
+	while ((n = rcu_dereference_protected(*np,
 					lockdep_is_held(&tbl->lock))) != NULL) {
-			/* Neighbour record may be discarded if:
-			 * - nobody refers to it.
-			 * - it is not permanent
-			 */
-			write_lock(&n->lock);
-			if (atomic_read(&n->refcnt) == 1 &&
-			    !(n->nud_state & NUD_PERMANENT)) {
-				rcu_assign_pointer(*np,
-					rcu_dereference_protected(n->next,
-						  lockdep_is_held(&tbl->lock)));
-				n->dead = 1;
-				shrunk	= 1;
-				write_unlock(&n->lock);
-				neigh_cleanup_and_release(n);
-				continue;
-			}
-			write_unlock(&n->lock);
-			np = &n->next;
+		if (n == ndel)
+			return neigh_del(n, np, tbl);
+		np = &n->next;
+	}
+	return false;
+}
+
+/* Evict unreferenced entries, oldest first, until we are back under
+ * gc_thresh2. Only entries on the gc_list are looked at, and the walk
+ * gives up after a millisecond so that a large table cannot stall the
+ * caller, which may be the packet path.
+ */
+static int neigh_forced_gc(struct neigh_table *tbl)
+{
+	int max_clean = atomic_read(&tbl->gc_entries) - tbl->gc_thresh2;
+	u64 start = ktime_get_ns(), tmax = start + NSEC_PER_MSEC;
+	struct neighbour *n, *tmp;
+	unsigned int scanned = 0;
+	int shrunk = 0;
+
+	NEIGH_CACHE_STAT_INC(tbl, forced_gc_runs);
+
+	write_lock_bh(&tbl->lock);
+
+	list_for_each_entry_safe(n, tmp, &tbl->gc_list, gc_list) {
+		scanned++;
+		if (atomic_read(&n->refcnt) == 1 && neigh_remove_one(n, tbl)) {
+			shrunk++;
+			if (shrunk >= max_clean)
+				break;
 		}
+		if (!(scanned & 15) && ktime_get_ns() > tmax)
+			break;
 	}
 
 	tbl->last_flush = jiffies;
 
 	write_unlock_bh(&tbl->lock);
 
+	NEIGH_CACHE_STAT_ADD(tbl, gc_scanned, scanned);
+	NEIGH_CACHE_STAT_ADD(tbl, gc_usecs,
+			     div_u64(ktime_get_ns() - start, NSEC_PER_USEC));
+
 	return shrunk;
 }
 
@@ -222,7 +293,7 @@ static void neigh_flush_dev(struct neigh_table *tbl, struct net_device *dev)
 						lockdep_is_held(&tbl->lock)));
 			write_lock(&n->lock);
 			neigh_del_timer(n);
-			n->dead = 1;
+			neigh_mark_dead(n);
 
 			if (atomic_read(&n->refcnt) != 1) {
 				/* The most unpleasant situation.
@@ -276,7 +347,9 @@ static struct neighbour *neigh_alloc(struct neigh_table *tbl, struct net_device
 	unsigned long now = jiffies;
 	int entries;
 
-	entries = atomic_inc_return(&tbl->entries) - 1;
+	/* thresholds only apply to entries the GC may evict */
+	atomic_inc(&tbl->entries);
+	entries = atomic_inc_return(&tbl->gc_entries) - 1;
 	if (entries >= tbl->gc_thresh3 ||
 	    (entries >= tbl->gc_thresh2 &&
 	     time_after(now, tbl->last_flush + 5 * HZ))) {
@@ -290,6 +363,7 @@ static struct neighbour *neigh_alloc(struct neigh_table *tbl, struct net_device
 		goto out_entries;
 
 	__skb_queue_head_init(&n->arp_queue);
+	INIT_LIST_HEAD(&n->gc_list);
 	rwlock_init(&n->lock);
 	seqlock_init(&n->ha_lock);
 	n->updated	  = n->used = now;
@@ -307,6 +381,7 @@ out:
 	return n;
 
 out_entries:
+	atomic_dec(&tbl->gc_entries);
 	atomic_dec(&tbl->entries);
 	goto out;
 }
@@ -535,6 +610,7 @@ struct neighbour *__neigh_create(struct neigh_table *tbl, const void *pkey,
 	}
 
 	n->dead = 0;
+	list_add_tail(&n->gc_list, &tbl->gc_list);
 	if (want_ref)
 		neigh_hold(n);
 	rcu_assign_pointer(n->next,
@@ -549,6 +625,7 @@ out:
 out_tbl_unlock:
 	write_unlock_bh(&tbl->lock);
 out_neigh_release:
+	atomic_dec(&tbl->gc_entries);
 	neigh_release(n);
 	goto out;
 }
@@ -757,19 +834,79 @@ static void neigh_connect(struct neighbour *neigh)
 	neigh->output = neigh->ops->connected_output;
 }
 
+/* The periodic GC visits 1/NEIGH_GC_SLICES of the hash buckets per run,
+ * so that a large table is scanned in small steps instead of in one go.
+ */
+#define NEIGH_GC_SLICES		64
+
+static bool neigh_gc_candidate(struct neighbour *n)
+{
+	unsigned int state = ACCESS_ONCE(n->nud_state);
+
+	if (state & (NUD_PERMANENT | NUD_IN_TIMER))
+		return false;
+
+	if (time_before(n->used, n->confirmed))
+		n->used = n->confirmed;
+
+	return atomic_read(&n->refcnt) == 1 &&
+	       (state == NUD_FAILED ||
+		time_after(jiffies,
+			   n->used + NEIGH_VAR(n->parms, GC_STALETIME)));
+}
+
+/* Look for stale entries in a bucket without taking tbl->lock. */
+static bool neigh_bucket_has_candidate(struct neigh_hash_table *nht,
+				       unsigned int i, unsigned int *scanned)
+{
+	struct neighbour *n;
+
+	for (n = rcu_dereference_bh(nht->hash_buckets[i]);
+	     n != NULL;
+	     n = rcu_dereference_bh(n->next)) {
+		(*scanned)++;
+		if (neigh_gc_candidate(n))
+			return true;
+	}
+	return false;
+}
+
+static void neigh_bucket_gc(struct neigh_table *tbl,
+			    struct neigh_hash_table *nht, unsigned int i)
+{
+	struct neighbour __rcu **np = &nht->hash_buckets[i];
+	struct neighbour *n;
+
+	while ((n = rcu_dereference_protected(*np,
+				lockdep_is_held(&tbl->lock))) != NULL) {
+		write_lock(&n->lock);
+		if (neigh_gc_candidate(n)) {
+			*np = n->next;
+			neigh_mark_dead(n);
+			write_unlock(&n->lock);
+			neigh_cleanup_and_release(n);
+			continue;
+		}
+		write_unlock(&n->lock);
+		np = &n->next;
+	}
+}
+
 static void neigh_periodic_work(struct work_struct *work)
 {
 	struct neigh_table *tbl = container_of(work, struct neigh_table, gc_work.work);
-	struct neighbour *n;
-	struct neighbour __rcu **np;
-	unsigned int i;
+	unsigned int i, slice, scanned = 0;
 	struct neigh_hash_table *nht;
+	u64 start = ktime_get_ns();
+	unsigned long delay;
 
-	NEIGH_CACHE_STAT_INC(tbl, periodic_gc_runs);
+	/* Cycle through all hash buckets every BASE_REACHABLE_TIME/2 ticks.
+	 * ARP entry timeouts range from 1/2 BASE_REACHABLE_TIME to 3/2
+	 * BASE_REACHABLE_TIME.
+	 */
+	delay = NEIGH_VAR(&tbl->parms, BASE_REACHABLE_TIME) >> 1;
 
-	write_lock_bh(&tbl->lock);
-	nht = rcu_dereference_protected(tbl->nht,
-					lockdep_is_held(&tbl->lock));
+	NEIGH_CACHE_STAT_INC(tbl, periodic_gc_runs);
 
 	if (atomic_read(&tbl->entries) < tbl->gc_thresh1)
 		goto out;
@@ -780,62 +917,56 @@ static void neigh_periodic_work(struct work_struct *work)
 
 	if (time_after(jiffies, tbl->last_rand + 300 * HZ)) {
 		struct neigh_parms *p;
+
+		write_lock_bh(&tbl->lock);
 		tbl->last_rand = jiffies;
 		for (p = &tbl->parms; p; p = p->next)
 			p->reachable_time =
 				neigh_rand_reach_time(NEIGH_VAR(p, BASE_REACHABLE_TIME));
+		write_unlock_bh(&tbl->lock);
 	}
 
-	for (i = 0 ; i < (1 << nht->hash_shift); i++) {
-		np = &nht->hash_buckets[i];
-
-		while ((n = rcu_dereference_protected(*np,
-				lockdep_is_held(&tbl->lock))) != NULL) {
-			unsigned int state;
-
-			write_lock(&n->lock);
-
-			state = n->nud_state;
-			if (state & (NUD_PERMANENT | NUD_IN_TIMER)) {
-				write_unlock(&n->lock);
-				goto next_elt;
-			}
+	rcu_read_lock_bh();
+	nht = rcu_dereference_bh(tbl->nht);
+	slice = DIV_ROUND_UP(1 << nht->hash_shift, NEIGH_GC_SLICES);
+	rcu_read_unlock_bh();
 
-			if (time_before(n->used, n->confirmed))
-				n->used = n->confirmed;
+	/* Buckets are scanned under RCU, tbl->lock is only taken for the
+	 * ones holding something to evict. The table may grow in between,
+	 * which only means some entries are seen twice or on the next
+	 * round.
+	 */
+	for (i = tbl->gc_bucket; slice; slice--, i++) {
+		bool evict;
 
-			if (atomic_read(&n->refcnt) == 1 &&
-			    (state == NUD_FAILED ||
-			     time_after(jiffies, n->used + NEIGH_VAR(n->parms, GC_STALETIME)))) {
-				*np = n->next;
-				n->dead = 1;
-				write_unlock(&n->lock);
-				neigh_cleanup_and_release(n);
-				continue;
-			}
-			write_unlock(&n->lock);
+		rcu_read_lock_bh();
+		nht = rcu_dereference_bh(tbl->nht);
+		if (i >= (1 << nht->hash_shift)) {
+			rcu_read_unlock_bh();
+			i = 0;
+			break;
+		}
+		evict = neigh_bucket_has_candidate(nht, i, &scanned);
+		rcu_read_unlock_bh();
 
-next_elt:
-			np = &n->next;
+		if (evict) {
+			write_lock_bh(&tbl->lock);
+			nht = rcu_dereference_protected(tbl->nht,
+						lockdep_is_held(&tbl->lock));
+			if (i < (1 << nht->hash_shift))
+				neigh_bucket_gc(tbl, nht, i);
+			write_unlock_bh(&tbl->lock);
 		}
-		/*
-		 * It's fine to release lock here, even if hash table
-		 * grows while we are preempted.
-		 */
-		write_unlock_bh(&tbl->lock);
 		cond_resched();
-		write_lock_bh(&tbl->lock);
-		nht = rcu_dereference_protected(tbl->nht,
-						lockdep_is_held(&tbl->lock));
 	}
+	tbl->gc_bucket = i;
+	delay = max(delay / NEIGH_GC_SLICES, 1UL);
+
+	NEIGH_CACHE_STAT_ADD(tbl, gc_scanned, scanned);
+	NEIGH_CACHE_STAT_ADD(tbl, gc_usecs,
+			     div_u64(ktime_get_ns() - start, NSEC_PER_USEC));
 out:
-	/* Cycle through all hash buckets every BASE_REACHABLE_TIME/2 ticks.
-	 * ARP entry timeouts range from 1/2 BASE_REACHABLE_TIME to 3/2
-	 * BASE_REACHABLE_TIME.
-	 */
-	schedule_delayed_work(&tbl->gc_work,
-			      NEIGH_VAR(&tbl->parms, BASE_REACHABLE_TIME) >> 1);
-	write_unlock_bh(&tbl->lock);
+	schedule_delayed_work(&tbl->gc_work, delay);
 }
 
 static __inline__ int neigh_max_probes(struct neighbour *n)
@@ -1099,6 +1230,7 @@ int neigh_update(struct neighbour *neigh, const u8 *lladdr, u8 new,
 	int notify = 0;
 	struct net_device *dev;
 	int update_isrouter = 0;
+	bool gc_update;
 
 	write_lock_bh(&neigh->lock);
 
@@ -1246,8 +1378,12 @@ out:
 			(neigh->flags | NTF_ROUTER) :
 			(neigh->flags & ~NTF_ROUTER);
 	}
+	gc_update = (old ^ neigh->nud_state) & NUD_PERMANENT;
 	write_unlock_bh(&neigh->lock);
 
+	if (gc_update)
+		neigh_update_gc_list(neigh);
+
 	if (notify)
 		neigh_update_notify(neigh);
 
@@ -1580,6 +1716,7 @@ static void neigh_table_init_no_netlink(struct neigh_table *tbl)
 		WARN_ON(tbl->entry_size % NEIGH_PRIV_ALIGN);
 
 	rwlock_init(&tbl->lock);
+	INIT_LIST_HEAD(&tbl->gc_list);
 	INIT_DEFERRABLE_WORK(&tbl->gc_work, neigh_periodic_work);
 	schedule_delayed_work(&tbl->gc_work, tbl->parms.reachable_time);
 	setup_timer(&tbl->proxy_timer, neigh_proxy_process, (unsigned long)tbl);
@@ -2447,7 +2584,7 @@ void __neigh_for_each_release(struct neigh_table *tbl,
 				rcu_assign_pointer(*np,
 					rcu_dereference_protected(n->next,
 						lockdep_is_held(&tbl->lock)));
-				n->dead = 1;
+				neigh_mark_dead(n);
 			} else
 				np = &n->next;
 			write_unlock(&n->lock);
@@ -2733,12 +2870,12 @@ static int neigh_stat_seq_show(struct seq_file *seq, void *v)
 	struct neigh_statistics *st = v;
 
 	if (v == SEQ_START_TOKEN) {
-		seq_printf(seq, "entries  allocs destroys hash_grows  lookups hits  res_failed  rcv_probes_mcast rcv_probes_ucast  periodic_gc_runs forced_gc_runs unresolved_discards\n");
+		seq_printf(seq, "entries  allocs destroys hash_grows  lookups hits  res_failed  rcv_probes_mcast rcv_probes_ucast  periodic_gc_runs forced_gc_runs unresolved_discards gc_scanned gc_usecs\n");
 		return 0;
 	}
 
 	seq_printf(seq, "%08x  %08lx %08lx %08lx  %08lx %08lx  %08lx  "
-			"%08lx %08lx  %08lx %08lx %08lx\n",
+			"%08lx %08lx  %08lx %08lx %08lx %08lx %08lx\n",
 		   atomic_read(&tbl->entries),
 
 		   st->allocs,
@@ -2755,7 +2892,9 @@ static int neigh_stat_seq_show(struct seq_file *seq, void *v)
 
 		   st->periodic_gc_runs,
 		   st->forced_gc_runs,
-		   st->unres_discards
+		   st->unres_discards,
+		   st->gc_scanned,
+		   st->gc_usecs
 		   );
 
 	return 0;
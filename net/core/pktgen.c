@@ -202,6 +202,7 @@
 #define F_NODE          (1<<15)	/* Node memory alloc*/
 #define F_UDPCSUM       (1<<16)	/* Include UDP checksum */
 #define F_NO_TIMESTAMP  (1<<17)	/* Don't timestamp packets (default TS) */
+#define F_QUEUE_XMIT    (1<<18)	/* Send through dev_queue_xmit() and the qdisc */
 
 /* Thread control flag bits */
 #define T_STOP        (1<<0)	/* Stop run */
@@ -681,6 +682,9 @@ static int pktgen_if_show(struct seq_file *seq, void *v)
 	if (pkt_dev->flags & F_NODE)
 		seq_printf(seq, "NODE_ALLOC  ");
 
+	if (pkt_dev->flags & F_QUEUE_XMIT)
+		seq_puts(seq, "QUEUE_XMIT  ");
+
 	seq_puts(seq, "\n");
 
 	/* not really stopped, more like last-running-at */
@@ -1264,6 +1268,12 @@ static ssize_t pktgen_if_write(struct file *file,
 		else if (strcmp(f, "NO_TIMESTAMP") == 0)
 			pkt_dev->flags |= F_NO_TIMESTAMP;
 
+		else if (strcmp(f, "QUEUE_XMIT") == 0)
+			pkt_dev->flags |= F_QUEUE_XMIT;
+
+		else if (strcmp(f, "!QUEUE_XMIT") == 0)
+			pkt_dev->flags &= ~F_QUEUE_XMIT;
+
 		else {
 			sprintf(pg_result,
 				"Flag -:%s:- unknown\nAvailable flags, (prepend ! to un-set flag):\n%s",
@@ -1271,7 +1281,7 @@ static ssize_t pktgen_if_write(struct file *file,
 				"IPSRC_RND, IPDST_RND, UDPSRC_RND, UDPDST_RND, "
 				"MACSRC_RND, MACDST_RND, TXSIZE_RND, IPV6, "
 				"MPLS_RND, VID_RND, SVID_RND, FLOW_SEQ, "
-				"NO_TIMESTAMP, "
+				"NO_TIMESTAMP, QUEUE_XMIT, "
 #ifdef CONFIG_XFRM
 				"IPSEC, "
 #endif
@@ -3305,9 +3315,12 @@ static void pktgen_xmit(struct pktgen_dev *pkt_dev)
 		return;
 	}
 
-	/* If no skb or clone count exhausted then get new one */
-	if (!pkt_dev->skb || (pkt_dev->last_ok &&
-			      ++pkt_dev->clone_count >= pkt_dev->clone_skb)) {
+	/* If no skb or clone count exhausted then get new one.
+	 * The qdisc owns what it was given, so QUEUE_XMIT never reuses.
+	 */
+	if (!pkt_dev->skb || (pkt_dev->flags & F_QUEUE_XMIT) ||
+	    (pkt_dev->last_ok &&
+	     ++pkt_dev->clone_count >= pkt_dev->clone_skb)) {
 		/* build a new pkt */
 		kfree_skb(pkt_dev->skb);
 
@@ -3326,6 +3339,25 @@ static void pktgen_xmit(struct pktgen_dev *pkt_dev)
 	if (pkt_dev->delay && pkt_dev->last_ok)
 		spin(pkt_dev, pkt_dev->next_tx);
 
+	if (pkt_dev->flags & F_QUEUE_XMIT) {
+		local_bh_disable();
+		atomic_inc(&pkt_dev->skb->users);
+		ret = dev_queue_xmit(pkt_dev->skb);
+		local_bh_enable();
+
+		/* the qdisc consumed the skb whatever the outcome */
+		pkt_dev->last_ok = 1;
+		if (likely(ret == NET_XMIT_SUCCESS)) {
+			pkt_dev->sofar++;
+			pkt_dev->seq_num++;
+			pkt_dev->tx_bytes += pkt_dev->last_pkt_size;
+		} else {
+			/* NET_XMIT_DROP/CN: the qdisc dropped or is about to */
+			pkt_dev->errors++;
+		}
+		goto out;
+	}
+
 	txq = skb_get_tx_queue(odev, pkt_dev->skb);
 
 	__netif_tx_lock_bh(txq);
@@ -3370,7 +3402,7 @@ xmit_more:
 		atomic_sub(burst, &pkt_dev->skb->users);
 unlock:
 	__netif_tx_unlock_bh(txq);
-
+out:
 	/* If pkt_dev->count is zero, then run forever */
 	if ((pkt_dev->count != 0) && (pkt_dev->sofar >= pkt_dev->count)) {
 		pktgen_wait_for_skb(pkt_dev);
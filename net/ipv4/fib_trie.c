@@ -71,6 +71,7 @@
 #include <linux/init.h>
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/export.h>
 #include <linux/notifier.h>
 #include <net/net_namespace.h>
@@ -246,6 +247,10 @@ struct tnode {
 #ifdef CONFIG_IP_FIB_TRIE_STATS
 struct trie_use_stats {
 	unsigned int gets;
+	unsigned int node_visits;
+	unsigned int fast_gets;
+	unsigned int fast_visits;
+	unsigned int fast_fallback;
 	unsigned int backtrack;
 	unsigned int semantic_match_passed;
 	unsigned int semantic_match_miss;
@@ -264,12 +269,17 @@ struct trie_stat {
 	unsigned int nodesizes[MAX_STAT_DEPTH];
 };
 
+struct fast_table;
+
 struct trie {
 	struct rcu_head	rcu;
 	struct key_vector kv[1];
 #ifdef CONFIG_IP_FIB_TRIE_STATS
 	struct trie_use_stats __percpu *stats;
 #endif
+#ifdef CONFIG_IP_FIB_TRIE_COMPILED
+	struct fast_table *fast;	/* compiled copy, main table only */
+#endif
 };
 
 static struct key_vector *resize(struct trie *t, struct key_vector *tn);
@@ -1190,7 +1200,383 @@ static int fib_insert_alias(struct trie *t, struct key_vector *tp,
 	return 0;
 }
 
-/* Caller must hold RTNL. */
+static struct key_vector *leaf_walk_rcu(struct key_vector **tn, t_key key);
+
+#ifdef CONFIG_IP_FIB_TRIE_COMPILED
+/*
+ * Compiled lookup table
+ *
+ * The main table is mirrored into a three level multibit trie with
+ * strides of 16, 8 and 8 bits. Every slot holds the leaf with the longest
+ * prefix covering the addresses of the slot, or a pointer to a chunk of
+ * 256 finer slots (tagged with FAST_CHUNK) when longer prefixes exist
+ * below it. A lookup is at most three dependent loads, after which the
+ * aliases of the leaf are checked as usual. If none of them is usable
+ * the lookup falls back to walking the trie, which also handles TOS and
+ * scope driven backtracking.
+ *
+ * The table is updated under RTNL by rebuilding the slots covered by the
+ * changed prefix from the trie. Slots are always replaced before the
+ * leaves they point to are freed, so RCU readers never see a stale leaf.
+ * Bulk removals clear 'valid' first and rebuild the table once done.
+ */
+#define FAST_ROOT_BITS		16
+#define FAST_CHUNK_BITS		8
+#define FAST_CHUNK		1UL
+
+struct fast_chunk {
+	struct rcu_head	rcu;
+	unsigned long	slot[1 << FAST_CHUNK_BITS];
+};
+
+struct fast_table {
+	bool		valid;
+	unsigned int	chunks;
+	unsigned long	root[1 << FAST_ROOT_BITS];
+};
+
+static struct kmem_cache *fast_chunk_kmem __read_mostly;
+
+static inline struct fast_chunk *fast_chunk(unsigned long slot)
+{
+	return (struct fast_chunk *)(slot & ~FAST_CHUNK);
+}
+
+static struct key_vector *fast_lookup(struct trie *t, t_key key)
+{
+	unsigned long slot;
+	unsigned int levels = 1;
+
+	slot = ACCESS_ONCE(t->fast->root[key >> 16]);
+	if (slot & FAST_CHUNK) {
+		smp_read_barrier_depends();
+		slot = ACCESS_ONCE(fast_chunk(slot)->slot[(key >> 8) & 0xff]);
+		levels++;
+	}
+	if (slot & FAST_CHUNK) {
+		smp_read_barrier_depends();
+		slot = ACCESS_ONCE(fast_chunk(slot)->slot[key & 0xff]);
+		levels++;
+	}
+#ifdef CONFIG_IP_FIB_TRIE_STATS
+	this_cpu_add(t->stats->fast_visits, levels);
+#endif
+
+	return (struct key_vector *)slot;
+}
+
+static void __fast_chunk_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(fast_chunk_kmem,
+			container_of(head, struct fast_chunk, rcu));
+}
+
+static void fast_chunk_free(struct trie *t, struct fast_chunk *c)
+{
+	int i;
+
+	for (i = 0; i < (1 << FAST_CHUNK_BITS); i++)
+		if (c->slot[i] & FAST_CHUNK)
+			fast_chunk_free(t, fast_chunk(c->slot[i]));
+
+	t->fast->chunks--;
+	call_rcu(&c->rcu, __fast_chunk_free_rcu);
+}
+
+static void fast_slot_set(struct trie *t, unsigned long *slot,
+			  unsigned long val)
+{
+	unsigned long old = *slot;
+
+	/* chunk contents must be visible before the chunk */
+	if (val & FAST_CHUNK)
+		smp_wmb();
+	ACCESS_ONCE(*slot) = val;
+	if (old & FAST_CHUNK)
+		fast_chunk_free(t, fast_chunk(old));
+}
+
+/* Set every slot covering key/plen to val, splitting slots as needed.
+ * Each slot of 'slots' covers 1 << shift addresses.
+ */
+static int fast_fill(struct trie *t, unsigned long *slots, int shift,
+		     int bits, t_key key, int plen, unsigned long val)
+{
+	unsigned long idx = (key >> shift) & ((1ul << bits) - 1);
+	struct fast_chunk *c;
+	unsigned long i, n;
+
+	if (plen <= KEYLENGTH - shift) {
+		n = 1ul << (KEYLENGTH - shift - plen);
+		for (i = idx; i < idx + n; i++)
+			fast_slot_set(t, &slots[i], val);
+		return 0;
+	}
+
+	if (!(slots[idx] & FAST_CHUNK)) {
+		c = kmem_cache_alloc(fast_chunk_kmem, GFP_KERNEL);
+		if (!c)
+			return -ENOMEM;
+		for (i = 0; i < (1 << FAST_CHUNK_BITS); i++)
+			c->slot[i] = slots[idx];
+		t->fast->chunks++;
+		fast_slot_set(t, &slots[idx], (unsigned long)c | FAST_CHUNK);
+	}
+
+	c = fast_chunk(slots[idx]);
+	return fast_fill(t, c->slot, shift - FAST_CHUNK_BITS, FAST_CHUNK_BITS,
+			 key, plen, val);
+}
+
+/* Replace a chunk whose slots all hold the same leaf by that leaf */
+static void fast_collapse(struct trie *t, unsigned long *slot)
+{
+	struct fast_chunk *c = fast_chunk(*slot);
+	unsigned long val = c->slot[0];
+	int i;
+
+	if (val & FAST_CHUNK)
+		return;
+	for (i = 1; i < (1 << FAST_CHUNK_BITS); i++)
+		if (c->slot[i] != val)
+			return;
+
+	fast_slot_set(t, slot, val);
+}
+
+static bool fast_leaf_has(struct key_vector *l, u8 slen,
+			  struct fib_alias *exclude)
+{
+	struct fib_alias *fa;
+
+	hlist_for_each_entry(fa, &l->leaf, fa_list)
+		if (fa->fa_slen == slen && fa != exclude)
+			return true;
+	return false;
+}
+
+/* Paint the prefixes of leaf l that are at least min_plen long, shortest
+ * first so that longer ones override them.
+ */
+static int fast_paint_leaf(struct trie *t, unsigned long *slots, int shift,
+			   int bits, struct key_vector *l, int min_plen,
+			   struct fib_alias *exclude)
+{
+	u64 plens = 0;
+	struct fib_alias *fa;
+	int plen, err;
+
+	hlist_for_each_entry(fa, &l->leaf, fa_list) {
+		plen = KEYLENGTH - fa->fa_slen;
+		if (fa != exclude && plen >= min_plen)
+			plens |= 1ull << plen;
+	}
+
+	for (plen = min_plen; plen <= KEYLENGTH; plen++) {
+		if (!(plens & (1ull << plen)))
+			continue;
+		err = fast_fill(t, slots, shift, bits, l->key, plen,
+				(unsigned long)l);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/* Rebuild the whole table from the trie. Caller must hold RTNL. */
+static void fast_rebuild(struct trie *t)
+{
+	struct key_vector *l, *tp = t->kv;
+	t_key key = 0;
+	int i;
+
+	if (!t->fast)
+		return;
+
+	t->fast->valid = false;
+	for (i = 0; i < (1 << FAST_ROOT_BITS); i++)
+		fast_slot_set(t, &t->fast->root[i], 0);
+
+	while ((l = leaf_walk_rcu(&tp, key)) != NULL) {
+		if (fast_paint_leaf(t, t->fast->root,
+				    KEYLENGTH - FAST_ROOT_BITS, FAST_ROOT_BITS,
+				    l, 0, NULL))
+			return;
+		key = l->key + 1;
+		if (key < l->key)
+			break;
+	}
+
+	/* slots must be visible before readers may use them */
+	smp_wmb();
+	t->fast->valid = true;
+}
+
+/* Compute from the trie the value of a slot covering the 1 << shift
+ * addresses starting at key, ignoring alias exclude. Chunks are built
+ * privately and only become visible once the caller stores the result.
+ */
+static int fast_build(struct trie *t, t_key key, int shift,
+		      struct fib_alias *exclude, unsigned long *val)
+{
+	t_key last = key | ((1ul << shift) - 1);
+	int plen = KEYLENGTH - shift;
+	struct key_vector *l, *tp;
+	unsigned long slot = 0;
+	int len, err = 0;
+
+	/* the longest prefix covering the whole slot */
+	for (len = plen; len >= 0; len--) {
+		t_key k = len ? key & (KEY_MAX << (KEYLENGTH - len)) : 0;
+
+		l = fib_find_node(t, &tp, k);
+		if (l && fast_leaf_has(l, KEYLENGTH - len, exclude)) {
+			slot = (unsigned long)l;
+			break;
+		}
+	}
+
+	/* and the longer ones inside it */
+	tp = t->kv;
+	while ((l = leaf_walk_rcu(&tp, key)) != NULL && l->key <= last) {
+		err = fast_paint_leaf(t, &slot, shift, 0, l, plen + 1, exclude);
+		if (err || l->key == last)
+			break;
+		key = l->key + 1;
+	}
+
+	if (err) {
+		if (slot & FAST_CHUNK)
+			fast_chunk_free(t, fast_chunk(slot));
+		return err;
+	}
+
+	*val = slot;
+	return 0;
+}
+
+/* Recompute the slots covering key/plen from the trie, ignoring alias
+ * exclude which is about to be removed. Every affected slot is rebuilt
+ * on the side and replaced with a single store, so a concurrent lookup
+ * sees either the old or the new route for its address, never a mix.
+ * Caller must hold RTNL.
+ */
+static void fast_update(struct trie *t, t_key key, int plen,
+			struct fib_alias *exclude)
+{
+	unsigned long *root, *slots, val;
+	unsigned long i, first, n;
+	t_key base;
+	int shift;
+
+	if (!t->fast)
+		return;
+
+	if (!t->fast->valid) {
+		/* An earlier update ran out of memory. Try again on the
+		 * next insert, a delete has to wait as its alias is still
+		 * linked in the trie.
+		 */
+		if (!exclude)
+			fast_rebuild(t);
+		return;
+	}
+
+	root = &t->fast->root[key >> FAST_ROOT_BITS];
+	if (plen >= FAST_ROOT_BITS && (*root & FAST_CHUNK)) {
+		slots = fast_chunk(*root)->slot;
+		shift = KEYLENGTH - FAST_ROOT_BITS - FAST_CHUNK_BITS;
+		base = key & (KEY_MAX << FAST_ROOT_BITS);
+	} else {
+		slots = t->fast->root;
+		shift = KEYLENGTH - FAST_ROOT_BITS;
+		base = 0;
+	}
+
+	first = (key - base) >> shift;
+	n = plen < KEYLENGTH - shift ? 1ul << (KEYLENGTH - shift - plen) : 1;
+	for (i = first; i < first + n; i++) {
+		if (fast_build(t, base + ((t_key)i << shift), shift, exclude,
+			       &val)) {
+			/* readers fall back to the trie until rebuilt */
+			t->fast->valid = false;
+			return;
+		}
+		fast_slot_set(t, &slots[i], val);
+	}
+
+	if (slots != t->fast->root)
+		fast_collapse(t, root);
+}
+
+static void fast_init(struct trie *t)
+{
+	t->fast = vzalloc(sizeof(*t->fast));
+	if (t->fast)
+		t->fast->valid = true;
+}
+
+/* Called once RCU readers are gone */
+static void fast_chunk_destroy(struct fast_chunk *c)
+{
+	int i;
+
+	for (i = 0; i < (1 << FAST_CHUNK_BITS); i++)
+		if (c->slot[i] & FAST_CHUNK)
+			fast_chunk_destroy(fast_chunk(c->slot[i]));
+	kmem_cache_free(fast_chunk_kmem, c);
+}
+
+static void fast_free(struct trie *t)
+{
+	int i;
+
+	if (!t->fast)
+		return;
+
+	for (i = 0; i < (1 << FAST_ROOT_BITS); i++)
+		if (t->fast->root[i] & FAST_CHUNK)
+			fast_chunk_destroy(fast_chunk(t->fast->root[i]));
+	vfree(t->fast);
+}
+
+static bool fast_suspend(struct trie *t)
+{
+	bool valid = t->fast && t->fast->valid;
+
+	if (t->fast)
+		t->fast->valid = false;
+	return valid;
+}
+
+static void fast_resume(struct trie *t, bool valid, bool changed)
+{
+	if (!t->fast)
+		return;
+
+	if (valid && !changed) {
+		t->fast->valid = true;
+		return;
+	}
+	fast_rebuild(t);
+}
+#else
+static inline void fast_update(struct trie *t, t_key key, int plen,
+			       struct fib_alias *exclude)
+{
+}
+
+static inline bool fast_suspend(struct trie *t)
+{
+	return false;
+}
+
+static inline void fast_resume(struct trie *t, bool valid, bool changed)
+{
+}
+#endif /* CONFIG_IP_FIB_TRIE_COMPILED */
+
+
 int fib_table_insert(struct net *net, struct fib_table *tb,
 		     struct fib_config *cfg)
 {
@@ -1339,6 +1725,8 @@ int fib_table_insert(struct net *net, struct fib_table *tb,
 	if (err)
 		goto out_free_new_fa;
 
+	fast_update(t, key, plen, NULL);
+
 	if (!plen)
 		tb->tb_num_default++;
 
@@ -1378,6 +1766,10 @@ int fib_table_lookup(struct fib_table *tb, const struct flowi4 *flp,
 	struct fib_alias *fa;
 	unsigned long index;
 	t_key cindex;
+#ifdef CONFIG_IP_FIB_TRIE_COMPILED
+	struct fast_table *ft = t->fast;
+	bool compiled = false;
+#endif
 
 	pn = t->kv;
 	cindex = 0;
@@ -1390,9 +1782,31 @@ int fib_table_lookup(struct fib_table *tb, const struct flowi4 *flp,
 	this_cpu_inc(stats->gets);
 #endif
 
+#ifdef CONFIG_IP_FIB_TRIE_COMPILED
+	if (ft && ACCESS_ONCE(ft->valid)) {
+		struct key_vector *l;
+
+		/* pairs with smp_wmb() in fast_rebuild() */
+		smp_rmb();
+		l = fast_lookup(t, key);
+#ifdef CONFIG_IP_FIB_TRIE_STATS
+		this_cpu_inc(stats->fast_gets);
+#endif
+		if (!l)
+			return -EAGAIN;
+		n = l;
+		compiled = true;
+		goto found;
+	}
+trie_walk:
+#endif
+
 	/* Step 1: Travel to the longest prefix match in the trie */
 	for (;;) {
 		index = get_cindex(key, n);
+#ifdef CONFIG_IP_FIB_TRIE_STATS
+		this_cpu_inc(stats->node_visits);
+#endif
 
 		/* This bit of code is a bit tricky but it combines multiple
 		 * checks into a single check.  The prefix consists of the
@@ -1437,6 +1851,9 @@ int fib_table_lookup(struct fib_table *tb, const struct flowi4 *flp,
 		 * between the key and the prefix exist in the region of
 		 * the lsb and higher in the prefix.
 		 */
+#ifdef CONFIG_IP_FIB_TRIE_STATS
+		this_cpu_inc(stats->node_visits);
+#endif
 		if (unlikely(prefix_mismatch(key, n)) || (n->slen == n->pos))
 			goto backtrace;
 
@@ -1539,6 +1956,23 @@ found:
 	}
 #ifdef CONFIG_IP_FIB_TRIE_STATS
 	this_cpu_inc(stats->semantic_match_miss);
+#endif
+#ifdef CONFIG_IP_FIB_TRIE_COMPILED
+	/* No usable alias in the leaf, resolve TOS, scope and dead next
+	 * hops by walking the trie, which knows how to backtrack.
+	 */
+	if (compiled) {
+#ifdef CONFIG_IP_FIB_TRIE_STATS
+		this_cpu_inc(stats->fast_fallback);
+#endif
+		compiled = false;
+		pn = t->kv;
+		cindex = 0;
+		n = get_child_rcu(pn, cindex);
+		if (!n)
+			return -EAGAIN;
+		goto trie_walk;
+	}
 #endif
 	goto backtrace;
 }
@@ -1635,6 +2069,8 @@ int fib_table_delete(struct net *net, struct fib_table *tb,
 	if (!plen)
 		tb->tb_num_default--;
 
+	/* before the leaf can be freed */
+	fast_update(t, key, plen, fa_to_delete);
 	fib_remove_alias(t, tp, l, fa_to_delete);
 
 	if (fa_to_delete->fa_state & FA_S_ACCESSED)
@@ -1712,6 +2148,10 @@ int fib_table_flush(struct net *net, struct fib_table *tb)
 	struct hlist_node *tmp;
 	struct fib_alias *fa;
 	int found = 0;
+	bool fast_valid;
+
+	/* leaves are freed below, stop using the compiled table */
+	fast_valid = fast_suspend(t);
 
 	/* walk trie in reverse order */
 	for (;;) {
@@ -1773,6 +2213,8 @@ int fib_table_flush(struct net *net, struct fib_table *tb)
 		}
 	}
 
+	fast_resume(t, fast_valid, found);
+
 	pr_debug("trie_flush found=%d\n", found);
 	return found;
 }
@@ -1849,6 +2291,9 @@ static void __trie_free_rcu(struct rcu_head *head)
 #ifdef CONFIG_IP_FIB_TRIE_STATS
 	free_percpu(t->stats);
 #endif /* CONFIG_IP_FIB_TRIE_STATS */
+#ifdef CONFIG_IP_FIB_TRIE_COMPILED
+	fast_free(t);
+#endif
 	kfree(tb);
 }
 
@@ -1940,6 +2385,11 @@ void __init fib_trie_init(void)
 	trie_leaf_kmem = kmem_cache_create("ip_fib_trie",
 					   LEAF_SIZE,
 					   0, SLAB_PANIC, NULL);
+#ifdef CONFIG_IP_FIB_TRIE_COMPILED
+	fast_chunk_kmem = kmem_cache_create("ip_fib_fast",
+					    sizeof(struct fast_chunk),
+					    0, SLAB_PANIC, NULL);
+#endif
 }
 
 struct fib_table *fib_trie_table(u32 id)
@@ -1962,9 +2412,13 @@ struct fib_table *fib_trie_table(u32 id)
 	t->stats = alloc_percpu(struct trie_use_stats);
 	if (!t->stats) {
 		kfree(tb);
-		tb = NULL;
+		return NULL;
 	}
 #endif
+#ifdef CONFIG_IP_FIB_TRIE_COMPILED
+	if (id == RT_TABLE_MAIN)
+		fast_init(t);
+#endif
 
 	return tb;
 }
@@ -2124,6 +2578,7 @@ static void trie_show_usage(struct seq_file *seq,
 			    const struct trie_use_stats __percpu *stats)
 {
 	struct trie_use_stats s = { 0 };
+	unsigned int walks;
 	int cpu;
 
 	/* loop through all of the CPUs and gather up the stats */
@@ -2131,6 +2586,10 @@ static void trie_show_usage(struct seq_file *seq,
 		const struct trie_use_stats *pcpu = per_cpu_ptr(stats, cpu);
 
 		s.gets += pcpu->gets;
+		s.node_visits += pcpu->node_visits;
+		s.fast_gets += pcpu->fast_gets;
+		s.fast_visits += pcpu->fast_visits;
+		s.fast_fallback += pcpu->fast_fallback;
 		s.backtrack += pcpu->backtrack;
 		s.semantic_match_passed += pcpu->semantic_match_passed;
 		s.semantic_match_miss += pcpu->semantic_match_miss;
@@ -2145,7 +2604,27 @@ static void trie_show_usage(struct seq_file *seq,
 		   s.semantic_match_passed);
 	seq_printf(seq, "semantic match miss = %u\n", s.semantic_match_miss);
 	seq_printf(seq, "null node hit= %u\n", s.null_node_hit);
-	seq_printf(seq, "skipped node resize = %u\n\n", s.resize_node_skipped);
+	seq_printf(seq, "skipped node resize = %u\n", s.resize_node_skipped);
+
+	/* lookup cost: nodes visited per trie walk against levels visited
+	 * per compiled table lookup
+	 */
+	walks = s.gets - s.fast_gets + s.fast_fallback;
+	if (walks) {
+		u64 avg = div_u64((u64)s.node_visits * 100, walks);
+
+		seq_printf(seq, "trie nodes per lookup = %u.%02u\n",
+			   (unsigned int)avg / 100, (unsigned int)avg % 100);
+	}
+	if (s.fast_gets) {
+		u64 avg = div_u64((u64)s.fast_visits * 100, s.fast_gets);
+
+		seq_printf(seq, "compiled gets = %u\n", s.fast_gets);
+		seq_printf(seq, "compiled fallbacks = %u\n", s.fast_fallback);
+		seq_printf(seq, "compiled levels per lookup = %u.%02u\n",
+			   (unsigned int)avg / 100, (unsigned int)avg % 100);
+	}
+	seq_putc(seq, '\n');
 }
 #endif /*  CONFIG_IP_FIB_TRIE_STATS */
 
@@ -2185,6 +2664,17 @@ static int fib_triestat_seq_show(struct seq_file *seq, void *v)
 
 			trie_collect_stats(t, &stat);
 			trie_show_stats(seq, &stat);
+#ifdef CONFIG_IP_FIB_TRIE_COMPILED
+			if (t->fast) {
+				unsigned int chunks = ACCESS_ONCE(t->fast->chunks);
+
+				seq_printf(seq, "\tCompiled table: %s, %u chunks, %zu kB\n",
+					   ACCESS_ONCE(t->fast->valid) ?
+					   "valid" : "rebuilding", chunks,
+					   (sizeof(struct fast_table) +
+					    chunks * sizeof(struct fast_chunk)) >> 10);
+			}
+#endif
 #ifdef CONFIG_IP_FIB_TRIE_STATS
 			trie_show_usage(seq, t->stats);
 #endif
@@ -25,8 +25,12 @@
 #include <linux/proc_fs.h>
 #include <linux/err.h>
 #include <linux/cpumask.h>
+#include <linux/sort.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
 
 #include <linux/netfilter/x_tables.h>
+#include <linux/netfilter/xt_tcpudp.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <net/netfilter/nf_log.h>
 #include "../../netfilter/xt_repldata.h"
@@ -282,6 +286,424 @@ struct ipt_entry *ipt_next_entry(const struct ipt_entry *entry)
 	return (void *)entry + entry->next_offset;
 }
 
+/*
+ * Ruleset classifier.
+ *
+ * When a table is loaded we build candidate lists of entries, in table
+ * order, keyed by layer 4 protocol and, for tcp/udp rules whose first
+ * match asks for a single destination port, by that port as well.  Each
+ * slot also carries the rule's destination prefix.  When an entry does
+ * not match, ipt_do_table() jumps straight to the next entry on the
+ * packet's lists instead of walking everything in between.
+ *
+ * Only entries that cannot match are ever skipped, and skipping them
+ * never bypasses a match with side effects: the address and protocol
+ * tests come before any match is called, and xt_tcpudp rejects a wrong
+ * port before it looks at anything else once the header is readable and
+ * the packet is not a fragment.  Packets that fail those conditions fall
+ * back to the per protocol list.  Chain policies, RETURNs and ERROR
+ * entries are unconditional and thus on every list, so a skip never
+ * leaves the current chain.
+ */
+struct ipt_cls_rule {
+	unsigned int	offset;		/* entry offset from the table base */
+	__be32		dst;		/* destination prefix, 0/0 when it */
+	__be32		dmsk;		/* can't be used to skip the entry */
+};
+
+struct ipt_cls_list {
+	unsigned int	first;		/* index into ipt_classifier.rules */
+	unsigned int	count;
+};
+
+struct ipt_cls_port {
+	u16			port;
+	struct ipt_cls_list	list;	/* rules for exactly this port */
+};
+
+struct ipt_cls_proto {
+	struct ipt_cls_list	all;	/* rules that can match this proto */
+	struct ipt_cls_list	anyport; /* same, minus single port rules */
+	unsigned int		first_port;
+	unsigned int		nports;
+};
+
+struct ipt_classifier {
+	struct xt_classifier	xt;
+	struct ipt_cls_list	any;	/* rules that match any protocol */
+	s16			proto[256]; /* index into protos, -1 if none */
+	struct ipt_cls_proto	*protos;
+	struct ipt_cls_port	*ports;
+	struct ipt_cls_rule	*rules;
+};
+
+struct ipt_cls_cursor {
+	const struct ipt_cls_rule *a, *a_end;
+	const struct ipt_cls_rule *b, *b_end;
+};
+
+static unsigned int classifier_min_rules __read_mostly = 64;
+module_param(classifier_min_rules, uint, 0644);
+MODULE_PARM_DESC(classifier_min_rules,
+		 "Index tables with at least this many rules (0 = never)");
+
+/* Give up indexing when the lists would need more slots than this per entry */
+#define IPT_CLS_MAX_FACTOR	16
+
+/* Destination port as xt_tcpudp would see it, or -1 if it can't. */
+static int ipt_cls_dport(const struct sk_buff *skb, u8 protocol,
+			 unsigned int thoff)
+{
+	union {
+		struct tcphdr	tcp;
+		struct udphdr	udp;
+	} _hdr;
+
+	if (protocol == IPPROTO_TCP) {
+		const struct tcphdr *th;
+
+		th = skb_header_pointer(skb, thoff, sizeof(_hdr.tcp), &_hdr);
+		return th ? ntohs(th->dest) : -1;
+	}
+	if (protocol == IPPROTO_UDP) {
+		const struct udphdr *uh;
+
+		uh = skb_header_pointer(skb, thoff, sizeof(_hdr.udp), &_hdr);
+		return uh ? ntohs(uh->dest) : -1;
+	}
+	return -1;
+}
+
+static const struct ipt_cls_list *
+ipt_cls_port_find(const struct ipt_classifier *cls,
+		  const struct ipt_cls_proto *pr, int dport)
+{
+	const struct ipt_cls_port *p = cls->ports + pr->first_port;
+	unsigned int lo = 0, hi = pr->nports;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (p[mid].port < dport)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < pr->nports && p[lo].port == dport)
+		return &p[lo].list;
+	return NULL;
+}
+
+static void ipt_cls_select(const struct ipt_classifier *cls,
+			   const struct sk_buff *skb, const struct iphdr *ip,
+			   const struct xt_action_param *par,
+			   struct ipt_cls_cursor *cur)
+{
+	const struct ipt_cls_list *a = &cls->any, *b = NULL;
+	int idx = cls->proto[ip->protocol];
+
+	if (idx >= 0) {
+		const struct ipt_cls_proto *pr = &cls->protos[idx];
+
+		a = &pr->all;
+		if (pr->nports && par->fragoff == 0) {
+			int dport = ipt_cls_dport(skb, ip->protocol,
+						  par->thoff);
+
+			if (dport >= 0) {
+				a = &pr->anyport;
+				b = ipt_cls_port_find(cls, pr, dport);
+			}
+		}
+	}
+
+	cur->a = cls->rules + a->first;
+	cur->a_end = cur->a + a->count;
+	if (b) {
+		cur->b = cls->rules + b->first;
+		cur->b_end = cur->b + b->count;
+	} else {
+		cur->b = cur->b_end = NULL;
+	}
+}
+
+/* First slot past @off whose destination prefix fits @daddr */
+static const struct ipt_cls_rule *
+ipt_cls_next(const struct ipt_cls_rule *r, const struct ipt_cls_rule *end,
+	     unsigned int off, __be32 daddr)
+{
+	unsigned int lo = 0, hi = end - r;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (r[mid].offset <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (r += lo; r < end; r++)
+		if ((daddr & r->dmsk) == r->dst)
+			return r;
+	return NULL;
+}
+
+/* Performance critical */
+static inline struct ipt_entry *
+ipt_next_candidate(const void *table_base, const struct ipt_entry *e,
+		   const struct ipt_cls_cursor *cur, const struct iphdr *ip)
+{
+	const struct ipt_cls_rule *a, *b;
+	unsigned int off;
+
+	if (!cur->a)
+		return ipt_next_entry(e);
+
+	off = (void *)e - table_base;
+	a = ipt_cls_next(cur->a, cur->a_end, off, ip->daddr);
+	b = ipt_cls_next(cur->b, cur->b_end, off, ip->daddr);
+	if (b && (!a || b->offset < a->offset))
+		a = b;
+	if (unlikely(!a))
+		return ipt_next_entry(e);
+	return get_entry(table_base, a->offset);
+}
+
+/* Per entry classification used while building */
+struct ipt_cls_tmp {
+	struct ipt_cls_rule	rule;
+	s16			proto;	/* -1: any protocol */
+	s32			port;	/* -1: no single destination port */
+};
+
+static void ipt_cls_classify(const struct ipt_entry *e, const void *entry0,
+			     struct ipt_cls_tmp *t)
+{
+	const struct xt_entry_match *m = (const void *)e->elems;
+
+	t->rule.offset = (void *)e - entry0;
+	if (e->ip.invflags & IPT_INV_DSTIP) {
+		t->rule.dst = 0;
+		t->rule.dmsk = 0;
+	} else {
+		t->rule.dst = e->ip.dst.s_addr;
+		t->rule.dmsk = e->ip.dmsk.s_addr;
+	}
+
+	t->proto = -1;
+	t->port = -1;
+	if (!e->ip.proto || e->ip.invflags & IPT_INV_PROTO)
+		return;
+	t->proto = e->ip.proto;
+
+	/* only the first match, earlier ones could have side effects */
+	if (e->target_offset == sizeof(struct ipt_entry) ||
+	    m->u.kernel.match->revision != 0)
+		return;
+
+	if (e->ip.proto == IPPROTO_TCP &&
+	    strcmp(m->u.kernel.match->name, "tcp") == 0) {
+		const struct xt_tcp *tcp = (const void *)m->data;
+
+		if (!(tcp->invflags & XT_TCP_INV_DSTPT) &&
+		    tcp->dpts[0] == tcp->dpts[1])
+			t->port = tcp->dpts[0];
+	} else if (e->ip.proto == IPPROTO_UDP &&
+		   strcmp(m->u.kernel.match->name, "udp") == 0) {
+		const struct xt_udp *udp = (const void *)m->data;
+
+		if (!(udp->invflags & XT_UDP_INV_DSTPT) &&
+		    udp->dpts[0] == udp->dpts[1])
+			t->port = udp->dpts[0];
+	}
+}
+
+static int ipt_cls_tmp_cmp(const void *a, const void *b)
+{
+	const struct ipt_cls_tmp *x = a, *y = b;
+
+	if (x->proto != y->proto)
+		return x->proto - y->proto;
+	if (x->port != y->port)
+		return x->port - y->port;
+	return x->rule.offset < y->rule.offset ? -1 : 1;
+}
+
+static void *ipt_cls_zalloc(size_t sz)
+{
+	void *p = kzalloc(sz, GFP_KERNEL | __GFP_NOWARN);
+
+	return p ? p : vzalloc(sz);
+}
+
+static void ipt_cls_destroy(struct xt_classifier *xt)
+{
+	free_percpu(xt->stats);
+	kvfree(container_of(xt, struct ipt_classifier, xt));
+}
+
+/* Append the entries of @tmp accepted by @want to @cls->rules */
+static void ipt_cls_fill(struct ipt_classifier *cls, unsigned int *next,
+			 struct ipt_cls_list *list,
+			 const struct ipt_cls_tmp *tmp, unsigned int n,
+			 int proto, bool anyport)
+{
+	unsigned int i;
+
+	list->first = *next;
+	for (i = 0; i < n; i++) {
+		if (tmp[i].proto >= 0 &&
+		    (tmp[i].proto != proto || (anyport && tmp[i].port >= 0)))
+			continue;
+		cls->rules[(*next)++] = tmp[i].rule;
+	}
+	list->count = *next - list->first;
+}
+
+static struct ipt_classifier *
+ipt_cls_index(const struct xt_table_info *info, void *entry0)
+{
+	unsigned int i, n = info->number, nany = 0, nexact = 0;
+	unsigned int nprotos = 0, nports = 0, nrules, next = 0;
+	unsigned int *cnt, *exact;
+	struct ipt_cls_tmp *tmp, *ex;
+	struct ipt_classifier *cls = NULL;
+	const struct ipt_entry *iter;
+	size_t sz;
+	int p;
+
+	/* rules per protocol, and how many of those are single port */
+	cnt = kcalloc(2 * 256, sizeof(*cnt), GFP_KERNEL);
+	if (!cnt)
+		return NULL;
+	exact = cnt + 256;
+
+	tmp = ipt_cls_zalloc(n * sizeof(*tmp));
+	if (!tmp)
+		goto out_cnt;
+
+	i = 0;
+	xt_entry_foreach(iter, entry0, info->size) {
+		ipt_cls_classify(iter, entry0, &tmp[i]);
+		if (tmp[i].proto < 0) {
+			nany++;
+		} else {
+			cnt[tmp[i].proto]++;
+			if (tmp[i].port >= 0)
+				exact[tmp[i].proto]++;
+		}
+		i++;
+	}
+
+	nrules = nany;
+	for (p = 0; p < 256; p++) {
+		if (!cnt[p])
+			continue;
+		nprotos++;
+		/* the all list, then anyport plus the per port lists */
+		nrules += nany + cnt[p];
+		if (exact[p])
+			nrules += nany + cnt[p];
+	}
+	if (nrules > IPT_CLS_MAX_FACTOR * n)
+		goto out;
+
+	/* exact port rules, grouped by (proto, port) in table order */
+	ex = ipt_cls_zalloc(n * sizeof(*ex));
+	if (!ex)
+		goto out;
+	for (i = 0; i < n; i++)
+		if (tmp[i].port >= 0)
+			ex[nexact++] = tmp[i];
+	sort(ex, nexact, sizeof(*ex), ipt_cls_tmp_cmp, NULL);
+	for (i = 0; i < nexact; i++)
+		if (i == 0 || ex[i].proto != ex[i - 1].proto ||
+		    ex[i].port != ex[i - 1].port)
+			nports++;
+
+	sz = sizeof(*cls) + nprotos * sizeof(*cls->protos) +
+	     nports * sizeof(*cls->ports) + nrules * sizeof(*cls->rules);
+	cls = ipt_cls_zalloc(sz);
+	if (!cls)
+		goto out_ex;
+	cls->protos = (void *)(cls + 1);
+	cls->ports = (void *)(cls->protos + nprotos);
+	cls->rules = (void *)(cls->ports + nports);
+
+	ipt_cls_fill(cls, &next, &cls->any, tmp, n, -1, false);
+
+	nprotos = 0;
+	nports = 0;
+	for (p = 0; p < 256; p++) {
+		struct ipt_cls_proto *pr;
+
+		cls->proto[p] = -1;
+		if (!cnt[p])
+			continue;
+
+		cls->proto[p] = nprotos;
+		pr = &cls->protos[nprotos++];
+		ipt_cls_fill(cls, &next, &pr->all, tmp, n, p, false);
+		if (!exact[p]) {
+			pr->anyport = pr->all;
+			continue;
+		}
+		ipt_cls_fill(cls, &next, &pr->anyport, tmp, n, p, true);
+
+		pr->first_port = nports;
+		for (i = 0; i < nexact; i++) {
+			struct ipt_cls_port *port;
+
+			if (ex[i].proto != p)
+				continue;
+			if (pr->nports == 0 ||
+			    cls->ports[nports - 1].port != ex[i].port) {
+				port = &cls->ports[nports++];
+				port->port = ex[i].port;
+				port->list.first = next;
+				pr->nports++;
+			}
+			port = &cls->ports[nports - 1];
+			cls->rules[next++] = ex[i].rule;
+			port->list.count++;
+		}
+	}
+	cls->xt.rules = n;
+
+out_ex:
+	kvfree(ex);
+out:
+	kvfree(tmp);
+out_cnt:
+	kfree(cnt);
+	return cls;
+}
+
+/* Called once the entries of @info have been checked; a table without
+ * a classifier (allocation failure) is simply walked linearly.
+ */
+static struct xt_classifier *
+ipt_build_classifier(const struct xt_table_info *info, void *entry0)
+{
+	struct ipt_classifier *cls = NULL;
+
+	if (classifier_min_rules && info->number >= classifier_min_rules)
+		cls = ipt_cls_index(info, entry0);
+	if (!cls) {
+		cls = kzalloc(sizeof(*cls), GFP_KERNEL);
+		if (!cls)
+			return NULL;
+	}
+
+	cls->xt.stats = alloc_percpu(struct xt_classifier_stats);
+	if (!cls->xt.stats) {
+		kvfree(cls);
+		return NULL;
+	}
+	cls->xt.destroy = ipt_cls_destroy;
+	return &cls->xt;
+}
+
 /* Returns one of the generic firewall policies, like NF_ACCEPT. */
 unsigned int
 ipt_do_table(struct sk_buff *skb,
@@ -298,8 +720,10 @@ ipt_do_table(struct sk_buff *skb,
 	struct ipt_entry *e, **jumpstack;
 	unsigned int *stackptr, origptr, cpu;
 	const struct xt_table_info *private;
+	const struct ipt_classifier *cls = NULL;
+	struct ipt_cls_cursor cur = {};
 	struct xt_action_param acpar;
-	unsigned int addend;
+	unsigned int addend, evaluated = 0;
 
 	/* Initialization */
 	ip = ip_hdr(skb);
@@ -333,6 +757,12 @@ ipt_do_table(struct sk_buff *skb,
 	jumpstack  = (struct ipt_entry **)private->jumpstack[cpu];
 	stackptr   = per_cpu_ptr(private->stackptr, cpu);
 	origptr    = *stackptr;
+	if (private->classifier) {
+		cls = container_of(private->classifier,
+				   struct ipt_classifier, xt);
+		if (cls->xt.rules)
+			ipt_cls_select(cls, skb, ip, &acpar, &cur);
+	}
 
 	e = get_entry(table_base, private->hook_entry[hook]);
 
@@ -346,10 +776,11 @@ ipt_do_table(struct sk_buff *skb,
 		struct xt_counters *counter;
 
 		IP_NF_ASSERT(e);
+		evaluated++;
 		if (!ip_packet_match(ip, indev, outdev,
 		    &e->ip, acpar.fragoff)) {
  no_match:
-			e = ipt_next_entry(e);
+			e = ipt_next_candidate(table_base, e, &cur, ip);
 			continue;
 		}
 
@@ -417,15 +848,23 @@ ipt_do_table(struct sk_buff *skb,
 		verdict = t->u.kernel.target->target(skb, &acpar);
 		/* Target might have changed stuff. */
 		ip = ip_hdr(skb);
-		if (verdict == XT_CONTINUE)
+		if (verdict == XT_CONTINUE) {
+			if (cur.a)
+				ipt_cls_select(cls, skb, ip, &acpar, &cur);
 			e = ipt_next_entry(e);
-		else
+		} else
 			/* Verdict */
 			break;
 	} while (!acpar.hotdrop);
 	pr_debug("Exiting %s; resetting sp from %u to %u\n",
 		 __func__, *stackptr, origptr);
 	*stackptr = origptr;
+	if (cls) {
+		struct xt_classifier_stats *st = this_cpu_ptr(cls->xt.stats);
+
+		st->packets++;
+		st->evaluated += evaluated;
+	}
  	xt_write_recseq_end(addend);
  	local_bh_enable();
 
@@ -879,6 +1318,7 @@ translate_table(struct net *net, struct xt_table_info *newinfo, void *entry0,
 		return ret;
 	}
 
+	newinfo->classifier = ipt_build_classifier(newinfo, entry0);
 	return ret;
  out_free:
 	kvfree(offsets);
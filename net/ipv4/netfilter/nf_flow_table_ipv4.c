@@ -0,0 +1,683 @@
+/*
+ * IPv4 flow offload table
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Offloading is requested by the ruleset: the FLOWOFFLOAD target in the
+ * filter table's FORWARD chain records the forwarding decision and NAT
+ * mapping of an established TCP or UDP connection, for the direction of
+ * the packet it sees, in a flow keyed by the packet's 5-tuple, TOS and
+ * input interface. Received packets that match a flow are rewritten and
+ * handed to the neighbour layer straight from netif_receive_skb(),
+ * bypassing the netfilter hooks, the routing lookup and ip_forward().
+ * Rules after FLOWOFFLOAD are therefore only evaluated until the flow is
+ * set up.
+ *
+ * Packets carrying a mark are never offloaded, since the mark may select
+ * the route and is not known on the receive path.
+ *
+ * Packets that the fast path cannot handle (IP options, fragments, TTL
+ * expiry, exceeding the MTU, TCP FIN or RST) go through the normal stack,
+ * which keeps conntrack state and ICMP generation correct. Flows are
+ * removed once idle, when their conntrack entry dies, their route is
+ * invalidated or the iptables or nftables ruleset changes.
+ */
+
+#include <linux/types.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/jhash.h>
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/rtnetlink.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter/x_tables.h>
+#include <net/arp.h>
+#include <net/ip.h>
+#include <net/neighbour.h>
+#include <net/net_namespace.h>
+#include <net/route.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_core.h>
+#include <net/netfilter/nf_conntrack_helper.h>
+
+static unsigned int nf_flow_hashsize __read_mostly = 16384;
+module_param_named(hashsize, nf_flow_hashsize, uint, 0400);
+MODULE_PARM_DESC(hashsize, "number of flow table hash buckets");
+
+static unsigned int nf_flow_max __read_mostly;
+module_param_named(max, nf_flow_max, uint, 0644);
+MODULE_PARM_DESC(max, "maximum number of flows, 0 for eight per bucket");
+
+static unsigned int nf_flow_timeout __read_mostly = 30;
+module_param_named(timeout, nf_flow_timeout, uint, 0644);
+MODULE_PARM_DESC(timeout, "seconds an idle flow stays in the table");
+
+/* Key of a flow: the headers of the packet as received, before NAT */
+struct nf_flow_tuple {
+	__be32			saddr;
+	__be32			daddr;
+	__be16			sport;
+	__be16			dport;
+	u8			l4proto;
+	u8			tos;
+	u8			pad[2];
+	int			iifindex;
+};
+
+#define NF_FLOW_SNAT		0x1
+#define NF_FLOW_DNAT		0x2
+#define NF_FLOW_TEARDOWN	0x4
+
+struct nf_flow {
+	struct hlist_node	hnode;
+	struct nf_flow_tuple	tuple;
+	unsigned long		timeout;
+	unsigned int		flags;
+	unsigned int		mtu;
+	struct dst_entry	*dst;
+	struct net		*net;
+	struct nf_conn		*ct;
+
+	/* Ruleset generations the flow was set up under */
+	unsigned int		xt_gen;
+	unsigned int		nft_gen;
+
+	/* Headers after NAT */
+	__be32			new_saddr;
+	__be32			new_daddr;
+	__be16			new_sport;
+	__be16			new_dport;
+
+	struct rcu_head		rcu;
+};
+
+static struct hlist_head *nf_flow_hash __read_mostly;
+static unsigned int nf_flow_hash_rnd __read_mostly;
+static DEFINE_SPINLOCK(nf_flow_lock);
+static unsigned int nf_flow_count;
+static struct delayed_work nf_flow_gc_work;
+
+static u32 nf_flow_hashfn(const struct nf_flow_tuple *tuple)
+{
+	return jhash2((const u32 *)tuple, sizeof(*tuple) / sizeof(u32),
+		      nf_flow_hash_rnd) & (nf_flow_hashsize - 1);
+}
+
+static struct nf_flow *nf_flow_find(const struct net *net,
+				    const struct nf_flow_tuple *tuple)
+{
+	struct nf_flow *flow;
+
+	hlist_for_each_entry_rcu(flow, &nf_flow_hash[nf_flow_hashfn(tuple)],
+				 hnode) {
+		if (!memcmp(&flow->tuple, tuple, sizeof(*tuple)) &&
+		    net_eq(flow->net, net))
+			return flow;
+	}
+	return NULL;
+}
+
+static void nf_flow_free_rcu(struct rcu_head *head)
+{
+	struct nf_flow *flow = container_of(head, struct nf_flow, rcu);
+
+	dst_release(flow->dst);
+	nf_ct_put(flow->ct);
+	kfree(flow);
+}
+
+/* Called with nf_flow_lock held */
+static void nf_flow_del(struct nf_flow *flow)
+{
+	hlist_del_rcu(&flow->hnode);
+	nf_flow_count--;
+	call_rcu(&flow->rcu, nf_flow_free_rcu);
+}
+
+static unsigned int nf_flow_nft_gen(const struct net *net)
+{
+#if IS_ENABLED(CONFIG_NF_TABLES)
+	return ACCESS_ONCE(net->nft.base_seq);
+#else
+	return 0;
+#endif
+}
+
+/* The verdict that set up the flow may not hold under a new ruleset */
+static bool nf_flow_ruleset_changed(const struct nf_flow *flow)
+{
+	return flow->xt_gen != atomic_read(&xt_table_gen) ||
+	       flow->nft_gen != nf_flow_nft_gen(flow->net);
+}
+
+static bool nf_flow_stale(const struct nf_flow *flow)
+{
+	return flow->flags & NF_FLOW_TEARDOWN ||
+	       nf_ct_is_dying(flow->ct) ||
+	       dst_check(flow->dst, 0) == NULL ||
+	       nf_flow_ruleset_changed(flow);
+}
+
+/*
+ * Fast path
+ */
+
+static void nf_flow_nat_ip(const struct nf_flow *flow, struct sk_buff *skb,
+			   struct iphdr *iph, __sum16 *check)
+{
+	if (flow->flags & NF_FLOW_SNAT) {
+		csum_replace4(&iph->check, iph->saddr, flow->new_saddr);
+		if (check)
+			inet_proto_csum_replace4(check, skb, iph->saddr,
+						 flow->new_saddr, 1);
+		iph->saddr = flow->new_saddr;
+	}
+	if (flow->flags & NF_FLOW_DNAT) {
+		csum_replace4(&iph->check, iph->daddr, flow->new_daddr);
+		if (check)
+			inet_proto_csum_replace4(check, skb, iph->daddr,
+						 flow->new_daddr, 1);
+		iph->daddr = flow->new_daddr;
+	}
+}
+
+static void nf_flow_nat_port(const struct nf_flow *flow, struct sk_buff *skb,
+			     __be16 *ports, __sum16 *check)
+{
+	if (flow->new_sport != ports[0]) {
+		if (check)
+			inet_proto_csum_replace2(check, skb, ports[0],
+						 flow->new_sport, 0);
+		ports[0] = flow->new_sport;
+	}
+	if (flow->new_dport != ports[1]) {
+		if (check)
+			inet_proto_csum_replace2(check, skb, ports[1],
+						 flow->new_dport, 0);
+		ports[1] = flow->new_dport;
+	}
+}
+
+static void nf_flow_nat(const struct nf_flow *flow, struct sk_buff *skb)
+{
+	struct iphdr *iph = ip_hdr(skb);
+	void *l4 = (void *)iph + sizeof(*iph);
+	__sum16 *check = NULL;
+
+	if (!(flow->flags & (NF_FLOW_SNAT | NF_FLOW_DNAT)))
+		return;
+
+	if (iph->protocol == IPPROTO_TCP) {
+		check = &((struct tcphdr *)l4)->check;
+	} else {
+		struct udphdr *uh = l4;
+
+		if (uh->check || skb->ip_summed == CHECKSUM_PARTIAL)
+			check = &uh->check;
+	}
+
+	nf_flow_nat_ip(flow, skb, iph, check);
+	nf_flow_nat_port(flow, skb, l4, check);
+
+	if (iph->protocol == IPPROTO_UDP && check && !*check)
+		*check = CSUM_MANGLED_0;
+}
+
+static int nf_flow_xmit(struct sk_buff *skb, struct dst_entry *dst)
+{
+	struct rtable *rt = (struct rtable *)dst;
+	struct net_device *dev = dst->dev;
+	unsigned int hh_len = LL_RESERVED_SPACE(dev);
+	struct neighbour *neigh;
+	u32 nexthop;
+	int res;
+
+	if (unlikely(skb_headroom(skb) < hh_len && dev->header_ops)) {
+		if (pskb_expand_head(skb, HH_DATA_ALIGN(hh_len), 0,
+				     GFP_ATOMIC)) {
+			kfree_skb(skb);
+			return -ENOMEM;
+		}
+	}
+
+	rcu_read_lock_bh();
+	nexthop = (__force u32)rt_nexthop(rt, ip_hdr(skb)->daddr);
+	neigh = __ipv4_neigh_lookup_noref(dev, nexthop);
+	if (unlikely(!neigh))
+		neigh = __neigh_create(&arp_tbl, &nexthop, dev, false);
+	if (IS_ERR(neigh)) {
+		rcu_read_unlock_bh();
+		kfree_skb(skb);
+		return -EINVAL;
+	}
+	res = dst_neigh_output(dst, neigh, skb);
+	rcu_read_unlock_bh();
+
+	return res;
+}
+
+static rx_handler_result_t nf_flow_offload_rx(struct sk_buff **pskb)
+{
+	struct sk_buff *skb = *pskb;
+	struct nf_flow_tuple tuple;
+	unsigned long timeout;
+	struct nf_flow *flow;
+	unsigned int thoff, hdrsize;
+	struct iphdr *iph;
+	__be16 *ports;
+
+	if (skb->protocol != htons(ETH_P_IP) ||
+	    skb->pkt_type != PACKET_HOST)
+		return RX_HANDLER_PASS;
+
+	skb = skb_share_check(skb, GFP_ATOMIC);
+	if (unlikely(skb == NULL))
+		return RX_HANDLER_CONSUMED;
+	*pskb = skb;
+
+	if (!pskb_may_pull(skb, sizeof(*iph)))
+		return RX_HANDLER_PASS;
+
+	iph = ip_hdr(skb);
+	if (iph->ihl != 5 || iph->version != 4 || ip_is_fragment(iph) ||
+	    iph->ttl <= 1)
+		return RX_HANDLER_PASS;
+	if (iph->protocol != IPPROTO_TCP && iph->protocol != IPPROTO_UDP)
+		return RX_HANDLER_PASS;
+
+	thoff = sizeof(*iph);
+	hdrsize = thoff + (iph->protocol == IPPROTO_TCP ?
+			   sizeof(struct tcphdr) : sizeof(struct udphdr));
+	if (!pskb_may_pull(skb, hdrsize))
+		return RX_HANDLER_PASS;
+
+	iph = ip_hdr(skb);
+	if (unlikely(ip_fast_csum((u8 *)iph, iph->ihl)) ||
+	    ntohs(iph->tot_len) > skb->len ||
+	    ntohs(iph->tot_len) < hdrsize)
+		return RX_HANDLER_PASS;
+
+	ports = (__be16 *)(skb_network_header(skb) + thoff);
+
+	memset(&tuple, 0, sizeof(tuple));
+	tuple.saddr	= iph->saddr;
+	tuple.daddr	= iph->daddr;
+	tuple.sport	= ports[0];
+	tuple.dport	= ports[1];
+	tuple.l4proto	= iph->protocol;
+	tuple.tos	= iph->tos;
+	tuple.iifindex	= skb->dev->ifindex;
+
+	flow = nf_flow_find(dev_net(skb->dev), &tuple);
+	if (flow == NULL)
+		return RX_HANDLER_PASS;
+
+	if (unlikely(nf_flow_stale(flow))) {
+		flow->flags |= NF_FLOW_TEARDOWN;
+		return RX_HANDLER_PASS;
+	}
+
+	/* Let conntrack see the end of the connection */
+	if (iph->protocol == IPPROTO_TCP) {
+		struct tcphdr *th = (struct tcphdr *)ports;
+
+		if (unlikely(th->fin || th->rst)) {
+			flow->flags |= NF_FLOW_TEARDOWN;
+			return RX_HANDLER_PASS;
+		}
+	}
+
+	skb_set_transport_header(skb, thoff);
+	if (skb_is_gso(skb) ? skb_gso_network_seglen(skb) > flow->mtu :
+			      ntohs(iph->tot_len) > flow->mtu)
+		return RX_HANDLER_PASS;
+
+	if (pskb_trim_rcsum(skb, ntohs(iph->tot_len)) ||
+	    !skb_make_writable(skb, hdrsize)) {
+		kfree_skb(skb);
+		return RX_HANDLER_CONSUMED;
+	}
+
+	/* Avoid dirtying the flow more than once per tick */
+	timeout = jiffies + nf_flow_timeout * HZ;
+	if (flow->timeout != timeout)
+		flow->timeout = timeout;
+
+	nf_flow_nat(flow, skb);
+	ip_decrease_ttl(ip_hdr(skb));
+
+	IP_INC_STATS_BH(flow->net, IPSTATS_MIB_OUTFORWDATAGRAMS);
+
+	skb_dst_drop(skb);
+	skb_dst_set_noref(skb, flow->dst);
+	skb->dev = flow->dst->dev;
+	nf_flow_xmit(skb, flow->dst);
+
+	return RX_HANDLER_CONSUMED;
+}
+
+/*
+ * Learning
+ */
+
+static bool nf_flow_ct_offloadable(const struct nf_conn *ct,
+				   enum ip_conntrack_info ctinfo)
+{
+	if (ctinfo != IP_CT_ESTABLISHED && ctinfo != IP_CT_ESTABLISHED_REPLY)
+		return false;
+	if (!nf_ct_is_confirmed(ct) || nf_ct_is_dying((struct nf_conn *)ct))
+		return false;
+	if (nfct_help(ct) || test_bit(IPS_SEQ_ADJUST_BIT, &ct->status))
+		return false;
+
+	switch (nf_ct_protonum(ct)) {
+	case IPPROTO_TCP:
+		return ct->proto.tcp.state == TCP_CONNTRACK_ESTABLISHED;
+	case IPPROTO_UDP:
+		return test_bit(IPS_ASSURED_BIT, &ct->status);
+	}
+	return false;
+}
+
+static void nf_flow_fill(struct nf_flow *flow, const struct nf_conn *ct,
+			 enum ip_conntrack_dir dir)
+{
+	const struct nf_conntrack_tuple *t = &ct->tuplehash[dir].tuple;
+	const struct nf_conntrack_tuple *r = &ct->tuplehash[!dir].tuple;
+
+	flow->tuple.saddr	= t->src.u3.ip;
+	flow->tuple.daddr	= t->dst.u3.ip;
+	flow->tuple.sport	= t->src.u.all;
+	flow->tuple.dport	= t->dst.u.all;
+	flow->tuple.l4proto	= t->dst.protonum;
+
+	/* The packet leaves with the inverse of the other direction */
+	flow->new_saddr		= r->dst.u3.ip;
+	flow->new_daddr		= r->src.u3.ip;
+	flow->new_sport		= r->dst.u.all;
+	flow->new_dport		= r->src.u.all;
+
+	if (flow->new_saddr != flow->tuple.saddr ||
+	    flow->new_sport != flow->tuple.sport)
+		flow->flags |= NF_FLOW_SNAT;
+	if (flow->new_daddr != flow->tuple.daddr ||
+	    flow->new_dport != flow->tuple.dport)
+		flow->flags |= NF_FLOW_DNAT;
+}
+
+static void nf_flow_add(struct sk_buff *skb, struct nf_conn *ct,
+			enum ip_conntrack_info ctinfo)
+{
+	struct dst_entry *dst = skb_dst(skb);
+	struct nf_flow *flow;
+	unsigned int max;
+
+	flow = kzalloc(sizeof(*flow), GFP_ATOMIC);
+	if (flow == NULL)
+		return;
+
+	nf_flow_fill(flow, ct, CTINFO2DIR(ctinfo));
+	flow->tuple.tos	= ip_hdr(skb)->tos;
+	flow->tuple.iifindex = skb->skb_iif;
+	flow->net	= nf_ct_net(ct);
+	flow->xt_gen	= atomic_read(&xt_table_gen);
+	flow->nft_gen	= nf_flow_nft_gen(flow->net);
+	flow->mtu	= dst_mtu(dst);
+	flow->timeout	= jiffies + nf_flow_timeout * HZ;
+
+	max = nf_flow_max ? : nf_flow_hashsize * 8;
+
+	spin_lock_bh(&nf_flow_lock);
+	if (nf_flow_count >= max ||
+	    nf_flow_find(flow->net, &flow->tuple) != NULL) {
+		spin_unlock_bh(&nf_flow_lock);
+		kfree(flow);
+		return;
+	}
+
+	/* Conntrack stops seeing the packets of this connection, so it
+	 * must not judge TCP windows when they come back to it.
+	 */
+	if (nf_ct_protonum(ct) == IPPROTO_TCP) {
+		spin_lock(&ct->lock);
+		ct->proto.tcp.seen[0].flags |= IP_CT_TCP_FLAG_BE_LIBERAL;
+		ct->proto.tcp.seen[1].flags |= IP_CT_TCP_FLAG_BE_LIBERAL;
+		spin_unlock(&ct->lock);
+	}
+
+	nf_conntrack_get(&ct->ct_general);
+	flow->ct = ct;
+	dst_hold(dst);
+	flow->dst = dst;
+
+	hlist_add_head_rcu(&flow->hnode,
+			   &nf_flow_hash[nf_flow_hashfn(&flow->tuple)]);
+	nf_flow_count++;
+	spin_unlock_bh(&nf_flow_lock);
+}
+
+/*
+ * FLOWOFFLOAD target: offload the connection of this packet, in the
+ * direction of this packet. Evaluation continues with the next rule.
+ */
+static unsigned int nf_flow_offload_tg(struct sk_buff *skb,
+				       const struct xt_action_param *par)
+{
+	struct dst_entry *dst = skb_dst(skb);
+	enum ip_conntrack_info ctinfo;
+	struct nf_flow_tuple tuple;
+	struct nf_conn *ct;
+
+	if (!(IPCB(skb)->flags & IPSKB_FORWARDED) || dst == NULL ||
+	    dst->xfrm != NULL || ((struct rtable *)dst)->rt_type != RTN_UNICAST)
+		return XT_CONTINUE;
+
+	/* The mark may steer policy routing; the fast path cannot see it */
+	if (skb->mark)
+		return XT_CONTINUE;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	if (ct == NULL || nf_ct_is_untracked(ct) ||
+	    !nf_flow_ct_offloadable(ct, ctinfo))
+		return XT_CONTINUE;
+
+	/* Cheap check before allocating, nf_flow_add() checks again */
+	memset(&tuple, 0, sizeof(tuple));
+	tuple.saddr	= ct->tuplehash[CTINFO2DIR(ctinfo)].tuple.src.u3.ip;
+	tuple.daddr	= ct->tuplehash[CTINFO2DIR(ctinfo)].tuple.dst.u3.ip;
+	tuple.sport	= ct->tuplehash[CTINFO2DIR(ctinfo)].tuple.src.u.all;
+	tuple.dport	= ct->tuplehash[CTINFO2DIR(ctinfo)].tuple.dst.u.all;
+	tuple.l4proto	= nf_ct_protonum(ct);
+	tuple.tos	= ip_hdr(skb)->tos;
+	tuple.iifindex	= skb->skb_iif;
+
+	rcu_read_lock();
+	if (nf_flow_find(nf_ct_net(ct), &tuple) == NULL)
+		nf_flow_add(skb, ct, ctinfo);
+	rcu_read_unlock();
+
+	return XT_CONTINUE;
+}
+
+static int nf_flow_offload_tg_check(const struct xt_tgchk_param *par)
+{
+	return nf_ct_l3proto_try_module_get(par->family);
+}
+
+static void nf_flow_offload_tg_destroy(const struct xt_tgdtor_param *par)
+{
+	nf_ct_l3proto_module_put(par->family);
+}
+
+static struct xt_target nf_flow_offload_tg_reg __read_mostly = {
+	.name		= "FLOWOFFLOAD",
+	.family		= NFPROTO_IPV4,
+	.table		= "filter",
+	.hooks		= 1 << NF_INET_FORWARD,
+	.target		= nf_flow_offload_tg,
+	.checkentry	= nf_flow_offload_tg_check,
+	.destroy	= nf_flow_offload_tg_destroy,
+	.me		= THIS_MODULE,
+};
+
+/*
+ * Garbage collection
+ */
+
+static void nf_flow_flush(bool (*match)(const struct nf_flow *, void *),
+			  void *data)
+{
+	struct hlist_node *n;
+	struct nf_flow *flow;
+	unsigned int i;
+
+	for (i = 0; i < nf_flow_hashsize; i++) {
+		spin_lock_bh(&nf_flow_lock);
+		hlist_for_each_entry_safe(flow, n, &nf_flow_hash[i], hnode) {
+			if (match(flow, data))
+				nf_flow_del(flow);
+		}
+		spin_unlock_bh(&nf_flow_lock);
+	}
+}
+
+static bool nf_flow_gc_match(const struct nf_flow *flow, void *data)
+{
+	struct nf_conn *ct = flow->ct;
+
+	if (time_after(jiffies, flow->timeout) || nf_flow_stale(flow))
+		return true;
+
+	/* The fast path does not refresh the conntrack entry, keep it
+	 * alive for as long as the flow is.
+	 */
+	ct->timeout = nfct_time_stamp + 2 * nf_flow_timeout * HZ;
+	return false;
+}
+
+static void nf_flow_gc_worker(struct work_struct *work)
+{
+	nf_flow_flush(nf_flow_gc_match, NULL);
+	queue_delayed_work(system_long_wq, &nf_flow_gc_work, HZ);
+}
+
+static bool nf_flow_dev_match(const struct nf_flow *flow, void *data)
+{
+	const struct net_device *dev = data;
+
+	return (net_eq(flow->net, dev_net(dev)) &&
+		flow->tuple.iifindex == dev->ifindex) ||
+	       flow->dst->dev == dev;
+}
+
+static int nf_flow_netdev_event(struct notifier_block *this,
+				unsigned long event, void *ptr)
+{
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+
+	if (event == NETDEV_DOWN || event == NETDEV_UNREGISTER)
+		nf_flow_flush(nf_flow_dev_match, dev);
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block nf_flow_netdev_notifier = {
+	.notifier_call	= nf_flow_netdev_event,
+};
+
+static bool nf_flow_net_match(const struct nf_flow *flow, void *data)
+{
+	return net_eq(flow->net, data);
+}
+
+/* Flows hold conntrack references, drop them before conntrack waits for
+ * its entries to go away.
+ */
+static void __net_exit nf_flow_net_exit(struct net *net)
+{
+	nf_flow_flush(nf_flow_net_match, net);
+	rcu_barrier();
+}
+
+static struct pernet_operations nf_flow_net_ops = {
+	.exit		= nf_flow_net_exit,
+};
+
+static bool nf_flow_all_match(const struct nf_flow *flow, void *data)
+{
+	return true;
+}
+
+static int __init nf_flow_table_init(void)
+{
+	int ret;
+
+	nf_flow_hashsize = roundup_pow_of_two(max(nf_flow_hashsize, 16U));
+	nf_flow_hash = nf_ct_alloc_hashtable(&nf_flow_hashsize, 0);
+	if (nf_flow_hash == NULL)
+		return -ENOMEM;
+	get_random_bytes(&nf_flow_hash_rnd, sizeof(nf_flow_hash_rnd));
+
+	ret = register_pernet_subsys(&nf_flow_net_ops);
+	if (ret < 0)
+		goto err1;
+
+	ret = register_netdevice_notifier(&nf_flow_netdev_notifier);
+	if (ret < 0)
+		goto err2;
+
+	ret = xt_register_target(&nf_flow_offload_tg_reg);
+	if (ret < 0)
+		goto err3;
+
+	rtnl_lock();
+	ret = netdev_flow_offload_register(nf_flow_offload_rx);
+	rtnl_unlock();
+	if (ret < 0)
+		goto err4;
+
+	INIT_DEFERRABLE_WORK(&nf_flow_gc_work, nf_flow_gc_worker);
+	queue_delayed_work(system_long_wq, &nf_flow_gc_work, HZ);
+	return 0;
+
+err4:
+	xt_unregister_target(&nf_flow_offload_tg_reg);
+err3:
+	unregister_netdevice_notifier(&nf_flow_netdev_notifier);
+err2:
+	unregister_pernet_subsys(&nf_flow_net_ops);
+err1:
+	nf_ct_free_hashtable(nf_flow_hash, nf_flow_hashsize);
+	return ret;
+}
+
+static void __exit nf_flow_table_fini(void)
+{
+	rtnl_lock();
+	netdev_flow_offload_unregister();
+	rtnl_unlock();
+	xt_unregister_target(&nf_flow_offload_tg_reg);
+	cancel_delayed_work_sync(&nf_flow_gc_work);
+
+	nf_flow_flush(nf_flow_all_match, NULL);
+	rcu_barrier();
+
+	unregister_netdevice_notifier(&nf_flow_netdev_notifier);
+	unregister_pernet_subsys(&nf_flow_net_ops);
+	nf_ct_free_hashtable(nf_flow_hash, nf_flow_hashsize);
+}
+
+module_init(nf_flow_table_init);
+module_exit(nf_flow_table_fini);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("IPv4 flow offload table for forwarded connections");
+MODULE_ALIAS("ipt_FLOWOFFLOAD");
@@ -33,7 +33,9 @@
 #include <linux/mm.h>
 #include <linux/nsproxy.h>
 #include <linux/rculist_nulls.h>
+#include <linux/workqueue.h>
 
+#include <net/netns/generic.h>
 #include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_conntrack_l3proto.h>
 #include <net/netfilter/nf_conntrack_l4proto.h>
@@ -156,6 +158,24 @@ static u32 hash_bucket(u32 hash, const struct net *net)
 	return __hash_bucket(hash, net->ct.htable_size);
 }
 
+/* must be called with rcu read lock held */
+static void nf_conntrack_get_ht(struct net *net,
+				struct hlist_nulls_head **hash,
+				unsigned int *hsize)
+{
+	struct hlist_nulls_head *hptr;
+	unsigned int sequence, hsz;
+
+	do {
+		sequence = read_seqcount_begin(&net->ct.generation);
+		hsz = net->ct.htable_size;
+		hptr = net->ct.hash;
+	} while (read_seqcount_retry(&net->ct.generation, sequence));
+
+	*hash = hptr;
+	*hsize = hsz;
+}
+
 static u_int32_t __hash_conntrack(const struct nf_conntrack_tuple *tuple,
 				  unsigned int size)
 {
@@ -336,7 +356,6 @@ destroy_conntrack(struct nf_conntrack *nfct)
 
 	pr_debug("destroy_conntrack(%p)\n", ct);
 	NF_CT_ASSERT(atomic_read(&nfct->use) == 0);
-	NF_CT_ASSERT(!timer_pending(&ct->timeout));
 
 	if (unlikely(nf_ct_is_template(ct))) {
 		nf_ct_tmpl_free(ct);
@@ -410,8 +429,7 @@ static void death_by_event(unsigned long ul_conntrack)
 		add_timer(&ecache->timeout);
 		return;
 	}
-	/* we've got the event delivered, now it's dying */
-	set_bit(IPS_DYING_BIT, &ct->status);
+	/* we've got the event delivered, drop the hash table reference */
 	nf_ct_put(ct);
 }
 
@@ -429,32 +447,46 @@ static void nf_ct_dying_timeout(struct nf_conn *ct)
 	add_timer(&ecache->timeout);
 }
 
+/* Whoever sets IPS_DYING first owns the hash table reference and is the
+ * only one to unlink the conntrack; everybody else gets false.
+ */
 bool nf_ct_delete(struct nf_conn *ct, u32 portid, int report)
 {
 	struct nf_conn_tstamp *tstamp;
 
+	if (test_and_set_bit(IPS_DYING_BIT, &ct->status))
+		return false;
+
 	tstamp = nf_conn_tstamp_find(ct);
 	if (tstamp && tstamp->stop == 0)
 		tstamp->stop = ktime_get_real_ns();
 
-	if (!nf_ct_is_dying(ct) &&
-	    unlikely(nf_conntrack_event_report(IPCT_DESTROY, ct,
-	    portid, report) < 0)) {
+	if (unlikely(nf_conntrack_event_report(IPCT_DESTROY, ct,
+					       portid, report) < 0)) {
 		/* destroy event was not delivered */
 		nf_ct_delete_from_lists(ct);
 		nf_ct_dying_timeout(ct);
 		return false;
 	}
-	set_bit(IPS_DYING_BIT, &ct->status);
 	nf_ct_delete_from_lists(ct);
 	nf_ct_put(ct);
 	return true;
 }
 EXPORT_SYMBOL_GPL(nf_ct_delete);
 
-static void death_by_timeout(unsigned long ul_conntrack)
+/* Kill an entry found expired during a hash walk.  Called without any
+ * conntrack lock held, the entry may be recycled under us so take a
+ * reference and recheck first.
+ */
+static void nf_ct_gc_expired(struct nf_conn *ct)
 {
-	nf_ct_delete((struct nf_conn *)ul_conntrack, 0, 0);
+	if (!atomic_inc_not_zero(&ct->ct_general.use))
+		return;
+
+	if (nf_ct_should_gc(ct))
+		nf_ct_kill(ct);
+
+	nf_ct_put(ct);
 }
 
 static inline bool
@@ -491,6 +523,13 @@ ____nf_conntrack_find(struct net *net, const struct nf_conntrack_zone *zone,
 	local_bh_disable();
 begin:
 	hlist_nulls_for_each_entry_rcu(h, n, &net->ct.hash[bucket], hnnode) {
+		struct nf_conn *ct = nf_ct_tuplehash_to_ctrack(h);
+
+		if (nf_ct_is_expired(ct)) {
+			nf_ct_gc_expired(ct);
+			continue;
+		}
+
 		if (nf_ct_key_equal(h, tuple, zone)) {
 			NF_CT_STAT_INC(net, found);
 			local_bh_enable();
@@ -596,7 +635,6 @@ nf_conntrack_hash_check_insert(struct nf_conn *ct)
 				     NF_CT_DIRECTION(h)))
 			goto out;
 
-	add_timer(&ct->timeout);
 	smp_wmb();
 	/* The caller holds a reference to this object */
 	atomic_set(&ct->ct_general.use, 2);
@@ -692,11 +730,10 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 
 	nf_ct_del_from_dying_or_unconfirmed_list(ct);
 
-	/* Timer relative to confirmation time, not original
+	/* Timeout is relative to confirmation time, not original
 	   setting time, otherwise we'd get timer wrap in
 	   weird delay cases. */
-	ct->timeout.expires += jiffies;
-	add_timer(&ct->timeout);
+	ct->timeout += nfct_time_stamp;
 	atomic_inc(&ct->ct_general.use);
 	ct->status |= IPS_CONFIRMED;
 
@@ -709,7 +746,7 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 		tstamp->start = ktime_to_ns(skb->tstamp);
 	}
 	/* Since the lookup is lockless, hash insertion must be done after
-	 * starting the timer and setting the CONFIRMED bit. The RCU barriers
+	 * setting the timeout and the CONFIRMED bit. The RCU barriers
 	 * guarantee that no other CPU can find the conntrack before the above
 	 * stores are visible.
 	 */
@@ -756,6 +793,12 @@ nf_conntrack_tuple_taken(const struct nf_conntrack_tuple *tuple,
 	rcu_read_lock_bh();
 	hlist_nulls_for_each_entry_rcu(h, n, &net->ct.hash[hash], hnnode) {
 		ct = nf_ct_tuplehash_to_ctrack(h);
+
+		if (nf_ct_is_expired(ct)) {
+			nf_ct_gc_expired(ct);
+			continue;
+		}
+
 		if (ct != ignored_conntrack &&
 		    nf_ct_tuple_equal(tuple, &h->tuple) &&
 		    nf_ct_zone_equal(ct, zone, NF_CT_DIRECTION(h))) {
@@ -773,59 +816,59 @@ EXPORT_SYMBOL_GPL(nf_conntrack_tuple_taken);
 
 #define NF_CT_EVICTION_RANGE	8
 
-/* There's a small race here where we may free a just-assured
-   connection.  Too bad: we're in trouble anyway. */
+/* Look at no more than NF_CT_EVICTION_RANGE buckets, reaping expired
+ * entries on the way, and kill the first unassured conntrack found.
+ * There's a small race here where we may free a just-assured
+ * connection.  Too bad: we're in trouble anyway.
+ */
 static noinline int early_drop(struct net *net, unsigned int _hash)
 {
-	/* Use oldest entry, which is roughly LRU */
 	struct nf_conntrack_tuple_hash *h;
-	struct nf_conn *ct = NULL, *tmp;
+	struct hlist_nulls_head *ct_hash;
 	struct hlist_nulls_node *n;
-	unsigned int i = 0, cnt = 0;
+	struct nf_conn *ct = NULL, *tmp;
+	unsigned int i, hash, hsize;
 	int dropped = 0;
-	unsigned int hash, sequence;
-	spinlock_t *lockp;
 
-	local_bh_disable();
-restart:
-	sequence = read_seqcount_begin(&net->ct.generation);
-	hash = hash_bucket(_hash, net);
-	for (; i < net->ct.htable_size; i++) {
-		lockp = &nf_conntrack_locks[hash % CONNTRACK_LOCKS];
-		spin_lock(lockp);
-		if (read_seqcount_retry(&net->ct.generation, sequence)) {
-			spin_unlock(lockp);
-			goto restart;
-		}
-		hlist_nulls_for_each_entry_rcu(h, n, &net->ct.hash[hash],
-					 hnnode) {
+	rcu_read_lock();
+	nf_conntrack_get_ht(net, &ct_hash, &hsize);
+	hash = __hash_bucket(_hash, hsize);
+	for (i = 0; i < NF_CT_EVICTION_RANGE && !ct; i++) {
+		hlist_nulls_for_each_entry_rcu(h, n, &ct_hash[hash], hnnode) {
 			tmp = nf_ct_tuplehash_to_ctrack(h);
-			if (!test_bit(IPS_ASSURED_BIT, &tmp->status) &&
-			    !nf_ct_is_dying(tmp) &&
-			    atomic_inc_not_zero(&tmp->ct_general.use)) {
+
+			if (nf_ct_is_expired(tmp)) {
+				nf_ct_gc_expired(tmp);
+				continue;
+			}
+
+			if (test_bit(IPS_ASSURED_BIT, &tmp->status) ||
+			    nf_ct_is_dying(tmp) ||
+			    !atomic_inc_not_zero(&tmp->ct_general.use))
+				continue;
+
+			/* SLAB_DESTROY_BY_RCU: may have been freed and reused
+			 * meanwhile, for an unconfirmed conntrack, one in
+			 * another netns or one that is assured by now.
+			 */
+			if (nf_ct_is_confirmed(tmp) &&
+			    net_eq(nf_ct_net(tmp), net) &&
+			    !test_bit(IPS_ASSURED_BIT, &tmp->status)) {
 				ct = tmp;
 				break;
 			}
-			cnt++;
+			nf_ct_put(tmp);
 		}
-
-		hash = (hash + 1) % net->ct.htable_size;
-		spin_unlock(lockp);
-
-		if (ct || cnt >= NF_CT_EVICTION_RANGE)
-			break;
-
+		hash = (hash + 1) % hsize;
 	}
-	local_bh_enable();
+	rcu_read_unlock();
 
 	if (!ct)
 		return dropped;
 
-	if (del_timer(&ct->timeout)) {
-		if (nf_ct_delete(ct, 0, 0)) {
-			dropped = 1;
-			NF_CT_STAT_INC_ATOMIC(net, early_drop);
-		}
+	if (nf_ct_delete(ct, 0, 0)) {
+		dropped = 1;
+		NF_CT_STAT_INC_ATOMIC(net, early_drop);
 	}
 	nf_ct_put(ct);
 	return dropped;
@@ -894,8 +937,6 @@ __nf_conntrack_alloc(struct net *net,
 	ct->tuplehash[IP_CT_DIR_REPLY].tuple = *repl;
 	/* save hash for reusing when confirming */
 	*(unsigned long *)(&ct->tuplehash[IP_CT_DIR_REPLY].hnnode.pprev) = hash;
-	/* Don't set timer yet: wait for confirmation */
-	setup_timer(&ct->timeout, death_by_timeout, (unsigned long)ct);
 	write_pnet(&ct->ct_net, net);
 
 	if (zone && nf_ct_zone_add(ct, GFP_ATOMIC, zone) < 0)
@@ -1270,24 +1311,23 @@ void __nf_ct_refresh_acct(struct nf_conn *ct,
 			  unsigned long extra_jiffies,
 			  int do_acct)
 {
-	NF_CT_ASSERT(ct->timeout.data == (unsigned long)ct);
 	NF_CT_ASSERT(skb);
 
 	/* Only update if this is not a fixed timeout */
 	if (test_bit(IPS_FIXED_TIMEOUT_BIT, &ct->status))
 		goto acct;
 
-	/* If not in hash table, timer will not be active yet */
+	/* If not in hash table, timeout is relative, see confirm */
 	if (!nf_ct_is_confirmed(ct)) {
-		ct->timeout.expires = extra_jiffies;
+		ct->timeout = extra_jiffies;
 	} else {
-		unsigned long newtime = jiffies + extra_jiffies;
+		u32 newtime = nfct_time_stamp + extra_jiffies;
 
 		/* Only update the timeout if the new timeout is at least
-		   HZ jiffies from the old timeout. Need del_timer for race
-		   avoidance (may already be dying). */
-		if (newtime - ct->timeout.expires >= HZ)
-			mod_timer_pending(&ct->timeout, newtime);
+		   HZ jiffies from the old timeout, no need to dirty the
+		   cacheline on every packet. */
+		if (newtime - ct->timeout >= HZ)
+			ct->timeout = newtime;
 	}
 
 acct:
@@ -1319,11 +1359,11 @@ bool __nf_ct_kill_acct(struct nf_conn *ct,
 		}
 	}
 
-	if (del_timer(&ct->timeout)) {
-		ct->timeout.function((unsigned long)ct);
-		return true;
-	}
-	return false;
+	/* not in the hash table yet, nothing to kill */
+	if (!nf_ct_is_confirmed(ct))
+		return false;
+
+	return nf_ct_delete(ct, 0, 0);
 }
 EXPORT_SYMBOL_GPL(__nf_ct_kill_acct);
 
@@ -1458,11 +1498,7 @@ void nf_ct_iterate_cleanup(struct net *net,
 
 	while ((ct = get_next_corpse(net, iter, data, &bucket)) != NULL) {
 		/* Time to push up daises... */
-		if (del_timer(&ct->timeout))
-			nf_ct_delete(ct, portid, report);
-
-		/* ... else the timer will get him soon. */
-
+		nf_ct_delete(ct, portid, report);
 		nf_ct_put(ct);
 	}
 }
@@ -1568,6 +1604,13 @@ void nf_conntrack_cleanup_net_list(struct list_head *net_exit_list)
 	 *  netfilter framework.  Roll on, two-stage module
 	 *  delete...
 	 */
+	list_for_each_entry(net, net_exit_list, exit_list) {
+		struct nf_conntrack_net *cnet;
+
+		cnet = net_generic(net, nf_conntrack_net_id);
+		cancel_delayed_work_sync(&cnet->gc_work);
+	}
+
 	synchronize_net();
 i_see_dead_people:
 	busy = 0;
@@ -1621,26 +1664,13 @@ void *nf_ct_alloc_hashtable(unsigned int *sizep, int nulls)
 }
 EXPORT_SYMBOL_GPL(nf_ct_alloc_hashtable);
 
-int nf_conntrack_set_hashsize(const char *val, struct kernel_param *kp)
+/* Rehash all conntracks of @net into a table of @hashsize buckets. */
+static int nf_conntrack_hash_resize(struct net *net, unsigned int hashsize)
 {
-	int i, bucket, rc;
-	unsigned int hashsize, old_size;
+	int i, bucket;
+	unsigned int old_size;
 	struct hlist_nulls_head *hash, *old_hash;
 	struct nf_conntrack_tuple_hash *h;
-	struct nf_conn *ct;
-
-	if (current->nsproxy->net_ns != &init_net)
-		return -EOPNOTSUPP;
-
-	/* On boot, we can set this without any fancy locking. */
-	if (!nf_conntrack_htable_size)
-		return param_set_uint(val, kp);
-
-	rc = kstrtouint(val, 0, &hashsize);
-	if (rc)
-		return rc;
-	if (!hashsize)
-		return -EINVAL;
 
 	hash = nf_ct_alloc_hashtable(&hashsize, 1);
 	if (!hash)
@@ -1648,7 +1678,7 @@ int nf_conntrack_set_hashsize(const char *val, struct kernel_param *kp)
 
 	local_bh_disable();
 	nf_conntrack_all_lock();
-	write_seqcount_begin(&init_net.ct.generation);
+	write_seqcount_begin(&net->ct.generation);
 
 	/* Lookups in the old hash might happen in parallel, which means we
 	 * might get false negatives during connection lookup. New connections
@@ -1656,34 +1686,143 @@ int nf_conntrack_set_hashsize(const char *val, struct kernel_param *kp)
 	 * though since that required taking the locks.
 	 */
 
-	for (i = 0; i < init_net.ct.htable_size; i++) {
-		while (!hlist_nulls_empty(&init_net.ct.hash[i])) {
-			h = hlist_nulls_entry(init_net.ct.hash[i].first,
+	for (i = 0; i < net->ct.htable_size; i++) {
+		while (!hlist_nulls_empty(&net->ct.hash[i])) {
+			h = hlist_nulls_entry(net->ct.hash[i].first,
 					struct nf_conntrack_tuple_hash, hnnode);
-			ct = nf_ct_tuplehash_to_ctrack(h);
 			hlist_nulls_del_rcu(&h->hnnode);
 			bucket = __hash_conntrack(&h->tuple, hashsize);
 			hlist_nulls_add_head_rcu(&h->hnnode, &hash[bucket]);
 		}
 	}
-	old_size = init_net.ct.htable_size;
-	old_hash = init_net.ct.hash;
+	old_size = net->ct.htable_size;
+	old_hash = net->ct.hash;
 
-	init_net.ct.htable_size = nf_conntrack_htable_size = hashsize;
-	init_net.ct.hash = hash;
+	net->ct.htable_size = hashsize;
+	net->ct.hash = hash;
 
-	write_seqcount_end(&init_net.ct.generation);
+	write_seqcount_end(&net->ct.generation);
 	nf_conntrack_all_unlock();
 	local_bh_enable();
 
+	/* gc and early_drop walk the table without the locks */
+	synchronize_net();
 	nf_ct_free_hashtable(old_hash, old_size);
 	return 0;
 }
+
+int nf_conntrack_set_hashsize(const char *val, struct kernel_param *kp)
+{
+	unsigned int hashsize;
+	int rc;
+
+	if (current->nsproxy->net_ns != &init_net)
+		return -EOPNOTSUPP;
+
+	/* On boot, we can set this without any fancy locking. */
+	if (!nf_conntrack_htable_size)
+		return param_set_uint(val, kp);
+
+	rc = kstrtouint(val, 0, &hashsize);
+	if (rc)
+		return rc;
+	if (!hashsize)
+		return -EINVAL;
+
+	rc = nf_conntrack_hash_resize(&init_net, hashsize);
+	if (rc)
+		return rc;
+
+	nf_conntrack_htable_size = init_net.ct.htable_size;
+	return 0;
+}
 EXPORT_SYMBOL_GPL(nf_conntrack_set_hashsize);
 
 module_param_call(hashsize, nf_conntrack_set_hashsize, param_get_uint,
 		  &nf_conntrack_htable_size, 0600);
 
+/* The gc worker visits at most 1/GC_MAX_BUCKETS_DIV of the table, capped
+ * at GC_MAX_BUCKETS, every GC_INTERVAL and stops early after
+ * GC_MAX_EVICTS evictions.  When almost everything it sees is expired it
+ * reschedules itself right away.
+ */
+#define GC_MAX_BUCKETS_DIV	64u
+#define GC_MAX_BUCKETS		8192u
+#define GC_INTERVAL		(5 * HZ)
+#define GC_MAX_EVICTS		256u
+
+/* Upper bound for automatic growth of the conntrack table. */
+#define NF_CT_HTABLE_GROW_MAX	(1u << 22)
+
+int nf_conntrack_net_id __read_mostly;
+
+/* Double the table once there are more conntracks than buckets, each
+ * conntrack sits in two chains.  Never grow beyond nf_conntrack_max.
+ */
+static void nf_conntrack_hash_grow(struct net *net)
+{
+	unsigned int hsize = net->ct.htable_size;
+	unsigned int max = NF_CT_HTABLE_GROW_MAX;
+
+	if (nf_conntrack_max)
+		max = min(max, nf_conntrack_max);
+
+	if (atomic_read(&net->ct.count) <= hsize || hsize >= max)
+		return;
+
+	nf_conntrack_hash_resize(net, min(hsize * 2, max));
+}
+
+static void gc_worker(struct work_struct *work)
+{
+	struct nf_conntrack_net *cnet = container_of(to_delayed_work(work),
+						     struct nf_conntrack_net,
+						     gc_work);
+	unsigned int i, goal, buckets = 0, expired_count = 0, scanned = 0;
+	unsigned long next_run = GC_INTERVAL;
+	struct net *net = cnet->net;
+
+	goal = min(net->ct.htable_size / GC_MAX_BUCKETS_DIV, GC_MAX_BUCKETS);
+	i = cnet->gc_next_bucket;
+
+	do {
+		struct nf_conntrack_tuple_hash *h;
+		struct hlist_nulls_head *ct_hash;
+		struct hlist_nulls_node *n;
+		unsigned int hsize;
+		struct nf_conn *tmp;
+
+		rcu_read_lock();
+		nf_conntrack_get_ht(net, &ct_hash, &hsize);
+		if (i >= hsize)
+			i = 0;
+
+		hlist_nulls_for_each_entry_rcu(h, n, &ct_hash[i], hnnode) {
+			tmp = nf_ct_tuplehash_to_ctrack(h);
+
+			scanned++;
+			if (nf_ct_is_expired(tmp)) {
+				nf_ct_gc_expired(tmp);
+				expired_count++;
+			}
+		}
+		rcu_read_unlock();
+
+		cond_resched();
+		i++;
+	} while (++buckets < goal && expired_count < GC_MAX_EVICTS);
+
+	cnet->gc_next_bucket = i;
+
+	if (expired_count == GC_MAX_EVICTS ||
+	    (scanned && expired_count * 100 / scanned >= 90))
+		next_run = 0;
+
+	nf_conntrack_hash_grow(net);
+
+	queue_delayed_work(system_long_wq, &cnet->gc_work, next_run);
+}
+
 void nf_ct_untracked_status_or(unsigned long bits)
 {
 	int cpu;
@@ -1820,6 +1959,7 @@ void nf_conntrack_init_end(void)
 
 int nf_conntrack_init_net(struct net *net)
 {
+	struct nf_conntrack_net *cnet = net_generic(net, nf_conntrack_net_id);
 	int ret = -ENOMEM;
 	int cpu;
 
@@ -1878,6 +2018,11 @@ int nf_conntrack_init_net(struct net *net)
 	ret = nf_conntrack_proto_pernet_init(net);
 	if (ret < 0)
 		goto err_proto;
+
+	cnet->net = net;
+	cnet->gc_next_bucket = 0;
+	INIT_DEFERRABLE_WORK(&cnet->gc_work, gc_worker);
+	queue_delayed_work(system_long_wq, &cnet->gc_work, GC_INTERVAL);
 	return 0;
 
 err_proto:
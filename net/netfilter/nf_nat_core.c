@@ -546,17 +546,21 @@ static int nf_nat_proto_clean(struct nf_conn *ct, void *data)
 	 * Else, when the conntrack is destoyed, nf_nat_cleanup_conntrack()
 	 * will delete entry from already-freed table.
 	 */
-	if (!del_timer(&ct->timeout))
+	if (nf_ct_is_dying(ct))
 		return 1;
 
+	/* ct may start dying under us, status bits are updated atomically
+	 * and nf_nat_cleanup_conntrack() rechecks nat->ct under the lock.
+	 */
 	spin_lock_bh(&nf_nat_lock);
-	hlist_del_rcu(&nat->bysource);
-	ct->status &= ~IPS_NAT_DONE_MASK;
-	nat->ct = NULL;
+	if (nat->ct) {
+		hlist_del_rcu(&nat->bysource);
+		clear_bit(IPS_SRC_NAT_DONE_BIT, &ct->status);
+		clear_bit(IPS_DST_NAT_DONE_BIT, &ct->status);
+		nat->ct = NULL;
+	}
 	spin_unlock_bh(&nf_nat_lock);
 
-	add_timer(&ct->timeout);
-
 	/* don't delete conntrack.  Although that would make things a lot
 	 * simpler, we'd end up flushing all conntracks on nat rmmod.
 	 */
@@ -700,7 +704,8 @@ static void nf_nat_cleanup_conntrack(struct nf_conn *ct)
 	NF_CT_ASSERT(nat->ct->status & IPS_SRC_NAT_DONE);
 
 	spin_lock_bh(&nf_nat_lock);
-	hlist_del_rcu(&nat->bysource);
+	if (nat->ct)
+		hlist_del_rcu(&nat->bysource);
 	spin_unlock_bh(&nf_nat_lock);
 }
 
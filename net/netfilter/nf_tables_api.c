@@ -2973,6 +2973,7 @@ static const struct nla_policy nft_set_elem_policy[NFTA_SET_ELEM_MAX + 1] = {
 	[NFTA_SET_ELEM_TIMEOUT]		= { .type = NLA_U64 },
 	[NFTA_SET_ELEM_USERDATA]	= { .type = NLA_BINARY,
 					    .len = NFT_USERDATA_MAXLEN },
+	[NFTA_SET_ELEM_EXPR]		= { .type = NLA_NESTED },
 };
 
 static const struct nla_policy nft_set_elem_list_policy[NFTA_SET_ELEM_LIST_MAX + 1] = {
@@ -3340,6 +3341,7 @@ static int nft_add_set_elem(struct nft_ctx *ctx, struct nft_set *set,
 	struct nft_set_elem elem;
 	struct nft_set_binding *binding;
 	struct nft_userdata *udata;
+	struct nft_expr *expr = NULL;
 	struct nft_data data;
 	enum nft_registers dreg;
 	struct nft_trans *trans;
@@ -3437,6 +3439,29 @@ static int nft_add_set_elem(struct nft_ctx *ctx, struct nft_set *set,
 		nft_set_ext_add_length(&tmpl, NFT_SET_EXT_DATA, d2.len);
 	}
 
+	/* A stateful expression, such as a counter, is updated each time
+	 * a lookup matches the element.
+	 */
+	if (nla[NFTA_SET_ELEM_EXPR] != NULL) {
+		err = -EINVAL;
+		if (flags & NFT_SET_ELEM_INTERVAL_END)
+			goto err3;
+
+		expr = nft_expr_init(ctx, nla[NFTA_SET_ELEM_EXPR]);
+		if (IS_ERR(expr)) {
+			err = PTR_ERR(expr);
+			expr = NULL;
+			goto err3;
+		}
+
+		err = -EOPNOTSUPP;
+		if (!(expr->ops->type->flags & NFT_EXPR_STATEFUL))
+			goto err3;
+
+		nft_set_ext_add_length(&tmpl, NFT_SET_EXT_EXPR,
+				       expr->ops->size);
+	}
+
 	/* The full maximum length of userdata can exceed the maximum
 	 * offset value (U8_MAX) for following extensions, therefor it
 	 * must be the last extension added.
@@ -3458,6 +3483,8 @@ static int nft_add_set_elem(struct nft_ctx *ctx, struct nft_set *set,
 	ext = nft_set_elem_ext(set, elem.priv);
 	if (flags)
 		*nft_set_ext_flags(ext) = flags;
+	if (expr != NULL)
+		memcpy(nft_set_ext_expr(ext), expr, expr->ops->size);
 	if (ulen > 0) {
 		udata = nft_set_ext_userdata(ext);
 		udata->len = ulen - 1;
@@ -3475,6 +3502,8 @@ static int nft_add_set_elem(struct nft_ctx *ctx, struct nft_set *set,
 
 	nft_trans_elem(trans) = elem;
 	list_add_tail(&trans->list, &ctx->net->nft.commit_list);
+	/* The element now owns the expression state */
+	kfree(expr);
 	return 0;
 
 err5:
@@ -3482,6 +3511,8 @@ err5:
 err4:
 	kfree(elem.priv);
 err3:
+	if (expr != NULL)
+		nft_expr_destroy(ctx, expr);
 	if (nla[NFTA_SET_ELEM_DATA] != NULL)
 		nft_data_uninit(&data, d2.type);
 err2:
@@ -3857,6 +3888,21 @@ static int nf_tables_commit(struct sk_buff *skb)
 	/* Bump generation counter, invalidate any dump in progress */
 	while (++net->nft.base_seq == 0);
 
+	/* Set backends that keep a separate lookup structure build it for
+	 * the next generation now, while packets still see the current one.
+	 */
+	list_for_each_entry(trans, &net->nft.commit_list, list) {
+		switch (trans->msg_type) {
+		case NFT_MSG_NEWSETELEM:
+		case NFT_MSG_DELSETELEM:
+			te = (struct nft_trans_elem *)trans->data;
+
+			if (te->set->ops->commit)
+				te->set->ops->commit(te->set);
+			break;
+		}
+	}
+
 	/* A new generation has just started */
 	net->nft.gencursor = nft_gencursor_next(net);
 
@@ -0,0 +1,459 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Interval and prefix set type with lockless lookups.
+ *
+ * Elements are kept in a per-set rbtree that only the control plane
+ * touches. Before each generation starts, the elements active in it are
+ * flattened into a sorted array of interval boundaries which is published
+ * through RCU, one array per generation. Packet lookups binary search the
+ * array of the current generation without taking any lock: the matching
+ * boundary is the greatest one not above the key, and the key is part of
+ * the set unless that boundary ends an interval. Prefixes are handed to
+ * the kernel as intervals, so longest prefix matching needs nothing else.
+ */
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <net/netfilter/nf_tables.h>
+
+struct nft_interval_map {
+	unsigned int			num;
+	const struct nft_set_ext	**ext;
+	u8				keys[];
+};
+
+struct nft_interval {
+	spinlock_t			lock;
+	struct rb_root			root;
+	bool				dirty;
+	struct nft_interval_map __rcu	*map[2];
+};
+
+struct nft_interval_elem {
+	struct rb_node		node;
+	struct nft_set_ext	ext;
+};
+
+static bool nft_interval_end(const struct nft_set_ext *ext)
+{
+	return nft_set_ext_exists(ext, NFT_SET_EXT_FLAGS) &&
+	       *nft_set_ext_flags(ext) & NFT_SET_ELEM_INTERVAL_END;
+}
+
+static const u8 *nft_interval_key(const struct nft_set *set,
+				  const struct nft_interval_map *m,
+				  unsigned int i)
+{
+	return m->keys + i * set->klen;
+}
+
+/* Index of the last boundary that is not greater than the key, -1 if the
+ * key is below all of them.
+ */
+static int nft_interval_bsearch(const struct nft_set *set,
+				const struct nft_interval_map *m,
+				const u32 *key)
+{
+	unsigned int lo = 0, hi = m->num, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(nft_interval_key(set, m, mid), key, set->klen) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (int)lo - 1;
+}
+
+/* Only used while no array could be allocated for the current generation */
+static bool nft_interval_lookup_slow(const struct nft_set *set,
+				     const u32 *key,
+				     const struct nft_set_ext **ext)
+{
+	struct nft_interval *priv = nft_set_priv(set);
+	const struct nft_interval_elem *e, *best = NULL;
+	const struct rb_node *node;
+	u8 genmask = nft_genmask_cur(read_pnet(&set->pnet));
+	bool found = false;
+
+	spin_lock_bh(&priv->lock);
+	node = priv->root.rb_node;
+	while (node != NULL) {
+		e = rb_entry(node, struct nft_interval_elem, node);
+		if (memcmp(nft_set_ext_key(&e->ext), key, set->klen) <= 0) {
+			best = e;
+			node = node->rb_right;
+		} else {
+			node = node->rb_left;
+		}
+	}
+
+	for (node = best ? &best->node : NULL; node; node = rb_prev(node)) {
+		e = rb_entry(node, struct nft_interval_elem, node);
+		if (!nft_set_elem_active(&e->ext, genmask))
+			continue;
+		if (!(set->flags & NFT_SET_INTERVAL) &&
+		    memcmp(nft_set_ext_key(&e->ext), key, set->klen))
+			break;
+		if (nft_interval_end(&e->ext))
+			break;
+		*ext = &e->ext;
+		found = true;
+		break;
+	}
+	spin_unlock_bh(&priv->lock);
+
+	return found;
+}
+
+static bool nft_interval_lookup(const struct nft_set *set, const u32 *key,
+				const struct nft_set_ext **ext)
+{
+	const struct nft_interval *priv = nft_set_priv(set);
+	const struct net *net = read_pnet(&set->pnet);
+	const struct nft_interval_map *m;
+	const struct nft_set_ext *e;
+	int i;
+
+	m = rcu_dereference(priv->map[ACCESS_ONCE(net->nft.gencursor)]);
+	if (unlikely(m == NULL))
+		return nft_interval_lookup_slow(set, key, ext);
+
+	i = nft_interval_bsearch(set, m, key);
+	if (i < 0)
+		return false;
+	if (!(set->flags & NFT_SET_INTERVAL) &&
+	    memcmp(nft_interval_key(set, m, i), key, set->klen))
+		return false;
+
+	e = m->ext[i];
+	if (nft_interval_end(e))
+		return false;
+
+	*ext = e;
+	return true;
+}
+
+static struct nft_interval_map *nft_interval_map_alloc(const struct nft_set *set,
+						       unsigned int num)
+{
+	struct nft_interval_map *m;
+	size_t koff, size;
+
+	koff = ALIGN(sizeof(*m) + num * set->klen, sizeof(void *));
+	size = koff + num * sizeof(m->ext[0]);
+
+	m = kmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+	if (m == NULL)
+		m = vmalloc(size);
+	if (m == NULL)
+		return NULL;
+
+	m->num = num;
+	m->ext = (void *)m + koff;
+	return m;
+}
+
+static void nft_interval_map_free(struct nft_interval_map *m)
+{
+	kvfree(m);
+}
+
+static struct nft_interval_map *nft_interval_map_build(const struct nft_set *set,
+						       u8 genmask)
+{
+	struct nft_interval *priv = nft_set_priv(set);
+	struct nft_interval_elem *e;
+	struct nft_interval_map *m;
+	struct rb_node *node;
+	unsigned int num = 0;
+
+	for (node = rb_first(&priv->root); node; node = rb_next(node)) {
+		e = rb_entry(node, struct nft_interval_elem, node);
+		if (nft_set_elem_active(&e->ext, genmask))
+			num++;
+	}
+
+	m = nft_interval_map_alloc(set, num);
+	if (m == NULL)
+		return NULL;
+
+	num = 0;
+	for (node = rb_first(&priv->root); node; node = rb_next(node)) {
+		e = rb_entry(node, struct nft_interval_elem, node);
+		if (!nft_set_elem_active(&e->ext, genmask))
+			continue;
+
+		memcpy(m->keys + num * set->klen, nft_set_ext_key(&e->ext),
+		       set->klen);
+		m->ext[num++] = &e->ext;
+	}
+	return m;
+}
+
+/* Called under the nfnl mutex before the generation cursor moves, so the
+ * tree cannot change underneath the walk. No packet reads the array of
+ * the next generation yet, so the previous one can be freed right away
+ * unless it is still shared with the current generation.
+ */
+static void nft_interval_commit(const struct nft_set *set)
+{
+	struct nft_interval *priv = nft_set_priv(set);
+	const struct net *net = read_pnet(&set->pnet);
+	unsigned int cur = net->nft.gencursor;
+	unsigned int next = nft_gencursor_next(net);
+	struct nft_interval_map *m, *old;
+
+	if (!priv->dirty)
+		return;
+
+	m = nft_interval_map_build(set, nft_genmask_next(net));
+
+	old = rcu_dereference_protected(priv->map[next], 1);
+	rcu_assign_pointer(priv->map[next], m);
+	if (old != rcu_dereference_protected(priv->map[cur], 1))
+		nft_interval_map_free(old);
+
+	/* On allocation failure lookups fall back to the tree and the
+	 * next commit retries.
+	 */
+	priv->dirty = m == NULL;
+}
+
+/* Once the new generation has started and the previous one has been
+ * drained, both generations see the same elements again: let them share
+ * the array until the next commit.
+ */
+static void nft_interval_sync(const struct nft_set *set)
+{
+	struct nft_interval *priv = nft_set_priv(set);
+	const struct net *net = read_pnet(&set->pnet);
+	unsigned int cur = net->nft.gencursor;
+	struct nft_interval_map *m, *old;
+
+	m = rcu_dereference_protected(priv->map[cur], 1);
+	old = rcu_dereference_protected(priv->map[!cur], 1);
+	if (old == m)
+		return;
+
+	rcu_assign_pointer(priv->map[!cur], m);
+	nft_interval_map_free(old);
+}
+
+static int nft_interval_insert(const struct nft_set *set,
+			       const struct nft_set_elem *elem)
+{
+	struct nft_interval *priv = nft_set_priv(set);
+	struct nft_interval_elem *new = elem->priv, *e;
+	u8 genmask = nft_genmask_next(read_pnet(&set->pnet));
+	struct rb_node *parent = NULL, **p;
+	int d;
+
+	spin_lock_bh(&priv->lock);
+	p = &priv->root.rb_node;
+	while (*p != NULL) {
+		parent = *p;
+		e = rb_entry(parent, struct nft_interval_elem, node);
+		d = memcmp(nft_set_ext_key(&e->ext),
+			   nft_set_ext_key(&new->ext), set->klen);
+		if (d > 0) {
+			p = &parent->rb_left;
+		} else if (d < 0) {
+			p = &parent->rb_right;
+		} else {
+			if (nft_set_elem_active(&e->ext, genmask)) {
+				spin_unlock_bh(&priv->lock);
+				return -EEXIST;
+			}
+			p = &parent->rb_right;
+		}
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &priv->root);
+	priv->dirty = true;
+	spin_unlock_bh(&priv->lock);
+
+	return 0;
+}
+
+static void nft_interval_remove(const struct nft_set *set,
+				const struct nft_set_elem *elem)
+{
+	struct nft_interval *priv = nft_set_priv(set);
+	struct nft_interval_elem *e = elem->priv;
+
+	nft_interval_sync(set);
+
+	spin_lock_bh(&priv->lock);
+	rb_erase(&e->node, &priv->root);
+	spin_unlock_bh(&priv->lock);
+}
+
+static void nft_interval_activate(const struct nft_set *set,
+				  const struct nft_set_elem *elem)
+{
+	struct nft_interval_elem *e = elem->priv;
+
+	nft_interval_sync(set);
+	nft_set_elem_change_active(set, &e->ext);
+}
+
+static void *nft_interval_deactivate(const struct nft_set *set,
+				     const struct nft_set_elem *elem)
+{
+	struct nft_interval *priv = nft_set_priv(set);
+	const struct rb_node *node = priv->root.rb_node;
+	u8 genmask = nft_genmask_next(read_pnet(&set->pnet));
+	struct nft_interval_elem *e;
+	int d;
+
+	while (node != NULL) {
+		e = rb_entry(node, struct nft_interval_elem, node);
+
+		d = memcmp(nft_set_ext_key(&e->ext), &elem->key.val,
+			   set->klen);
+		if (d > 0) {
+			node = node->rb_left;
+		} else if (d < 0) {
+			node = node->rb_right;
+		} else {
+			if (!nft_set_elem_active(&e->ext, genmask)) {
+				node = node->rb_right;
+				continue;
+			}
+			nft_set_elem_change_active(set, &e->ext);
+			priv->dirty = true;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void nft_interval_walk(const struct nft_ctx *ctx,
+			      const struct nft_set *set,
+			      struct nft_set_iter *iter)
+{
+	struct nft_interval *priv = nft_set_priv(set);
+	struct nft_interval_elem *e;
+	struct nft_set_elem elem;
+	struct rb_node *node;
+	u8 genmask = nft_genmask_cur(read_pnet(&set->pnet));
+
+	spin_lock_bh(&priv->lock);
+	for (node = rb_first(&priv->root); node != NULL; node = rb_next(node)) {
+		e = rb_entry(node, struct nft_interval_elem, node);
+
+		if (iter->count < iter->skip)
+			goto cont;
+		if (!nft_set_elem_active(&e->ext, genmask))
+			goto cont;
+
+		elem.priv = e;
+
+		iter->err = iter->fn(ctx, set, iter, &elem);
+		if (iter->err < 0)
+			break;
+cont:
+		iter->count++;
+	}
+	spin_unlock_bh(&priv->lock);
+}
+
+static unsigned int nft_interval_privsize(const struct nlattr * const nla[])
+{
+	return sizeof(struct nft_interval);
+}
+
+static int nft_interval_init(const struct nft_set *set,
+			     const struct nft_set_desc *desc,
+			     const struct nlattr * const nla[])
+{
+	struct nft_interval *priv = nft_set_priv(set);
+
+	spin_lock_init(&priv->lock);
+	priv->root = RB_ROOT;
+	return 0;
+}
+
+static void nft_interval_destroy(const struct nft_set *set)
+{
+	struct nft_interval *priv = nft_set_priv(set);
+	struct nft_interval_map *m0, *m1;
+	struct nft_interval_elem *e;
+	struct rb_node *node;
+
+	m0 = rcu_dereference_protected(priv->map[0], 1);
+	m1 = rcu_dereference_protected(priv->map[1], 1);
+	nft_interval_map_free(m0);
+	if (m1 != m0)
+		nft_interval_map_free(m1);
+
+	while ((node = priv->root.rb_node) != NULL) {
+		rb_erase(node, &priv->root);
+		e = rb_entry(node, struct nft_interval_elem, node);
+		nft_set_elem_destroy(set, e);
+	}
+}
+
+static bool nft_interval_estimate(const struct nft_set_desc *desc,
+				  u32 features,
+				  struct nft_set_estimate *est)
+{
+	unsigned int nsize;
+
+	nsize = sizeof(struct nft_interval_elem) + desc->klen +
+		sizeof(struct nft_set_ext *);
+	if (desc->size)
+		est->size = sizeof(struct nft_interval) + desc->size * nsize;
+	else
+		est->size = nsize;
+
+	est->class = NFT_SET_CLASS_O_LOG_N_NOLOCK;
+
+	return true;
+}
+
+static struct nft_set_ops nft_interval_ops __read_mostly = {
+	.privsize	= nft_interval_privsize,
+	.elemsize	= offsetof(struct nft_interval_elem, ext),
+	.estimate	= nft_interval_estimate,
+	.init		= nft_interval_init,
+	.destroy	= nft_interval_destroy,
+	.insert		= nft_interval_insert,
+	.remove		= nft_interval_remove,
+	.deactivate	= nft_interval_deactivate,
+	.activate	= nft_interval_activate,
+	.commit		= nft_interval_commit,
+	.lookup		= nft_interval_lookup,
+	.walk		= nft_interval_walk,
+	.features	= NFT_SET_INTERVAL | NFT_SET_MAP,
+	.owner		= THIS_MODULE,
+};
+
+static int __init nft_interval_module_init(void)
+{
+	return nft_register_set(&nft_interval_ops);
+}
+
+static void __exit nft_interval_module_exit(void)
+{
+	nft_unregister_set(&nft_interval_ops);
+}
+
+module_init(nft_interval_module_init);
+module_exit(nft_interval_module_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_ALIAS_NFT_SET();
@@ -33,20 +33,34 @@ static void nft_lookup_eval(const struct nft_expr *expr,
 	const struct nft_lookup *priv = nft_expr_priv(expr);
 	const struct nft_set *set = priv->set;
 	const struct nft_set_ext *ext;
+	struct nft_expr *sexpr;
 	bool found;
 
-	found = set->ops->lookup(set, &regs->data[priv->sreg], &ext) ^
-		priv->invert;
-
+	found = set->ops->lookup(set, &regs->data[priv->sreg], &ext);
+	found ^= priv->invert;
 	if (!found) {
 		regs->verdict.code = NFT_BREAK;
 		return;
 	}
 
-	if (found && set->flags & NFT_SET_MAP)
+	/*
+	 * An inverted lookup only matches when no element was found, so
+	 * the element's stateful expression is only charged for packets
+	 * that actually match the rule.
+	 */
+	if (priv->invert)
+		return;
+
+	if (nft_set_ext_exists(ext, NFT_SET_EXT_EXPR)) {
+		sexpr = nft_set_ext_expr(ext);
+		sexpr->ops->eval(sexpr, regs, pkt);
+		if (regs->verdict.code == NFT_BREAK)
+			return;
+	}
+
+	if (set->flags & NFT_SET_MAP)
 		nft_data_copy(&regs->data[priv->dreg],
 			      nft_set_ext_data(ext), set->dlen);
-
 }
 
 static const struct nla_policy nft_lookup_policy[NFTA_LOOKUP_MAX + 1] = {
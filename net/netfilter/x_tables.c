@@ -26,6 +26,7 @@
 #include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/audit.h>
+#include <linux/math64.h>
 #include <net/net_namespace.h>
 
 #include <linux/netfilter/x_tables.h>
@@ -59,6 +60,13 @@ struct xt_af {
 
 static struct xt_af *xt;
 
+/*
+ * Bumped on every table replacement, so that state derived from an
+ * earlier ruleset (e.g. offloaded flows) can tell it is out of date.
+ */
+atomic_t xt_table_gen = ATOMIC_INIT(0);
+EXPORT_SYMBOL_GPL(xt_table_gen);
+
 static const char *const xt_prefix[NFPROTO_NUMPROTO] = {
 	[NFPROTO_UNSPEC] = "x",
 	[NFPROTO_IPV4]   = "ip",
@@ -999,6 +1007,9 @@ void xt_free_table_info(struct xt_table_info *info)
 
 	free_percpu(info->stackptr);
 
+	if (info->classifier)
+		info->classifier->destroy(info->classifier);
+
 	kvfree(info);
 }
 EXPORT_SYMBOL(xt_free_table_info);
@@ -1116,6 +1127,7 @@ xt_replace_table(struct xt_table *table,
 	 */
 	smp_wmb();
 	table->private = newinfo;
+	atomic_inc(&xt_table_gen);
 
 	/*
 	 * Even though table entries have now been swapped, other CPU's
@@ -1282,6 +1294,90 @@ static const struct file_operations xt_table_ops = {
 	.release = seq_release_net,
 };
 
+static void *xt_stats_seq_start(struct seq_file *seq, loff_t *pos)
+{
+	struct xt_names_priv *priv = seq->private;
+	struct net *net = seq_file_net(seq);
+	u_int8_t af = priv->af;
+
+	mutex_lock(&xt[af].mutex);
+	return seq_list_start_head(&net->xt.tables[af], *pos);
+}
+
+static void *xt_stats_seq_next(struct seq_file *seq, void *v, loff_t *pos)
+{
+	struct xt_names_priv *priv = seq->private;
+	struct net *net = seq_file_net(seq);
+	u_int8_t af = priv->af;
+
+	return seq_list_next(v, &net->xt.tables[af], pos);
+}
+
+static int xt_stats_seq_show(struct seq_file *seq, void *v)
+{
+	struct xt_names_priv *priv = seq->private;
+	struct net *net = seq_file_net(seq);
+	const struct xt_classifier *cls;
+	struct xt_table *table;
+	u64 packets = 0, evaluated = 0, avg;
+	int cpu;
+
+	if (v == &net->xt.tables[priv->af])
+		return seq_puts(seq, "table            rules  indexed"
+				"           packets         evaluated"
+				"     avg\n");
+
+	table = list_entry(v, struct xt_table, list);
+	cls = table->private->classifier;
+	if (!strlen(table->name) || !cls)
+		return 0;
+
+	for_each_possible_cpu(cpu) {
+		const struct xt_classifier_stats *st;
+
+		st = per_cpu_ptr(cls->stats, cpu);
+		packets += st->packets;
+		evaluated += st->evaluated;
+	}
+
+	/* average rules evaluated per packet, two decimals */
+	avg = packets ? div64_u64(evaluated * 100, packets) : 0;
+
+	return seq_printf(seq, "%-16s %6u %8u %17llu %17llu %4llu.%02llu\n",
+			  table->name, table->private->number, cls->rules,
+			  packets, evaluated, div_u64(avg, 100),
+			  avg - div_u64(avg, 100) * 100);
+}
+
+static const struct seq_operations xt_stats_seq_ops = {
+	.start	= xt_stats_seq_start,
+	.next	= xt_stats_seq_next,
+	.stop	= xt_table_seq_stop,
+	.show	= xt_stats_seq_show,
+};
+
+static int xt_stats_open(struct inode *inode, struct file *file)
+{
+	int ret;
+	struct xt_names_priv *priv;
+
+	ret = seq_open_net(inode, file, &xt_stats_seq_ops,
+			   sizeof(struct xt_names_priv));
+	if (!ret) {
+		priv = ((struct seq_file *)file->private_data)->private;
+		priv->af = (unsigned long)PDE_DATA(inode);
+	}
+	return ret;
+}
+
+static const struct file_operations xt_stats_ops = {
+	.owner	 = THIS_MODULE,
+	.open	 = xt_stats_open,
+	.read	 = seq_read,
+	.llseek	 = seq_lseek,
+	.release = seq_release_net,
+};
+
 /*
  * Traverse state for ip{,6}_{tables,matches} for helping crossing
  * the multi-AF mutexes.
@@ -1496,6 +1592,7 @@ static const struct file_operations xt_target_ops = {
 #define FORMAT_TABLES	"_tables_names"
 #define	FORMAT_MATCHES	"_tables_matches"
 #define FORMAT_TARGETS 	"_tables_targets"
+#define FORMAT_STATS	"_tables_stats"
 
 #endif /* CONFIG_PROC_FS */
 
@@ -1585,11 +1682,23 @@ int xt_proto_init(struct net *net, u_int8_t af)
 				(void *)(unsigned long)af);
 	if (!proc)
 		goto out_remove_matches;
+
+	strlcpy(buf, xt_prefix[af], sizeof(buf));
+	strlcat(buf, FORMAT_STATS, sizeof(buf));
+	proc = proc_create_data(buf, 0440, net->proc_net, &xt_stats_ops,
+				(void *)(unsigned long)af);
+	if (!proc)
+		goto out_remove_targets;
 #endif
 
 	return 0;
 
 #ifdef CONFIG_PROC_FS
+out_remove_targets:
+	strlcpy(buf, xt_prefix[af], sizeof(buf));
+	strlcat(buf, FORMAT_TARGETS, sizeof(buf));
+	remove_proc_entry(buf, net->proc_net);
+
 out_remove_matches:
 	strlcpy(buf, xt_prefix[af], sizeof(buf));
 	strlcat(buf, FORMAT_MATCHES, sizeof(buf));
@@ -1621,6 +1730,10 @@ void xt_proto_fini(struct net *net, u_int8_t af)
 	strlcpy(buf, xt_prefix[af], sizeof(buf));
 	strlcat(buf, FORMAT_MATCHES, sizeof(buf));
 	remove_proc_entry(buf, net->proc_net);
+
+	strlcpy(buf, xt_prefix[af], sizeof(buf));
+	strlcat(buf, FORMAT_STATS, sizeof(buf));
+	remove_proc_entry(buf, net->proc_net);
 #endif /*CONFIG_PROC_FS*/
 }
 EXPORT_SYMBOL_GPL(xt_proto_fini);
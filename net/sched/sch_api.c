@@ -951,6 +951,13 @@ static struct Qdisc *qdisc_create(struct net_device *dev,
 	sch->handle = handle;
 
 	if (!ops->init || (err = ops->init(sch, tca[TCA_OPTIONS])) == 0) {
+		/* Only the root of a tx queue may run without the lock,
+		 * a class parent already serializes its children.
+		 */
+		if ((sch->flags & TCQ_F_NOLOCK) && p &&
+		    !(p->flags & TCQ_F_MQROOT))
+			sch->flags &= ~(TCQ_F_NOLOCK | TCQ_F_CPUSTATS);
+
 		if (qdisc_is_percpu_stats(sch)) {
 			sch->cpu_bstats =
 				netdev_alloc_pcpu_stats(struct gnet_stats_basic_cpu);
@@ -1351,7 +1358,7 @@ static int tc_fill_qdisc(struct sk_buff *skb, struct Qdisc *q, u32 clid,
 		goto nla_put_failure;
 	if (q->ops->dump && q->ops->dump(q, skb) < 0)
 		goto nla_put_failure;
-	qlen = q->q.qlen;
+	qlen = qdisc_qlen_sum(q);
 
 	stab = rtnl_dereference(q->stab);
 	if (stab && qdisc_dump_stab(skb, stab) < 0)
@@ -37,6 +37,8 @@
 #include <linux/rbtree.h>
 #include <linux/workqueue.h>
 #include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/skb_array.h>
 #include <net/netlink.h>
 #include <net/sch_generic.h>
 #include <net/pkt_sched.h>
@@ -52,6 +54,14 @@
     Each class is assigned level. Leaf has ALWAYS level 0 and root
     classes have level TC_HTB_MAXDEPTH-1. Interior nodes has level
     one less than their parent.
+
+    Per-cpu mode (TCA_HTB_PERCPU):
+    The root HTB runs as a TCQ_F_NOLOCK qdisc. Enqueue only appends the
+    skb to a ring owned by the local cpu and marks that cpu in a pending
+    mask. The cpu owning the qdisc run takes the qdisc lock in dequeue,
+    classifies and queues the pending skbs into the class tree and then
+    runs the usual algorithm, so the class tree, the token buckets and
+    the filters are still only touched under the qdisc lock.
 */
 
 static int htb_hysteresis __read_mostly = 0; /* whether to use mode hysteresis for speedup */
@@ -69,6 +79,8 @@ static int htb_rate_est = 0; /* htb classes have a default rate estimator */
 module_param(htb_rate_est, int, 0640);
 MODULE_PARM_DESC(htb_rate_est, "setup a default rate estimator (4sec 16sec) for htb classes");
 
+#define HTB_MAX_DEQUEUE_BATCH	64
+
 /* used internaly to keep status of single class */
 enum htb_cmode {
 	HTB_CANT_SEND,		/* class can't send and can't borrow */
@@ -164,6 +176,14 @@ struct htb_sched {
 	struct sk_buff_head	direct_queue;
 	long			direct_pkts;
 
+	/* skbs dequeued along with the previous one from the same class */
+	struct sk_buff_head	batch_queue;
+	u32			dequeue_batch;
+
+	/* per-cpu mode: skbs not yet classified and cpus that queued some */
+	struct skb_array __percpu *pending;
+	cpumask_var_t		pending_mask;
+
 	struct qdisc_watchdog	watchdog;
 
 	s64			now;	/* cached dequeue time */
@@ -569,7 +589,7 @@ static inline void htb_deactivate(struct htb_sched *q, struct htb_class *cl)
 	list_del_init(&cl->un.leaf.drop_list);
 }
 
-static int htb_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+static int htb_enqueue_tree(struct sk_buff *skb, struct Qdisc *sch)
 {
 	int uninitialized_var(ret);
 	struct htb_sched *q = qdisc_priv(sch);
@@ -605,6 +625,61 @@ static int htb_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 	return NET_XMIT_SUCCESS;
 }
 
+/* Called without the qdisc lock in per-cpu mode: the skb is only parked
+ * on the local ring, htb_drain_pending() classifies it later.
+ */
+static int htb_enqueue_pending(struct sk_buff *skb, struct Qdisc *sch)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	int cpu = smp_processor_id();
+
+	if (unlikely(skb_array_produce(this_cpu_ptr(q->pending), skb)))
+		return qdisc_drop_cpu(skb, sch);
+
+	qdisc_qstats_cpu_backlog_inc(sch, skb);
+	qdisc_qstats_cpu_qlen_inc(sch);
+
+	/* order the ring store before the mask test; pairs with the
+	 * barrier in htb_drain_pending()
+	 */
+	smp_mb();
+	if (!cpumask_test_cpu(cpu, q->pending_mask))
+		cpumask_set_cpu(cpu, q->pending_mask);
+
+	return NET_XMIT_SUCCESS;
+}
+
+static int htb_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+{
+	if (sch->flags & TCQ_F_NOLOCK)
+		return htb_enqueue_pending(skb, sch);
+
+	return htb_enqueue_tree(skb, sch);
+}
+
+/* Move skbs parked by htb_enqueue_pending() into the class tree.
+ * Called with the qdisc lock held.
+ */
+static void htb_drain_pending(struct Qdisc *sch)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	int cpu;
+
+	for_each_cpu(cpu, q->pending_mask) {
+		struct skb_array *ring = per_cpu_ptr(q->pending, cpu);
+		struct sk_buff *skb;
+
+		cpumask_clear_cpu(cpu, q->pending_mask);
+		smp_mb__after_atomic();
+
+		while ((skb = skb_array_consume(ring)) != NULL) {
+			qdisc_qstats_cpu_backlog_dec(sch, skb);
+			qdisc_qstats_cpu_qlen_dec(sch);
+			htb_enqueue_tree(skb, sch);
+		}
+	}
+}
+
 static inline void htb_accnt_tokens(struct htb_class *cl, int bytes, s64 diff)
 {
 	s64 toks = diff + cl->tokens;
@@ -807,6 +882,51 @@ static struct htb_class *htb_lookup_leaf(struct htb_prio *hprio, const int prio)
 	return NULL;
 }
 
+/* Is cl still allowed to send at level, possibly borrowing from
+ * the ancestor sitting at that level ?
+ */
+static bool htb_class_may_send(const struct htb_class *cl, int level)
+{
+	while (cl && cl->level < level) {
+		if (cl->cmode != HTB_MAY_BORROW)
+			return false;
+		cl = cl->parent;
+	}
+	return cl && cl->level == level && cl->cmode == HTB_CAN_SEND;
+}
+
+/* Pull more packets from the class just served while its DRR deficit
+ * and its tokens allow it, and park them on q->batch_queue. This saves
+ * the event and feed tree walks for each of them.
+ */
+static void htb_dequeue_batch(struct htb_sched *q, struct htb_class *cl,
+			      const int prio, const int level)
+{
+	u32 budget = q->dequeue_batch;
+
+	while (--budget && cl->un.leaf.deficit[level] >= 0 &&
+	       cl->un.leaf.q->q.qlen && htb_class_may_send(cl, level)) {
+		struct sk_buff *skb = cl->un.leaf.q->dequeue(cl->un.leaf.q);
+
+		if (unlikely(!skb))
+			break;
+
+		bstats_update(&cl->bstats, skb);
+		cl->un.leaf.deficit[level] -= qdisc_pkt_len(skb);
+		if (cl->un.leaf.deficit[level] < 0) {
+			cl->un.leaf.deficit[level] += cl->quantum;
+			htb_next_rb_node(level ? &cl->parent->un.inner.clprio[prio].ptr :
+						 &q->hlevel[0].hprio[prio].ptr);
+			/* the class lost its turn, stop after this one */
+			budget = 1;
+		}
+		if (!cl->un.leaf.q->q.qlen)
+			htb_deactivate(q, cl);
+		htb_charge_class(q, cl, level, skb);
+		__skb_queue_tail(&q->batch_queue, skb);
+	}
+}
+
 /* dequeues packet at given priority and level; call only if
  * you are sure that there is active class at prio/level
  */
@@ -859,12 +979,15 @@ next:
 	} while (cl != start);
 
 	if (likely(skb != NULL)) {
+		bool rotated = false;
+
 		bstats_update(&cl->bstats, skb);
 		cl->un.leaf.deficit[level] -= qdisc_pkt_len(skb);
 		if (cl->un.leaf.deficit[level] < 0) {
 			cl->un.leaf.deficit[level] += cl->quantum;
 			htb_next_rb_node(level ? &cl->parent->un.inner.clprio[prio].ptr :
 						 &q->hlevel[0].hprio[prio].ptr);
+			rotated = true;
 		}
 		/* this used to be after charge_class but this constelation
 		 * gives us slightly better performance
@@ -872,11 +995,14 @@ next:
 		if (!cl->un.leaf.q->q.qlen)
 			htb_deactivate(q, cl);
 		htb_charge_class(q, cl, level, skb);
+
+		if (q->dequeue_batch > 1 && !rotated)
+			htb_dequeue_batch(q, cl, prio, level);
 	}
 	return skb;
 }
 
-static struct sk_buff *htb_dequeue(struct Qdisc *sch)
+static struct sk_buff *htb_dequeue_locked(struct Qdisc *sch)
 {
 	struct sk_buff *skb;
 	struct htb_sched *q = qdisc_priv(sch);
@@ -884,11 +1010,19 @@ static struct sk_buff *htb_dequeue(struct Qdisc *sch)
 	s64 next_event;
 	unsigned long start_at;
 
+	/* packets already charged along with the previous dequeue */
+	skb = __skb_dequeue(&q->batch_queue);
+	if (skb != NULL)
+		goto ok;
+
 	/* try to dequeue direct packets as high prio (!) to minimize cpu work */
 	skb = __skb_dequeue(&q->direct_queue);
 	if (skb != NULL) {
 ok:
-		qdisc_bstats_update(sch, skb);
+		if (qdisc_is_percpu_stats(sch))
+			qdisc_bstats_cpu_update(sch, skb);
+		else
+			qdisc_bstats_update(sch, skb);
 		qdisc_unthrottled(sch);
 		qdisc_qstats_backlog_dec(sch, skb);
 		sch->q.qlen--;
@@ -943,6 +1077,24 @@ fin:
 	return skb;
 }
 
+static struct sk_buff *htb_dequeue(struct Qdisc *sch)
+{
+	struct sk_buff *skb;
+
+	if (!(sch->flags & TCQ_F_NOLOCK))
+		return htb_dequeue_locked(sch);
+
+	/* Only the qdisc run owner gets here, the lock serializes it
+	 * against class changes done under sch_tree_lock().
+	 */
+	spin_lock(qdisc_lock(sch));
+	htb_drain_pending(sch);
+	skb = htb_dequeue_locked(sch);
+	spin_unlock(qdisc_lock(sch));
+
+	return skb;
+}
+
 /* try to drop from each class (by prio) until one succeed */
 static unsigned int htb_drop(struct Qdisc *sch)
 {
@@ -991,6 +1143,30 @@ static void htb_reset(struct Qdisc *sch)
 	}
 	qdisc_watchdog_cancel(&q->watchdog);
 	__skb_queue_purge(&q->direct_queue);
+	__skb_queue_purge(&q->batch_queue);
+	if (q->pending) {
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct skb_array *ring = per_cpu_ptr(q->pending, cpu);
+			struct sk_buff *skb;
+
+			while ((skb = skb_array_consume_bh(ring)) != NULL)
+				kfree_skb(skb);
+		}
+		cpumask_clear(q->pending_mask);
+	}
+	if (qdisc_is_percpu_stats(sch)) {
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct gnet_stats_queue *qstats;
+
+			qstats = per_cpu_ptr(sch->cpu_qstats, cpu);
+			qstats->backlog = 0;
+			qstats->qlen = 0;
+		}
+	}
 	sch->q.qlen = 0;
 	sch->qstats.backlog = 0;
 	memset(q->hlevel, 0, sizeof(q->hlevel));
@@ -1007,8 +1183,52 @@ static const struct nla_policy htb_policy[TCA_HTB_MAX + 1] = {
 	[TCA_HTB_DIRECT_QLEN] = { .type = NLA_U32 },
 	[TCA_HTB_RATE64] = { .type = NLA_U64 },
 	[TCA_HTB_CEIL64] = { .type = NLA_U64 },
+	[TCA_HTB_PERCPU] = { .type = NLA_FLAG },
+	[TCA_HTB_DEQUEUE_BATCH] = { .type = NLA_U32 },
 };
 
+static void htb_free_pending(struct htb_sched *q)
+{
+	int cpu;
+
+	if (!q->pending)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct skb_array *ring = per_cpu_ptr(q->pending, cpu);
+
+		if (ring->ring.queue)
+			skb_array_cleanup(ring);
+	}
+	free_percpu(q->pending);
+	q->pending = NULL;
+	free_cpumask_var(q->pending_mask);
+}
+
+static int htb_alloc_pending(struct htb_sched *q, int size)
+{
+	int cpu;
+
+	q->pending = alloc_percpu(struct skb_array);
+	if (!q->pending)
+		return -ENOMEM;
+
+	if (!zalloc_cpumask_var(&q->pending_mask, GFP_KERNEL)) {
+		free_percpu(q->pending);
+		q->pending = NULL;
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		if (skb_array_init(per_cpu_ptr(q->pending, cpu), size,
+				   GFP_KERNEL)) {
+			htb_free_pending(q);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
 static void htb_work_func(struct work_struct *work)
 {
 	struct htb_sched *q = container_of(work, struct htb_sched, work);
@@ -1048,16 +1268,34 @@ static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 	qdisc_watchdog_init(&q->watchdog, sch);
 	INIT_WORK(&q->work, htb_work_func);
 	skb_queue_head_init(&q->direct_queue);
+	skb_queue_head_init(&q->batch_queue);
 
 	if (tb[TCA_HTB_DIRECT_QLEN])
 		q->direct_qlen = nla_get_u32(tb[TCA_HTB_DIRECT_QLEN]);
 	else
 		q->direct_qlen = qdisc_dev(sch)->tx_queue_len;
 
+	q->dequeue_batch = 1;
+	if (tb[TCA_HTB_DEQUEUE_BATCH])
+		q->dequeue_batch = clamp_t(u32,
+					   nla_get_u32(tb[TCA_HTB_DEQUEUE_BATCH]),
+					   1, HTB_MAX_DEQUEUE_BATCH);
+
 	if ((q->rate2quantum = gopt->rate2quantum) < 1)
 		q->rate2quantum = 1;
 	q->defcls = gopt->defcls;
 
+	if (tb[TCA_HTB_PERCPU]) {
+		err = htb_alloc_pending(q, max_t(int,
+						 qdisc_dev(sch)->tx_queue_len,
+						 1));
+		if (err) {
+			qdisc_class_hash_destroy(&q->clhash);
+			return err;
+		}
+		sch->flags |= TCQ_F_NOLOCK | TCQ_F_CPUSTATS;
+	}
+
 	return 0;
 }
 
@@ -1081,7 +1319,11 @@ static int htb_dump(struct Qdisc *sch, struct sk_buff *skb)
 	if (nest == NULL)
 		goto nla_put_failure;
 	if (nla_put(skb, TCA_HTB_INIT, sizeof(gopt), &gopt) ||
-	    nla_put_u32(skb, TCA_HTB_DIRECT_QLEN, q->direct_qlen))
+	    nla_put_u32(skb, TCA_HTB_DIRECT_QLEN, q->direct_qlen) ||
+	    nla_put_u32(skb, TCA_HTB_DEQUEUE_BATCH, q->dequeue_batch))
+		goto nla_put_failure;
+	if ((sch->flags & TCQ_F_NOLOCK) &&
+	    nla_put_flag(skb, TCA_HTB_PERCPU))
 		goto nla_put_failure;
 
 	return nla_nest_end(skb, nest);
@@ -1264,6 +1506,8 @@ static void htb_destroy(struct Qdisc *sch)
 	}
 	qdisc_class_hash_destroy(&q->clhash);
 	__skb_queue_purge(&q->direct_queue);
+	__skb_queue_purge(&q->batch_queue);
+	htb_free_pending(q);
 }
 
 static int htb_delete(struct Qdisc *sch, unsigned long arg)
@@ -0,0 +1,114 @@
+#!/bin/bash
+#
+# Measure shaped HTB throughput against the number of transmitting cpus.
+#
+# One pktgen thread per cpu sends through dev_queue_xmit() (pktgen flag
+# QUEUE_XMIT), so every packet goes through the root qdisc of $DEV. The
+# HTB tree has $CLASSES leaf classes selected by UDP source port, all
+# with a ceil above line rate so that the qdisc, not the shaper, is what
+# limits the packet rate.
+#
+# Usage: htb_scaling.sh -i DEV [-c CLASSES] [-t SECONDS] [-p] [-b BATCH]
+#	-p	use the per-cpu enqueue mode (TCA_HTB_PERCPU)
+#	-b	packets dequeued per class visit (TCA_HTB_DEQUEUE_BATCH)
+#
+# Needs CONFIG_NET_PKTGEN and an iproute2 that knows the htb "percpu"
+# and "batch" options. Prints one "cpus pps" line per run.
+
+DEV=
+CLASSES=1000
+DURATION=10
+PERCPU=
+BATCH=1
+
+while getopts "i:c:t:pb:" opt; do
+	case $opt in
+	i) DEV=$OPTARG ;;
+	c) CLASSES=$OPTARG ;;
+	t) DURATION=$OPTARG ;;
+	p) PERCPU=percpu ;;
+	b) BATCH=$OPTARG ;;
+	*) echo "usage: $0 -i DEV [-c CLASSES] [-t SECONDS] [-p] [-b BATCH]"
+	   exit 1 ;;
+	esac
+done
+
+[ -z "$DEV" ] && { echo "$0: -i DEV is required"; exit 1; }
+[ -d /proc/net/pktgen ] || modprobe pktgen || exit 1
+
+PGDIR=/proc/net/pktgen
+NCPUS=$(nproc)
+
+pgset() {
+	local file=$1; shift
+	echo "$@" > $file
+	if ! grep -q "Result: OK" $file; then
+		echo "pktgen: '$*' on $file failed:"
+		grep "Result:" $file
+		exit 1
+	fi
+}
+
+setup_htb() {
+	tc qdisc del dev $DEV root 2>/dev/null
+	tc qdisc add dev $DEV root handle 1: htb default 1 \
+		batch $BATCH $PERCPU || exit 1
+	tc class add dev $DEV parent 1: classid 1:ffff htb \
+		rate 100gbit ceil 100gbit || exit 1
+
+	for ((i = 1; i <= CLASSES; i++)); do
+		printf "class add dev %s parent 1:ffff classid 1:%x htb " \
+			$DEV $i
+		echo "rate 10mbit ceil 100gbit"
+		printf "filter add dev %s parent 1: protocol ip prio 1 u32 " \
+			$DEV
+		printf "match ip sport %d 0xffff flowid 1:%x\n" \
+			$((1000 + i)) $i
+	done | tc -batch - || exit 1
+}
+
+setup_pktgen() {
+	local cpus=$1 cpu
+
+	for ((cpu = 0; cpu < NCPUS; cpu++)); do
+		pgset $PGDIR/kpktgend_$cpu "rem_device_all"
+	done
+
+	for ((cpu = 0; cpu < cpus; cpu++)); do
+		local pgdev=$PGDIR/$DEV@$cpu
+
+		pgset $PGDIR/kpktgend_$cpu "add_device $DEV@$cpu"
+		pgset $pgdev "flag QUEUE_XMIT"
+		pgset $pgdev "flag UDPSRC_RND"
+		pgset $pgdev "flag NO_TIMESTAMP"
+		pgset $pgdev "count 0"
+		pgset $pgdev "pkt_size 64"
+		pgset $pgdev "delay 0"
+		pgset $pgdev "dst 198.18.0.1"
+		pgset $pgdev "dst_mac 00:00:00:00:00:01"
+		pgset $pgdev "udp_src_min 1001"
+		pgset $pgdev "udp_src_max $((1000 + CLASSES))"
+	done
+}
+
+tx_packets() {
+	cat /sys/class/net/$DEV/statistics/tx_packets
+}
+
+setup_htb
+
+for ((cpus = 1; cpus <= NCPUS; cpus *= 2)); do
+	setup_pktgen $cpus
+
+	echo start > $PGDIR/pgctrl &
+	sleep 1
+	before=$(tx_packets)
+	sleep $DURATION
+	after=$(tx_packets)
+	echo stop > $PGDIR/pgctrl
+	wait
+
+	echo "$cpus $(( (after - before) / DURATION ))"
+done
+
+tc qdisc del dev $DEV root
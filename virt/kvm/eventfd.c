@@ -36,6 +36,7 @@
 #include <linux/slab.h>
 #include <linux/seqlock.h>
 #include <linux/irqbypass.h>
+#include <linux/hashtable.h>
 #include <trace/events/kvm.h>
 
 #include "iodev.h"
@@ -511,6 +512,8 @@ kvm_eventfd_init(struct kvm *kvm)
 	mutex_init(&kvm->irqfds.resampler_lock);
 #endif
 	INIT_LIST_HEAD(&kvm->ioeventfds);
+	INIT_LIST_HEAD(&kvm->ioeventfd_groups);
+	hash_init(kvm->ioeventfd_hash);
 }
 
 #ifdef CONFIG_HAVE_KVM_IRQFD
@@ -648,13 +651,33 @@ void kvm_irqfd_exit(void)
  * --------------------------------------------------------------------
  */
 
+/*
+ * ioeventfds with a datamatch are not put on the bus one by one; all of
+ * those sharing a bus, address and length (e.g. the notify register of a
+ * virtio-pci device, one datamatch per queue) hang off a single group
+ * device, which finds the ioeventfd for the written value in
+ * kvm->ioeventfd_hash.  Otherwise the bus would call every registration
+ * at the address in turn until one of them accepts the write.
+ */
+struct _ioeventfd_group {
+	struct list_head     list;
+	struct kvm          *kvm;
+	u64                  addr;
+	int                  length;
+	u8                   bus_idx;
+	int                  count;
+	struct kvm_io_device dev;
+};
+
 struct _ioeventfd {
 	struct list_head     list;
+	struct hlist_node    hnode;
 	u64                  addr;
 	int                  length;
 	struct eventfd_ctx  *eventfd;
 	u64                  datamatch;
 	struct kvm_io_device dev;
+	struct _ioeventfd_group *group;
 	u8                   bus_idx;
 	bool                 wildcard;
 };
@@ -665,6 +688,12 @@ to_ioeventfd(struct kvm_io_device *dev)
 	return container_of(dev, struct _ioeventfd, dev);
 }
 
+static inline struct _ioeventfd_group *
+to_ioeventfd_group(struct kvm_io_device *dev)
+{
+	return container_of(dev, struct _ioeventfd_group, dev);
+}
+
 static void
 ioeventfd_release(struct _ioeventfd *p)
 {
@@ -673,6 +702,37 @@ ioeventfd_release(struct _ioeventfd *p)
 	kfree(p);
 }
 
+static inline u64
+ioeventfd_hash_key(u64 addr, u64 datamatch)
+{
+	return addr ^ datamatch;
+}
+
+static bool
+ioeventfd_get_val(const void *val, int len, u64 *_val)
+{
+	BUG_ON(!IS_ALIGNED((unsigned long)val, len));
+
+	switch (len) {
+	case 1:
+		*_val = *(u8 *)val;
+		break;
+	case 2:
+		*_val = *(u16 *)val;
+		break;
+	case 4:
+		*_val = *(u32 *)val;
+		break;
+	case 8:
+		*_val = *(u64 *)val;
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
 static bool
 ioeventfd_in_range(struct _ioeventfd *p, gpa_t addr, int len, const void *val)
 {
@@ -695,25 +755,8 @@ ioeventfd_in_range(struct _ioeventfd *p, gpa_t addr, int len, const void *val)
 		return true;
 
 	/* otherwise, we have to actually compare the data */
-
-	BUG_ON(!IS_ALIGNED((unsigned long)val, len));
-
-	switch (len) {
-	case 1:
-		_val = *(u8 *)val;
-		break;
-	case 2:
-		_val = *(u16 *)val;
-		break;
-	case 4:
-		_val = *(u32 *)val;
-		break;
-	case 8:
-		_val = *(u64 *)val;
-		break;
-	default:
+	if (!ioeventfd_get_val(val, len, &_val))
 		return false;
-	}
 
 	return _val == p->datamatch ? true : false;
 }
@@ -749,6 +792,114 @@ static const struct kvm_io_device_ops ioeventfd_ops = {
 	.destructor = ioeventfd_destructor,
 };
 
+/* called under kvm->srcu, like every other kvm_io_device write */
+static int
+ioeventfd_group_write(struct kvm_io_device *this, gpa_t addr, int len,
+		      const void *val)
+{
+	struct _ioeventfd_group *group = to_ioeventfd_group(this);
+	struct _ioeventfd *p;
+	u64 _val;
+
+	if (addr != group->addr || len != group->length)
+		return -EOPNOTSUPP;
+
+	if (!ioeventfd_get_val(val, len, &_val))
+		return -EOPNOTSUPP;
+
+	hash_for_each_possible_rcu(group->kvm->ioeventfd_hash, p, hnode,
+				   ioeventfd_hash_key(addr, _val))
+		if (p->group == group && p->datamatch == _val) {
+			eventfd_signal(p->eventfd, 1);
+			return 0;
+		}
+
+	return -EOPNOTSUPP;
+}
+
+static void
+ioeventfd_group_destructor(struct kvm_io_device *this)
+{
+	struct _ioeventfd_group *group = to_ioeventfd_group(this);
+	struct _ioeventfd *p, *tmp;
+
+	list_for_each_entry_safe(p, tmp, &group->kvm->ioeventfds, list)
+		if (p->group == group) {
+			hash_del(&p->hnode);
+			ioeventfd_release(p);
+		}
+
+	list_del(&group->list);
+	kfree(group);
+}
+
+static const struct kvm_io_device_ops ioeventfd_group_ops = {
+	.write      = ioeventfd_group_write,
+	.destructor = ioeventfd_group_destructor,
+};
+
+/* assumes kvm->slots_lock held */
+static int
+ioeventfd_group_attach(struct kvm *kvm, struct _ioeventfd *p)
+{
+	struct _ioeventfd_group *group;
+	int ret;
+
+	list_for_each_entry(group, &kvm->ioeventfd_groups, list)
+		if (group->bus_idx == p->bus_idx &&
+		    group->addr == p->addr &&
+		    group->length == p->length)
+			goto found;
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (!group)
+		return -ENOMEM;
+
+	group->kvm     = kvm;
+	group->addr    = p->addr;
+	group->length  = p->length;
+	group->bus_idx = p->bus_idx;
+	kvm_iodevice_init(&group->dev, &ioeventfd_group_ops);
+
+	ret = kvm_io_bus_register_dev(kvm, p->bus_idx, p->addr, p->length,
+				      &group->dev);
+	if (ret < 0) {
+		kfree(group);
+		return ret;
+	}
+
+	kvm->buses[p->bus_idx]->ioeventfd_count++;
+	list_add_tail(&group->list, &kvm->ioeventfd_groups);
+
+found:
+	group->count++;
+	p->group = group;
+	hash_add_rcu(kvm->ioeventfd_hash, &p->hnode,
+		     ioeventfd_hash_key(p->addr, p->datamatch));
+
+	return 0;
+}
+
+/* assumes kvm->slots_lock held */
+static void
+ioeventfd_group_detach(struct kvm *kvm, struct _ioeventfd *p)
+{
+	struct _ioeventfd_group *group = p->group;
+
+	hash_del_rcu(&p->hnode);
+
+	if (--group->count) {
+		/* wait for writers still walking the hash before p is freed */
+		synchronize_srcu_expedited(&kvm->srcu);
+		return;
+	}
+
+	kvm_io_bus_unregister_dev(kvm, group->bus_idx, &group->dev);
+	kvm->buses[group->bus_idx]->ioeventfd_count--;
+	list_del(&group->list);
+	kfree(group);
+}
+
 /* assumes kvm->slots_lock held */
 static bool
 ioeventfd_check_collision(struct kvm *kvm, struct _ioeventfd *p)
@@ -815,14 +966,21 @@ static int kvm_assign_ioeventfd_idx(struct kvm *kvm,
 		goto unlock_fail;
 	}
 
-	kvm_iodevice_init(&p->dev, &ioeventfd_ops);
+	if (p->wildcard) {
+		kvm_iodevice_init(&p->dev, &ioeventfd_ops);
 
-	ret = kvm_io_bus_register_dev(kvm, bus_idx, p->addr, p->length,
-				      &p->dev);
-	if (ret < 0)
-		goto unlock_fail;
+		ret = kvm_io_bus_register_dev(kvm, bus_idx, p->addr, p->length,
+					      &p->dev);
+		if (ret < 0)
+			goto unlock_fail;
+
+		kvm->buses[bus_idx]->ioeventfd_count++;
+	} else {
+		ret = ioeventfd_group_attach(kvm, p);
+		if (ret < 0)
+			goto unlock_fail;
+	}
 
-	kvm->buses[bus_idx]->ioeventfd_count++;
 	list_add_tail(&p->list, &kvm->ioeventfds);
 
 	mutex_unlock(&kvm->slots_lock);
@@ -866,8 +1024,12 @@ kvm_deassign_ioeventfd_idx(struct kvm *kvm, enum kvm_bus bus_idx,
 		if (!p->wildcard && p->datamatch != args->datamatch)
 			continue;
 
-		kvm_io_bus_unregister_dev(kvm, bus_idx, &p->dev);
-		kvm->buses[bus_idx]->ioeventfd_count--;
+		if (p->group) {
+			ioeventfd_group_detach(kvm, p);
+		} else {
+			kvm_io_bus_unregister_dev(kvm, bus_idx, &p->dev);
+			kvm->buses[bus_idx]->ioeventfd_count--;
+		}
 		ioeventfd_release(p);
 		ret = 0;
 		break;
@@ -28,6 +28,7 @@
 #include <linux/vmalloc.h>
 #include <linux/reboot.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/highmem.h>
 #include <linux/file.h>
 #include <linux/syscore_ops.h>
@@ -58,6 +59,7 @@
 
 #include "coalesced_mmio.h"
 #include "async_pf.h"
+#include "mmu_lock.h"
 #include "vfio.h"
 
 #define CREATE_TRACE_POINTS
@@ -66,6 +68,10 @@
 /* Worst case buffer size needed for holding an integer. */
 #define ITOA_MAX_LEN 12
 
+/* Fixed point scale and decay of vcpu->halt_poll_success_avg */
+#define KVM_HALT_POLL_AVG_ONE	1024
+#define KVM_HALT_POLL_AVG_SHIFT	3
+
 MODULE_AUTHOR("Qumranet");
 MODULE_LICENSE("GPL");
 
@@ -84,6 +90,11 @@ unsigned int halt_poll_ns_shrink;
 module_param(halt_poll_ns_shrink, uint, S_IRUGO | S_IWUSR);
 EXPORT_SYMBOL_GPL(halt_poll_ns_shrink);
 
+/* Default stops polling when fewer than 10% of halts end within the window */
+unsigned int halt_poll_min_success = 10;
+module_param(halt_poll_min_success, uint, S_IRUGO | S_IWUSR);
+EXPORT_SYMBOL_GPL(halt_poll_min_success);
+
 /*
  * Ordering of locks:
  *
@@ -102,6 +113,7 @@ struct kmem_cache *kvm_vcpu_cache;
 EXPORT_SYMBOL_GPL(kvm_vcpu_cache);
 
 static __read_mostly struct preempt_ops kvm_preempt_ops;
+static DEFINE_PER_CPU(struct kvm_vcpu *, kvm_running_vcpu);
 
 struct dentry *kvm_debugfs_dir;
 EXPORT_SYMBOL_GPL(kvm_debugfs_dir);
@@ -121,7 +133,9 @@ static void hardware_disable_all(void);
 static void kvm_io_bus_destroy(struct kvm_io_bus *bus);
 
 static void kvm_release_pfn_dirty(kvm_pfn_t pfn);
-static void mark_page_dirty_in_slot(struct kvm_memory_slot *memslot, gfn_t gfn);
+static void mark_page_dirty_in_slot(struct kvm *kvm,
+				    struct kvm_memory_slot *memslot,
+				    gfn_t gfn);
 
 __visible bool kvm_rebooting;
 EXPORT_SYMBOL_GPL(kvm_rebooting);
@@ -146,6 +160,7 @@ int vcpu_load(struct kvm_vcpu *vcpu)
 	if (mutex_lock_killable(&vcpu->mutex))
 		return -EINTR;
 	cpu = get_cpu();
+	__this_cpu_write(kvm_running_vcpu, vcpu);
 	preempt_notifier_register(&vcpu->preempt_notifier);
 	kvm_arch_vcpu_load(vcpu, cpu);
 	put_cpu();
@@ -158,11 +173,30 @@ void vcpu_put(struct kvm_vcpu *vcpu)
 	preempt_disable();
 	kvm_arch_vcpu_put(vcpu);
 	preempt_notifier_unregister(&vcpu->preempt_notifier);
+	__this_cpu_write(kvm_running_vcpu, NULL);
 	preempt_enable();
 	mutex_unlock(&vcpu->mutex);
 }
 EXPORT_SYMBOL_GPL(vcpu_put);
 
+/**
+ * kvm_get_running_vcpu - get the vcpu running on the current CPU.
+ *
+ * Used by paths that dirty guest memory without being handed a vcpu,
+ * so that the page can be pushed to that vcpu's dirty ring.
+ */
+struct kvm_vcpu *kvm_get_running_vcpu(void)
+{
+	struct kvm_vcpu *vcpu;
+
+	preempt_disable();
+	vcpu = __this_cpu_read(kvm_running_vcpu);
+	preempt_enable();
+
+	return vcpu;
+}
+EXPORT_SYMBOL_GPL(kvm_get_running_vcpu);
+
 static void ack_flush(void *_completed)
 {
 }
@@ -238,6 +272,7 @@ int kvm_vcpu_init(struct kvm_vcpu *vcpu, struct kvm *kvm, unsigned id)
 	vcpu->vcpu_id = id;
 	vcpu->pid = NULL;
 	vcpu->halt_poll_ns = 0;
+	vcpu->halt_poll_success_avg = KVM_HALT_POLL_AVG_ONE;
 	init_waitqueue_head(&vcpu->wq);
 	kvm_async_pf_vcpu_init(vcpu);
 
@@ -255,11 +290,20 @@ int kvm_vcpu_init(struct kvm_vcpu *vcpu, struct kvm *kvm, unsigned id)
 	kvm_vcpu_set_dy_eligible(vcpu, false);
 	vcpu->preempted = false;
 
+	if (kvm->dirty_ring_size) {
+		r = kvm_dirty_ring_alloc(&vcpu->dirty_ring, id,
+					 kvm->dirty_ring_size);
+		if (r)
+			goto fail_free_run;
+	}
+
 	r = kvm_arch_vcpu_init(vcpu);
 	if (r < 0)
-		goto fail_free_run;
+		goto fail_free_ring;
 	return 0;
 
+fail_free_ring:
+	kvm_dirty_ring_free(&vcpu->dirty_ring);
 fail_free_run:
 	free_page((unsigned long)vcpu->run);
 fail:
@@ -271,6 +315,7 @@ void kvm_vcpu_uninit(struct kvm_vcpu *vcpu)
 {
 	put_pid(vcpu->pid);
 	kvm_arch_vcpu_uninit(vcpu);
+	kvm_dirty_ring_free(&vcpu->dirty_ring);
 	free_page((unsigned long)vcpu->run);
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_uninit);
@@ -307,7 +352,7 @@ static void kvm_mmu_notifier_invalidate_page(struct mmu_notifier *mn,
 	 * is going to be freed.
 	 */
 	idx = srcu_read_lock(&kvm->srcu);
-	spin_lock(&kvm->mmu_lock);
+	KVM_MMU_LOCK(kvm);
 
 	kvm->mmu_notifier_seq++;
 	need_tlb_flush = kvm_unmap_hva(kvm, address) | kvm->tlbs_dirty;
@@ -315,7 +360,7 @@ static void kvm_mmu_notifier_invalidate_page(struct mmu_notifier *mn,
 	if (need_tlb_flush)
 		kvm_flush_remote_tlbs(kvm);
 
-	spin_unlock(&kvm->mmu_lock);
+	KVM_MMU_UNLOCK(kvm);
 
 	kvm_arch_mmu_notifier_invalidate_page(kvm, address);
 
@@ -331,10 +376,10 @@ static void kvm_mmu_notifier_change_pte(struct mmu_notifier *mn,
 	int idx;
 
 	idx = srcu_read_lock(&kvm->srcu);
-	spin_lock(&kvm->mmu_lock);
+	KVM_MMU_LOCK(kvm);
 	kvm->mmu_notifier_seq++;
 	kvm_set_spte_hva(kvm, address, pte);
-	spin_unlock(&kvm->mmu_lock);
+	KVM_MMU_UNLOCK(kvm);
 	srcu_read_unlock(&kvm->srcu, idx);
 }
 
@@ -347,7 +392,7 @@ static void kvm_mmu_notifier_invalidate_range_start(struct mmu_notifier *mn,
 	int need_tlb_flush = 0, idx;
 
 	idx = srcu_read_lock(&kvm->srcu);
-	spin_lock(&kvm->mmu_lock);
+	KVM_MMU_LOCK(kvm);
 	/*
 	 * The count increase must become visible at unlock time as no
 	 * spte can be established without taking the mmu_lock and
@@ -360,7 +405,7 @@ static void kvm_mmu_notifier_invalidate_range_start(struct mmu_notifier *mn,
 	if (need_tlb_flush)
 		kvm_flush_remote_tlbs(kvm);
 
-	spin_unlock(&kvm->mmu_lock);
+	KVM_MMU_UNLOCK(kvm);
 	srcu_read_unlock(&kvm->srcu, idx);
 }
 
@@ -371,7 +416,7 @@ static void kvm_mmu_notifier_invalidate_range_end(struct mmu_notifier *mn,
 {
 	struct kvm *kvm = mmu_notifier_to_kvm(mn);
 
-	spin_lock(&kvm->mmu_lock);
+	KVM_MMU_LOCK(kvm);
 	/*
 	 * This sequence increase will notify the kvm page fault that
 	 * the page that is going to be mapped in the spte could have
@@ -385,7 +430,7 @@ static void kvm_mmu_notifier_invalidate_range_end(struct mmu_notifier *mn,
 	 * in conjunction with the smp_rmb in mmu_notifier_retry().
 	 */
 	kvm->mmu_notifier_count--;
-	spin_unlock(&kvm->mmu_lock);
+	KVM_MMU_UNLOCK(kvm);
 
 	BUG_ON(kvm->mmu_notifier_count < 0);
 }
@@ -398,13 +443,13 @@ static int kvm_mmu_notifier_clear_flush_young(struct mmu_notifier *mn,
 	int young, idx;
 
 	idx = srcu_read_lock(&kvm->srcu);
-	spin_lock(&kvm->mmu_lock);
+	KVM_MMU_LOCK(kvm);
 
 	young = kvm_age_hva(kvm, address);
 	if (young)
 		kvm_flush_remote_tlbs(kvm);
 
-	spin_unlock(&kvm->mmu_lock);
+	KVM_MMU_UNLOCK(kvm);
 	srcu_read_unlock(&kvm->srcu, idx);
 
 	return young;
@@ -418,9 +463,9 @@ static int kvm_mmu_notifier_test_young(struct mmu_notifier *mn,
 	int young, idx;
 
 	idx = srcu_read_lock(&kvm->srcu);
-	spin_lock(&kvm->mmu_lock);
+	KVM_MMU_LOCK(kvm);
 	young = kvm_test_age_hva(kvm, address);
-	spin_unlock(&kvm->mmu_lock);
+	KVM_MMU_UNLOCK(kvm);
 	srcu_read_unlock(&kvm->srcu, idx);
 
 	return young;
@@ -518,6 +563,125 @@ static void kvm_free_memslots(struct kvm *kvm, struct kvm_memslots *slots)
 	kvfree(slots);
 }
 
+static void kvm_get_halt_poll(struct kvm *kvm, struct kvm_halt_poll *hp)
+{
+	if (READ_ONCE(kvm->override_halt_poll_ns)) {
+		/* Pairs with the smp_wmb in kvm_vm_ioctl_enable_halt_poll() */
+		smp_rmb();
+		hp->max_ns = READ_ONCE(kvm->max_halt_poll_ns);
+	} else {
+		hp->max_ns = READ_ONCE(halt_poll_ns);
+	}
+	hp->grow = READ_ONCE(halt_poll_ns_grow);
+	hp->shrink = READ_ONCE(halt_poll_ns_shrink);
+	hp->min_success = READ_ONCE(halt_poll_min_success);
+}
+
+static unsigned int kvm_vcpu_halt_poll_success_pct(struct kvm_vcpu *vcpu)
+{
+	return READ_ONCE(vcpu->halt_poll_success_avg) * 100 /
+	       KVM_HALT_POLL_AVG_ONE;
+}
+
+static int kvm_halt_poll_show(struct seq_file *m, void *v)
+{
+	struct kvm *kvm = m->private;
+	struct kvm_halt_poll hp;
+
+	kvm_get_halt_poll(kvm, &hp);
+	seq_printf(m, "source: %s\n",
+		   READ_ONCE(kvm->override_halt_poll_ns) ? "vm" : "module");
+	seq_printf(m, "max_ns: %u\n", hp.max_ns);
+	seq_printf(m, "grow: %u\n", hp.grow);
+	seq_printf(m, "shrink: %u\n", hp.shrink);
+	seq_printf(m, "min_success: %u\n", hp.min_success);
+	return 0;
+}
+
+static int kvm_vcpu_halt_poll_show(struct seq_file *m, void *v)
+{
+	struct kvm_vcpu *vcpu = m->private;
+	int i;
+
+	seq_printf(m, "halt_poll_ns: %u\n", READ_ONCE(vcpu->halt_poll_ns));
+	seq_printf(m, "success_pct: %u\n",
+		   kvm_vcpu_halt_poll_success_pct(vcpu));
+	for (i = 0; i < KVM_HALT_HIST_BUCKETS; i++)
+		seq_printf(m, "%luus: %llu\n", i ? 1UL << (i - 1) : 0,
+			   READ_ONCE(vcpu->halt_hist[i]));
+	return 0;
+}
+
+/*
+ * Like the stat files, these hold a reference to the VM while open so
+ * that they cannot race with kvm_destroy_vm().
+ */
+static int kvm_halt_poll_open(struct inode *inode, struct file *file)
+{
+	struct kvm *kvm = inode->i_private;
+
+	if (!atomic_add_unless(&kvm->users_count, 1, 0))
+		return -ENOENT;
+
+	if (single_open(file, kvm_halt_poll_show, kvm)) {
+		kvm_put_kvm(kvm);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int kvm_halt_poll_release(struct inode *inode, struct file *file)
+{
+	struct kvm *kvm = inode->i_private;
+
+	single_release(inode, file);
+	kvm_put_kvm(kvm);
+
+	return 0;
+}
+
+static const struct file_operations kvm_halt_poll_fops = {
+	.owner   = THIS_MODULE,
+	.open    = kvm_halt_poll_open,
+	.release = kvm_halt_poll_release,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+};
+
+static int kvm_vcpu_halt_poll_open(struct inode *inode, struct file *file)
+{
+	struct kvm_vcpu *vcpu = inode->i_private;
+
+	if (!atomic_add_unless(&vcpu->kvm->users_count, 1, 0))
+		return -ENOENT;
+
+	if (single_open(file, kvm_vcpu_halt_poll_show, vcpu)) {
+		kvm_put_kvm(vcpu->kvm);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int kvm_vcpu_halt_poll_release(struct inode *inode, struct file *file)
+{
+	struct kvm_vcpu *vcpu = inode->i_private;
+
+	single_release(inode, file);
+	kvm_put_kvm(vcpu->kvm);
+
+	return 0;
+}
+
+static const struct file_operations kvm_vcpu_halt_poll_fops = {
+	.owner   = THIS_MODULE,
+	.open    = kvm_vcpu_halt_poll_open,
+	.release = kvm_vcpu_halt_poll_release,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+};
+
 static void kvm_destroy_vm_debugfs(struct kvm *kvm)
 {
 	int i;
@@ -569,6 +733,10 @@ static int kvm_create_vm_debugfs(struct kvm *kvm, int fd)
 					 stat_fops_per_vm[p->kind]))
 			return -ENOMEM;
 	}
+
+	if (!debugfs_create_file("halt_poll", 0444, kvm->debugfs_dentry,
+				 kvm, &kvm_halt_poll_fops))
+		return -ENOMEM;
 	return 0;
 }
 
@@ -580,7 +748,7 @@ static struct kvm *kvm_create_vm(unsigned long type)
 	if (!kvm)
 		return ERR_PTR(-ENOMEM);
 
-	spin_lock_init(&kvm->mmu_lock);
+	KVM_MMU_LOCK_INIT(kvm);
 	atomic_inc(&current->mm->mm_count);
 	kvm->mm = current->mm;
 	kvm_eventfd_init(kvm);
@@ -895,6 +1063,7 @@ int __kvm_set_memory_region(struct kvm *kvm,
 	new = old = *slot;
 
 	new.id = id;
+	new.as_id = as_id;
 	new.base_gfn = base_gfn;
 	new.npages = npages;
 	new.flags = mem->flags;
@@ -951,8 +1120,12 @@ int __kvm_set_memory_region(struct kvm *kvm,
 			goto out_free;
 	}
 
-	/* Allocate page dirty bitmap if needed */
-	if ((new.flags & KVM_MEM_LOG_DIRTY_PAGES) && !new.dirty_bitmap) {
+	/*
+	 * Allocate page dirty bitmap if needed.  With dirty rings the dirty
+	 * pages are pushed to the vcpu rings instead.
+	 */
+	if ((new.flags & KVM_MEM_LOG_DIRTY_PAGES) && !new.dirty_bitmap &&
+	    !kvm->dirty_ring_size) {
 		if (kvm_create_dirty_bitmap(&new) < 0)
 			goto out_free;
 	}
@@ -1142,7 +1315,7 @@ int kvm_get_dirty_log_protect(struct kvm *kvm,
 	dirty_bitmap_buffer = dirty_bitmap + n / sizeof(long);
 	memset(dirty_bitmap_buffer, 0, n);
 
-	spin_lock(&kvm->mmu_lock);
+	KVM_MMU_LOCK(kvm);
 	*is_dirty = false;
 	for (i = 0; i < n / sizeof(long); i++) {
 		unsigned long mask;
@@ -1163,7 +1336,7 @@ int kvm_get_dirty_log_protect(struct kvm *kvm,
 		}
 	}
 
-	spin_unlock(&kvm->mmu_lock);
+	KVM_MMU_UNLOCK(kvm);
 
 	r = -EFAULT;
 	if (copy_to_user(log->dirty_bitmap, dirty_bitmap_buffer, n))
@@ -1811,7 +1984,8 @@ int kvm_vcpu_read_guest_atomic(struct kvm_vcpu *vcpu, gpa_t gpa,
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_read_guest_atomic);
 
-static int __kvm_write_guest_page(struct kvm_memory_slot *memslot, gfn_t gfn,
+static int __kvm_write_guest_page(struct kvm *kvm,
+				  struct kvm_memory_slot *memslot, gfn_t gfn,
 			          const void *data, int offset, int len)
 {
 	int r;
@@ -1823,7 +1997,7 @@ static int __kvm_write_guest_page(struct kvm_memory_slot *memslot, gfn_t gfn,
 	r = __copy_to_user((void __user *)addr + offset, data, len);
 	if (r)
 		return -EFAULT;
-	mark_page_dirty_in_slot(memslot, gfn);
+	mark_page_dirty_in_slot(kvm, memslot, gfn);
 	return 0;
 }
 
@@ -1832,7 +2006,7 @@ int kvm_write_guest_page(struct kvm *kvm, gfn_t gfn,
 {
 	struct kvm_memory_slot *slot = gfn_to_memslot(kvm, gfn);
 
-	return __kvm_write_guest_page(slot, gfn, data, offset, len);
+	return __kvm_write_guest_page(kvm, slot, gfn, data, offset, len);
 }
 EXPORT_SYMBOL_GPL(kvm_write_guest_page);
 
@@ -1841,7 +2015,7 @@ int kvm_vcpu_write_guest_page(struct kvm_vcpu *vcpu, gfn_t gfn,
 {
 	struct kvm_memory_slot *slot = kvm_vcpu_gfn_to_memslot(vcpu, gfn);
 
-	return __kvm_write_guest_page(slot, gfn, data, offset, len);
+	return __kvm_write_guest_page(vcpu->kvm, slot, gfn, data, offset, len);
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_write_guest_page);
 
@@ -1944,7 +2118,7 @@ int kvm_write_guest_cached(struct kvm *kvm, struct gfn_to_hva_cache *ghc,
 	r = __copy_to_user((void __user *)ghc->hva, data, len);
 	if (r)
 		return -EFAULT;
-	mark_page_dirty_in_slot(ghc->memslot, ghc->gpa >> PAGE_SHIFT);
+	mark_page_dirty_in_slot(kvm, ghc->memslot, ghc->gpa >> PAGE_SHIFT);
 
 	return 0;
 }
@@ -2002,12 +2176,32 @@ int kvm_clear_guest(struct kvm *kvm, gpa_t gpa, unsigned long len)
 }
 EXPORT_SYMBOL_GPL(kvm_clear_guest);
 
-static void mark_page_dirty_in_slot(struct kvm_memory_slot *memslot,
+static void mark_page_dirty_in_slot(struct kvm *kvm,
+				    struct kvm_memory_slot *memslot,
 				    gfn_t gfn)
 {
-	if (memslot && memslot->dirty_bitmap) {
-		unsigned long rel_gfn = gfn - memslot->base_gfn;
+	struct kvm_vcpu *vcpu;
+	unsigned long rel_gfn;
+
+	if (!memslot)
+		return;
 
+	rel_gfn = gfn - memslot->base_gfn;
+
+	if (kvm->dirty_ring_size) {
+		if (!(memslot->flags & KVM_MEM_LOG_DIRTY_PAGES))
+			return;
+		/*
+		 * Pages are pushed to the ring of the vcpu that dirtied
+		 * them; there is no ring to push to outside vcpu context.
+		 */
+		vcpu = kvm_get_running_vcpu();
+		if (WARN_ON_ONCE(!vcpu || vcpu->kvm != kvm))
+			return;
+		kvm_dirty_ring_push(&vcpu->dirty_ring,
+				    (memslot->as_id << 16) | memslot->id,
+				    rel_gfn);
+	} else if (memslot->dirty_bitmap) {
 		set_bit_le(rel_gfn, memslot->dirty_bitmap);
 	}
 }
@@ -2017,7 +2211,7 @@ void mark_page_dirty(struct kvm *kvm, gfn_t gfn)
 	struct kvm_memory_slot *memslot;
 
 	memslot = gfn_to_memslot(kvm, gfn);
-	mark_page_dirty_in_slot(memslot, gfn);
+	mark_page_dirty_in_slot(kvm, memslot, gfn);
 }
 EXPORT_SYMBOL_GPL(mark_page_dirty);
 
@@ -2026,35 +2220,67 @@ void kvm_vcpu_mark_page_dirty(struct kvm_vcpu *vcpu, gfn_t gfn)
 	struct kvm_memory_slot *memslot;
 
 	memslot = kvm_vcpu_gfn_to_memslot(vcpu, gfn);
-	mark_page_dirty_in_slot(memslot, gfn);
+	mark_page_dirty_in_slot(vcpu->kvm, memslot, gfn);
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_mark_page_dirty);
 
-static void grow_halt_poll_ns(struct kvm_vcpu *vcpu)
+/*
+ * Polling burns host CPU for nothing when most halts last longer than
+ * the poll window, so only poll while enough recent halts did not.
+ */
+static bool kvm_vcpu_halt_poll_worthwhile(struct kvm_vcpu *vcpu,
+					  struct kvm_halt_poll *hp)
+{
+	return kvm_vcpu_halt_poll_success_pct(vcpu) >= hp->min_success;
+}
+
+static void kvm_vcpu_account_halt(struct kvm_vcpu *vcpu,
+				  struct kvm_halt_poll *hp, u64 block_ns)
+{
+	unsigned int avg = vcpu->halt_poll_success_avg;
+	int bucket = 0;
+
+	/*
+	 * Count the halt as a success if polling for the whole window would
+	 * have caught the wakeup, whether or not this halt actually polled;
+	 * that way a vcpu that stopped polling can start again.
+	 */
+	avg -= avg >> KVM_HALT_POLL_AVG_SHIFT;
+	if (block_ns <= hp->max_ns)
+		avg += KVM_HALT_POLL_AVG_ONE >> KVM_HALT_POLL_AVG_SHIFT;
+	vcpu->halt_poll_success_avg = avg;
+
+	if (block_ns >= NSEC_PER_USEC)
+		bucket = min_t(int, ilog2(div_u64(block_ns, NSEC_PER_USEC)) + 1,
+			       KVM_HALT_HIST_BUCKETS - 1);
+	vcpu->halt_hist[bucket]++;
+}
+
+static void grow_halt_poll_ns(struct kvm_vcpu *vcpu, struct kvm_halt_poll *hp)
 {
 	unsigned int old, val, grow;
 
 	old = val = vcpu->halt_poll_ns;
-	grow = READ_ONCE(halt_poll_ns_grow);
+	grow = hp->grow;
 	/* 10us base */
 	if (val == 0 && grow)
 		val = 10000;
 	else
 		val *= grow;
 
-	if (val > halt_poll_ns)
-		val = halt_poll_ns;
+	if (val > hp->max_ns)
+		val = hp->max_ns;
 
 	vcpu->halt_poll_ns = val;
 	trace_kvm_halt_poll_ns_grow(vcpu->vcpu_id, val, old);
 }
 
-static void shrink_halt_poll_ns(struct kvm_vcpu *vcpu)
+static void shrink_halt_poll_ns(struct kvm_vcpu *vcpu, struct kvm_halt_poll *hp)
 {
 	unsigned int old, val, shrink;
 
 	old = val = vcpu->halt_poll_ns;
-	shrink = READ_ONCE(halt_poll_ns_shrink);
+	shrink = hp->shrink;
 	if (shrink == 0)
 		val = 0;
 	else
@@ -2086,10 +2312,13 @@ void kvm_vcpu_block(struct kvm_vcpu *vcpu)
 	ktime_t start, cur;
 	DEFINE_WAIT(wait);
 	bool waited = false;
+	struct kvm_halt_poll hp;
 	u64 block_ns;
 
+	kvm_get_halt_poll(vcpu->kvm, &hp);
+
 	start = cur = ktime_get();
-	if (vcpu->halt_poll_ns) {
+	if (vcpu->halt_poll_ns && kvm_vcpu_halt_poll_worthwhile(vcpu, &hp)) {
 		ktime_t stop = ktime_add_ns(ktime_get(), vcpu->halt_poll_ns);
 
 		++vcpu->stat.halt_attempted_poll;
@@ -2124,17 +2353,18 @@ void kvm_vcpu_block(struct kvm_vcpu *vcpu)
 	kvm_arch_vcpu_unblocking(vcpu);
 out:
 	block_ns = ktime_to_ns(cur) - ktime_to_ns(start);
+	kvm_vcpu_account_halt(vcpu, &hp, block_ns);
 
-	if (halt_poll_ns) {
+	if (hp.max_ns) {
 		if (block_ns <= vcpu->halt_poll_ns)
 			;
 		/* we had a long block, shrink polling */
-		else if (vcpu->halt_poll_ns && block_ns > halt_poll_ns)
-			shrink_halt_poll_ns(vcpu);
+		else if (vcpu->halt_poll_ns && block_ns > hp.max_ns)
+			shrink_halt_poll_ns(vcpu, &hp);
 		/* we had a short halt and our poll time is too small */
-		else if (vcpu->halt_poll_ns < halt_poll_ns &&
-			block_ns < halt_poll_ns)
-			grow_halt_poll_ns(vcpu);
+		else if (vcpu->halt_poll_ns < hp.max_ns &&
+			block_ns < hp.max_ns)
+			grow_halt_poll_ns(vcpu, &hp);
 	} else
 		vcpu->halt_poll_ns = 0;
 
@@ -2285,6 +2515,17 @@ void kvm_vcpu_on_spin(struct kvm_vcpu *me)
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_on_spin);
 
+static bool kvm_page_in_dirty_ring(struct kvm *kvm, unsigned long pgoff)
+{
+#if KVM_DIRTY_LOG_PAGE_OFFSET > 0
+	return (pgoff >= KVM_DIRTY_LOG_PAGE_OFFSET) &&
+	    (pgoff < KVM_DIRTY_LOG_PAGE_OFFSET +
+	     kvm->dirty_ring_size / PAGE_SIZE);
+#else
+	return false;
+#endif
+}
+
 static int kvm_vcpu_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
 	struct kvm_vcpu *vcpu = vma->vm_file->private_data;
@@ -2300,6 +2541,10 @@ static int kvm_vcpu_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	else if (vmf->pgoff == KVM_COALESCED_MMIO_PAGE_OFFSET)
 		page = virt_to_page(vcpu->kvm->coalesced_mmio_ring);
 #endif
+	else if (kvm_page_in_dirty_ring(vcpu->kvm, vmf->pgoff))
+		page = kvm_dirty_ring_get_page(
+		    &vcpu->dirty_ring,
+		    vmf->pgoff - KVM_DIRTY_LOG_PAGE_OFFSET);
 	else
 		return kvm_arch_vcpu_fault(vcpu, vmf);
 	get_page(page);
@@ -2313,6 +2558,15 @@ static const struct vm_operations_struct kvm_vcpu_vm_ops = {
 
 static int kvm_vcpu_mmap(struct file *file, struct vm_area_struct *vma)
 {
+	struct kvm_vcpu *vcpu = file->private_data;
+	unsigned long pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+
+	/* The dirty ring is shared with the kernel and never executable */
+	if ((kvm_page_in_dirty_ring(vcpu->kvm, vma->vm_pgoff) ||
+	     kvm_page_in_dirty_ring(vcpu->kvm, vma->vm_pgoff + pages - 1)) &&
+	    ((vma->vm_flags & VM_EXEC) || !(vma->vm_flags & VM_SHARED)))
+		return -EINVAL;
+
 	vma->vm_ops = &kvm_vcpu_vm_ops;
 	return 0;
 }
@@ -2349,9 +2603,6 @@ static int kvm_create_vcpu_debugfs(struct kvm_vcpu *vcpu)
 	char dir_name[ITOA_MAX_LEN * 2];
 	int ret;
 
-	if (!kvm_arch_has_vcpu_debugfs())
-		return 0;
-
 	if (!debugfs_initialized())
 		return 0;
 
@@ -2361,13 +2612,22 @@ static int kvm_create_vcpu_debugfs(struct kvm_vcpu *vcpu)
 	if (!vcpu->debugfs_dentry)
 		return -ENOMEM;
 
-	ret = kvm_arch_create_vcpu_debugfs(vcpu);
-	if (ret < 0) {
-		debugfs_remove_recursive(vcpu->debugfs_dentry);
-		return ret;
+	ret = -ENOMEM;
+	if (!debugfs_create_file("halt_poll", 0444, vcpu->debugfs_dentry,
+				 vcpu, &kvm_vcpu_halt_poll_fops))
+		goto out_remove;
+
+	if (kvm_arch_has_vcpu_debugfs()) {
+		ret = kvm_arch_create_vcpu_debugfs(vcpu);
+		if (ret < 0)
+			goto out_remove;
 	}
 
 	return 0;
+
+out_remove:
+	debugfs_remove_recursive(vcpu->debugfs_dentry);
+	return ret;
 }
 
 /*
@@ -2404,6 +2664,11 @@ static int kvm_vm_ioctl_create_vcpu(struct kvm *kvm, u32 id)
 		r = -EINVAL;
 		goto unlock_vcpu_destroy;
 	}
+	/* The dirty ring was enabled while this vcpu was being created */
+	if (kvm->dirty_ring_size && !vcpu->dirty_ring.dirty_gfns) {
+		r = -EINVAL;
+		goto unlock_vcpu_destroy;
+	}
 
 	kvm_for_each_vcpu(r, v, kvm)
 		if (v->vcpu_id == id) {
@@ -2861,12 +3126,102 @@ static long kvm_vm_ioctl_check_extension_generic(struct kvm *kvm, long arg)
 #endif
 	case KVM_CAP_MAX_VCPU_ID:
 		return KVM_MAX_VCPU_ID;
+	case KVM_CAP_HALT_POLL:
+		return 1;
+#ifdef KVM_COALESCED_MMIO_PAGE_OFFSET
+	case KVM_CAP_COALESCED_PIO:
+		return 1;
+#endif
+	case KVM_CAP_DIRTY_LOG_RING:
+#if KVM_DIRTY_LOG_PAGE_OFFSET > 0
+		return KVM_DIRTY_RING_MAX_ENTRIES * sizeof(struct kvm_dirty_gfn);
+#else
+		return 0;
+#endif
 	default:
 		break;
 	}
 	return kvm_vm_ioctl_check_extension(kvm, arg);
 }
 
+static int kvm_vm_ioctl_enable_dirty_log_ring(struct kvm *kvm, u32 size)
+{
+	int r;
+
+	if (!KVM_DIRTY_LOG_PAGE_OFFSET)
+		return -EINVAL;
+
+	/* the size should be power of 2 */
+	if (!size || (size & (size - 1)))
+		return -EINVAL;
+
+	/* Should be bigger to keep the reserved entries, or a page */
+	if (size < kvm_dirty_ring_get_rsvd_entries() *
+	    sizeof(struct kvm_dirty_gfn) || size < PAGE_SIZE)
+		return -EINVAL;
+
+	if (size > KVM_DIRTY_RING_MAX_ENTRIES *
+	    sizeof(struct kvm_dirty_gfn))
+		return -E2BIG;
+
+	mutex_lock(&kvm->lock);
+
+	/* We only allow it to set once, and before any vcpu exists */
+	if (kvm->dirty_ring_size || atomic_read(&kvm->online_vcpus))
+		r = -EINVAL;
+	else {
+		kvm->dirty_ring_size = size;
+		r = 0;
+	}
+
+	mutex_unlock(&kvm->lock);
+	return r;
+}
+
+/*
+ * KVM_CAP_HALT_POLL replaces the halt_poll_ns module parameter for this VM
+ * with args[0]. Growing, shrinking and the success threshold keep following
+ * the halt_poll_ns_grow, halt_poll_ns_shrink and halt_poll_min_success
+ * module parameters.
+ */
+static int kvm_vm_ioctl_enable_halt_poll(struct kvm *kvm,
+					 struct kvm_enable_cap *cap)
+{
+	if (cap->args[0] > UINT_MAX)
+		return -EINVAL;
+
+	mutex_lock(&kvm->lock);
+	WRITE_ONCE(kvm->max_halt_poll_ns, cap->args[0]);
+	/* Pairs with the smp_rmb in kvm_get_halt_poll() */
+	smp_wmb();
+	WRITE_ONCE(kvm->override_halt_poll_ns, true);
+	mutex_unlock(&kvm->lock);
+
+	return 0;
+}
+
+static int kvm_vm_ioctl_reset_dirty_pages(struct kvm *kvm)
+{
+	struct kvm_vcpu *vcpu;
+	int i, cleared = 0;
+
+	if (!kvm->dirty_ring_size)
+		return -EINVAL;
+
+	mutex_lock(&kvm->slots_lock);
+
+	kvm_for_each_vcpu(i, vcpu, kvm)
+		cleared += kvm_dirty_ring_reset(kvm, &vcpu->dirty_ring);
+
+	mutex_unlock(&kvm->slots_lock);
+
+	/* Writes after this point fault and are pushed to the rings again */
+	if (cleared)
+		kvm_flush_remote_tlbs(kvm);
+
+	return cleared;
+}
+
 static long kvm_vm_ioctl(struct file *filp,
 			   unsigned int ioctl, unsigned long arg)
 {
@@ -2894,12 +3249,39 @@ static long kvm_vm_ioctl(struct file *filp,
 	case KVM_GET_DIRTY_LOG: {
 		struct kvm_dirty_log log;
 
+		r = -ENXIO;
+		if (kvm->dirty_ring_size)
+			goto out;
 		r = -EFAULT;
 		if (copy_from_user(&log, argp, sizeof(log)))
 			goto out;
 		r = kvm_vm_ioctl_get_dirty_log(kvm, &log);
 		break;
 	}
+	case KVM_RESET_DIRTY_RINGS:
+		r = kvm_vm_ioctl_reset_dirty_pages(kvm);
+		break;
+	case KVM_ENABLE_CAP: {
+		struct kvm_enable_cap cap;
+
+		r = -EFAULT;
+		if (copy_from_user(&cap, argp, sizeof(cap)))
+			goto out;
+		/* Everything but the generic caps is handled by the arch */
+		if (cap.cap != KVM_CAP_DIRTY_LOG_RING &&
+		    cap.cap != KVM_CAP_HALT_POLL) {
+			r = kvm_arch_vm_ioctl(filp, ioctl, arg);
+			break;
+		}
+		r = -EINVAL;
+		if (cap.flags)
+			goto out;
+		if (cap.cap == KVM_CAP_DIRTY_LOG_RING)
+			r = kvm_vm_ioctl_enable_dirty_log_ring(kvm, cap.args[0]);
+		else
+			r = kvm_vm_ioctl_enable_halt_poll(kvm, &cap);
+		break;
+	}
 #ifdef KVM_COALESCED_MMIO_PAGE_OFFSET
 	case KVM_REGISTER_COALESCED_MMIO: {
 		struct kvm_coalesced_mmio_zone zone;
@@ -3759,6 +4141,7 @@ static void kvm_sched_in(struct preempt_notifier *pn, int cpu)
 	if (vcpu->preempted)
 		vcpu->preempted = false;
 
+	__this_cpu_write(kvm_running_vcpu, vcpu);
 	kvm_arch_sched_in(vcpu, cpu);
 
 	kvm_arch_vcpu_load(vcpu, cpu);
@@ -3772,6 +4155,7 @@ static void kvm_sched_out(struct preempt_notifier *pn,
 	if (current->state == TASK_RUNNING)
 		vcpu->preempted = true;
 	kvm_arch_vcpu_put(vcpu);
+	__this_cpu_write(kvm_running_vcpu, NULL);
 }
 
 int kvm_init(void *opaque, unsigned vcpu_size, unsigned vcpu_align,
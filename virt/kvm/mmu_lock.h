@@ -0,0 +1,20 @@
+#ifndef __KVM_MMU_LOCK_H__
+#define __KVM_MMU_LOCK_H__
+
+/*
+ * Architectures can choose whether kvm->mmu_lock is an rwlock or a
+ * spinlock.  Common code only ever takes it exclusively, through these
+ * macros, so that it does not need to care which one it is.
+ */
+
+#ifdef KVM_HAVE_MMU_RWLOCK
+#define KVM_MMU_LOCK_INIT(kvm)		rwlock_init(&(kvm)->mmu_lock)
+#define KVM_MMU_LOCK(kvm)		write_lock(&(kvm)->mmu_lock)
+#define KVM_MMU_UNLOCK(kvm)		write_unlock(&(kvm)->mmu_lock)
+#else
+#define KVM_MMU_LOCK_INIT(kvm)		spin_lock_init(&(kvm)->mmu_lock)
+#define KVM_MMU_LOCK(kvm)		spin_lock(&(kvm)->mmu_lock)
+#define KVM_MMU_UNLOCK(kvm)		spin_unlock(&(kvm)->mmu_lock)
+#endif /* KVM_HAVE_MMU_RWLOCK */
+
+#endif /* __KVM_MMU_LOCK_H__ */